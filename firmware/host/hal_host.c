@@ -0,0 +1,194 @@
+// Linux implementation of hal.h for the simulator.
+//
+// - I2S: a WAV file played as a live microphone. Samples become available at
+//   the configured sample rate from simulator start; a reader that falls behind by more than
+//   the DMA ring loses the oldest audio, exactly like the real driver.
+// - GPIO: a button script of "<ms> press|release" lines on the same timeline.
+// - Network: plain BSD sockets (protocol.c is shared with the firmware).
+
+#include "hal_host.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "hal.h"
+#include "host_clock.h"
+#include "wav.h"
+
+static const char *TAG = "hal";
+
+// Mirror of the firmware DMA configuration (DMA_BUF_COUNT * DMA_BUF_LEN)
+#define DMA_RING_SAMPLES (4 * 256)
+
+#define MAX_BUTTON_EVENTS 256
+
+typedef struct {
+    int64_t at_us;
+    bool pressed;
+} button_event_t;
+
+static uint32_t sample_rate = 16000;
+static int16_t *wav_samples;
+static size_t wav_len;
+static int64_t stream_pos;  // next sample index handed to the reader
+
+static button_event_t button_events[MAX_BUTTON_EVENTS];
+static int button_event_count;
+
+static int wifi_rssi = -50;
+static const char *server_ip = "127.0.0.1";
+static uint16_t server_port = 12345;
+
+// ---------------------------------------------------------------------------
+// WAV-backed I2S
+// ---------------------------------------------------------------------------
+bool hal_host_load_wav(const char *path)
+{
+    uint32_t rate;
+    wav_samples = wav_read_mono16(path, &rate, &wav_len);
+    if (!wav_samples) {
+        return false;
+    }
+    if (rate != sample_rate) {
+        ESP_LOGE(TAG, "%s: need %u Hz audio, got %u Hz", path,
+                 (unsigned)sample_rate, (unsigned)rate);
+        free(wav_samples);
+        wav_samples = NULL;
+        return false;
+    }
+    ESP_LOGI(TAG, "Loaded %s (%.2fs)", path, (double)wav_len / sample_rate);
+    return true;
+}
+
+bool hal_audio_read(int32_t *raw, size_t samples)
+{
+    int64_t now_samples = esp_timer_get_time() * sample_rate / 1000000;
+
+    // Overrun: the driver keeps only the newest DMA_RING_SAMPLES
+    if (now_samples - stream_pos > DMA_RING_SAMPLES) {
+        stream_pos = now_samples - DMA_RING_SAMPLES;
+    }
+
+    // Block until the requested samples have been "captured"
+    int64_t ready_at_us = (stream_pos + (int64_t)samples) * 1000000 / sample_rate;
+    host_sleep_until_us(ready_at_us);
+
+    for (size_t i = 0; i < samples; i++) {
+        int64_t pos = stream_pos + (int64_t)i;
+        int16_t s = (pos < (int64_t)wav_len) ? wav_samples[pos] : 0;
+        raw[i] = (int32_t)s << 16;  // left-justified like the INMP441
+    }
+    stream_pos += samples;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Scripted button
+// ---------------------------------------------------------------------------
+bool hal_host_load_button_script(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        ESP_LOGE(TAG, "Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    char line[128];
+    int lineno = 0;
+    int64_t prev_us = -1;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        long long ms;
+        char action[16];
+        int n = sscanf(line, "%lld %15s", &ms, action);
+        if (n <= 0) {
+            continue;  // blank or comment
+        }
+        if (n != 2 || (strcmp(action, "press") != 0 && strcmp(action, "release") != 0)) {
+            ESP_LOGE(TAG, "%s:%d: expected \"<ms> press|release\"", path, lineno);
+            fclose(f);
+            return false;
+        }
+        if (button_event_count == MAX_BUTTON_EVENTS || ms * 1000 < prev_us) {
+            ESP_LOGE(TAG, "%s:%d: too many or out-of-order events", path, lineno);
+            fclose(f);
+            return false;
+        }
+        button_events[button_event_count].at_us = ms * 1000;
+        button_events[button_event_count].pressed = (action[0] == 'p');
+        prev_us = ms * 1000;
+        button_event_count++;
+    }
+
+    fclose(f);
+    return true;
+}
+
+bool hal_button_raw(void)
+{
+    int64_t now = esp_timer_get_time();
+    bool pressed = false;
+    for (int i = 0; i < button_event_count && button_events[i].at_us <= now; i++) {
+        pressed = button_events[i].pressed;
+    }
+    return pressed;
+}
+
+int64_t hal_host_wav_end_us(void)
+{
+    return (int64_t)wav_len * 1000000 / sample_rate;
+}
+
+int64_t hal_host_script_end_us(void)
+{
+    return button_event_count ? button_events[button_event_count - 1].at_us : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Misc
+// ---------------------------------------------------------------------------
+void hal_host_init(const char *ip, uint16_t port, uint32_t rate)
+{
+    host_clock_start();
+    server_ip = ip;
+    server_port = port;
+    sample_rate = rate;
+}
+
+void hal_host_set_rssi(int rssi)
+{
+    wifi_rssi = rssi;
+}
+
+int hal_wifi_rssi(void)
+{
+    return wifi_rssi;
+}
+
+void hal_delay_ms(uint32_t ms)
+{
+    struct timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (long)(ms % 1000) * 1000000,
+    };
+    nanosleep(&ts, NULL);
+}
+
+const char *hal_server_ip(void)
+{
+    return server_ip;
+}
+
+uint16_t hal_server_port(void)
+{
+    return server_port;
+}
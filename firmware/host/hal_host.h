@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Simulator-only setup for hal_host.c
+
+// Start the simulated clock and set the server address and mic sample rate.
+void hal_host_init(const char *ip, uint16_t port, uint32_t sample_rate);
+
+// Load a 16-bit mono WAV at the mic sample rate as the microphone signal.
+bool hal_host_load_wav(const char *path);
+
+// Load a button script: one "<ms> press|release" per line, '#' comments.
+bool hal_host_load_button_script(const char *path);
+
+// RSSI reported to the uplink codec selection (dBm).
+void hal_host_set_rssi(int rssi);
+
+// Time of the last scripted button event (microseconds).
+int64_t hal_host_script_end_us(void);
+
+// Time at which the microphone WAV has played out (microseconds).
+int64_t hal_host_wav_end_us(void);
@@ -0,0 +1,48 @@
+#include "host_clock.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static struct timespec start_ts;
+
+void host_clock_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start_ts.tv_sec) * 1000000 +
+           (now.tv_nsec - start_ts.tv_nsec) / 1000;
+}
+
+void host_sleep_until_us(int64_t t_us)
+{
+    struct timespec ts = start_ts;
+    ts.tv_sec += t_us / 1000000;
+    ts.tv_nsec += (t_us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+void host_log(char level, const char *tag, const char *fmt, ...)
+{
+    int64_t now = esp_timer_get_time();
+    fprintf(stderr, "%c (%lld.%03lld) %s: ", level,
+            (long long)(now / 1000000), (long long)(now / 1000 % 1000), tag);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
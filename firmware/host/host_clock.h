@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+// Simulated-time base for the host tools. esp_timer_get_time() and the
+// esp_log.h timestamps count from host_clock_start().
+
+void host_clock_start(void);
+
+// Sleep until *t_us* microseconds after host_clock_start().
+void host_sleep_until_us(int64_t t_us);
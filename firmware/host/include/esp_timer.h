@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Host stand-in for esp_timer: monotonic microseconds since simulator start.
+int64_t esp_timer_get_time(void);
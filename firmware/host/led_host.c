@@ -0,0 +1,35 @@
+// Host implementation of led.h: log animation changes instead of driving PWM.
+
+#include "led.h"
+
+#include "esp_log.h"
+
+static const char *TAG = "led";
+
+static const char *const anim_names[] = {
+    [LED_ANIM_OFF] = "off",
+    [LED_ANIM_SOLID] = "solid",
+    [LED_ANIM_BLINK] = "blink",
+    [LED_ANIM_BREATHE] = "breathe",
+    [LED_ANIM_ERROR_FLASH] = "error-flash",
+};
+
+static const char *const color_names[] = {
+    [LED_COLOR_RED] = "red",
+    [LED_COLOR_GREEN] = "green",
+    [LED_COLOR_BLUE] = "blue",
+};
+
+void led_init(void)
+{
+}
+
+void led_play(led_anim_t anim, led_color_t color)
+{
+    ESP_LOGI(TAG, "%s %s", anim_names[anim], color_names[color]);
+}
+
+void led_set_brightness(uint8_t percent)
+{
+    ESP_LOGI(TAG, "brightness %d%%", percent);
+}
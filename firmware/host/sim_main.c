@@ -0,0 +1,184 @@
+// Linux simulator: runs the firmware state machine (app.c) against a real
+// server.py, with the microphone and button replaced by a WAV file and a
+// button script.
+//
+//   kenta_sim --wav speech.wav --buttons press.txt [--server 127.0.0.1]
+//             [--port 12345] [--rate 16000] [--bits 16] [--rssi -50]
+//             [--fixed-pcm] [--wake-model model.bin] [--timeout 300]
+//
+// One line per completed interaction is written to stdout:
+//   interaction=1 uplink=PCM audio_bytes=96256 stalled=0 wait_ms=3001.2 server_ms=845.7
+// with " erle_db=..." appended when the server streamed an echo reference and
+// " trigger=wake" when the wake word started it, " endpoint=server" when the
+// server ended the recording, and " early=1" when the server released the
+// device as playback started. With --wake-model the
+// simulator also listens for the keyword (see host/kenta_wake) and runs
+// until the WAV has played out.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "app.h"
+#include "hal_host.h"
+#include "protocol.h"
+#include "uplink.h"
+#include "wakeword.h"
+
+static const char *TAG = "sim";
+
+// Let the last scripted edge pass debouncing before checking for idle
+#define SCRIPT_SETTLE_US (100 * 1000)
+
+#define WAKE_MODEL_MAX_BYTES (64 * 1024)
+
+static bool load_wake_model(const char *path, uint32_t rate)
+{
+    static uint8_t blob[WAKE_MODEL_MAX_BYTES];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    size_t len = fread(blob, 1, sizeof(blob), f);
+    fclose(f);
+    if (!wake_load_model(blob, len, rate)) {
+        fprintf(stderr, "%s: not a wake-word model for %u Hz\n", path, (unsigned)rate);
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s --wav FILE --buttons FILE [--server IP] [--port N]\n"
+            "          [--rate HZ] [--bits 16|24] [--rssi DBM] [--fixed-pcm]\n"
+            "          [--wake-model FILE] [--timeout S]\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *wav_path = NULL;
+    const char *script_path = NULL;
+    const char *wake_model_path = NULL;
+    const char *server_ip = "127.0.0.1";
+    int port = 12345;
+    int timeout_s = 300;
+    int rssi = -50;
+    bool adaptive = true;
+    app_config_t cfg = {
+        .sample_rate = 16000,
+        .sample_bits = 16,
+    };
+
+    static const struct option opts[] = {
+        {"wav", required_argument, NULL, 'w'},
+        {"buttons", required_argument, NULL, 'b'},
+        {"server", required_argument, NULL, 's'},
+        {"port", required_argument, NULL, 'p'},
+        {"rate", required_argument, NULL, 'r'},
+        {"bits", required_argument, NULL, 'B'},
+        {"rssi", required_argument, NULL, 'R'},
+        {"fixed-pcm", no_argument, NULL, 'F'},
+        {"wake-model", required_argument, NULL, 'k'},
+        {"timeout", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:b:s:p:r:B:R:Fk:t:", opts, NULL)) != -1) {
+        switch (c) {
+        case 'w': wav_path = optarg; break;
+        case 'b': script_path = optarg; break;
+        case 's': server_ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'r': cfg.sample_rate = (uint32_t)atoi(optarg); break;
+        case 'B': cfg.sample_bits = (uint8_t)atoi(optarg); break;
+        case 'R': rssi = atoi(optarg); break;
+        case 'F': adaptive = false; break;
+        case 'k': wake_model_path = optarg; break;
+        case 't': timeout_s = atoi(optarg); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (!wav_path || !script_path) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!proto_format_supported(cfg.sample_rate, cfg.sample_bits)) {
+        fprintf(stderr, "unsupported format: %u Hz, %d-bit\n",
+                (unsigned)cfg.sample_rate, cfg.sample_bits);
+        return 2;
+    }
+
+    hal_host_init(server_ip, (uint16_t)port, cfg.sample_rate);
+    if (!hal_host_load_wav(wav_path) || !hal_host_load_button_script(script_path)) {
+        return 1;
+    }
+    if (wake_model_path && !load_wake_model(wake_model_path, cfg.sample_rate)) {
+        return 1;
+    }
+
+    hal_host_set_rssi(rssi);
+    uplink_init(adaptive);
+    app_init(&cfg);
+
+    int64_t script_end = hal_host_script_end_us() + SCRIPT_SETTLE_US;
+    if (wake_model_path && hal_host_wav_end_us() > script_end) {
+        script_end = hal_host_wav_end_us();
+    }
+    int64_t deadline = (int64_t)timeout_s * 1000000;
+    int64_t last_done = 0;
+    int interactions = 0;
+
+    while (1) {
+        state_t state = app_step();
+
+        const app_timing_t *t = app_last_timing();
+        if (t->done_us != last_done) {
+            last_done = t->done_us;
+            interactions++;
+            printf("interaction=%d uplink=%s audio_bytes=%u stalled=%u "
+                   "wait_ms=%.1f server_ms=%.1f",
+                   interactions, uplink_mode_name(t->uplink), t->bytes_sent,
+                   t->stalled_frames,
+                   (t->end_sent_us - t->release_us) / 1000.0,
+                   (t->done_us - t->end_sent_us) / 1000.0);
+            if (t->aec_samples > 0) {
+                printf(" erle_db=%.1f", t->aec_erle_db);
+            }
+            if (t->wake_word) {
+                printf(" trigger=wake");
+            }
+            if (t->server_endpoint) {
+                printf(" endpoint=server");
+            }
+            if (t->released_early) {
+                printf(" early=1");
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (state == STATE_IDLE && now > script_end) {
+            break;
+        }
+        if (now > deadline) {
+            ESP_LOGE(TAG, "Timeout after %ds", timeout_s);
+            return 1;
+        }
+    }
+
+    ESP_LOGI(TAG, "Script finished, %d interaction(s)", interactions);
+    if (wake_enabled()) {
+        wake_stats_t ws;
+        wake_get_stats(&ws);
+        ESP_LOGI(TAG, "Wake word: %u detection(s), %.1f us/frame avg, %u us max",
+                 (unsigned)ws.detections, ws.frames ? (double)ws.busy_us / ws.frames : 0.0,
+                 (unsigned)ws.max_frame_us);
+    }
+    return 0;
+}
@@ -0,0 +1,527 @@
+// Enrollment and evaluation tool for the firmware wake-word detector
+// (main/wakeword.c).
+//
+//   kenta_wake --enroll model.bin [--threshold T] clip1.wav clip2.wav ...
+//   kenta_wake --model model.bin --eval corpus.txt [--max-frr PCT] [--max-fa-per-hour N]
+//   kenta_wake --selftest
+//   kenta_wake --demo DIR
+//
+// --enroll builds a model blob from 16-bit mono recordings of the keyword
+// (2-4 clips). Without --threshold, the threshold is set from how far apart
+// the clips are from each other. Store the blob on the device as the
+// "wake_model" entry of the "kenta" NVS namespace.
+//
+// --eval streams every file listed in the corpus through the detector in
+// real-time-sized frames. Each corpus line is "<wav> <expected detections>",
+// paths relative to the corpus file, '#' comments. The result is printed as
+//   files=12 hours=0.52 keywords=40 detected=38 false_accepts=1
+//   frr_pct=5.0 fa_per_hour=1.9 us_per_frame=41.2 cpu_pct=0.26
+// cpu_pct is the share of real time spent in wake_process() on this host.
+//
+// --selftest enrolls a synthetic keyword and evaluates it on a synthetic
+// stream of keyword repetitions, other words and noise. --demo writes
+// DIR/model.bin and DIR/demo.wav (silence, the keyword, a short request,
+// silence) for driving kenta_sim --wake-model.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "host_clock.h"
+#include "wakeword.h"
+#include "wav.h"
+
+#define FRAME_LEN 256
+
+// Headroom over the largest distance between enrollment clips
+#define THRESHOLD_MARGIN 1.2f
+
+#define SYNTH_RATE 16000
+
+static uint32_t rng_state = 12345;
+
+static float rng_uniform(void)
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    return (float)(rng_state >> 8) / (float)(1u << 24);
+}
+
+// ---------------------------------------------------------------------------
+// Formant synthesiser for the self-test: a harmonic source shaped by two
+// resonances per segment, with unvoiced segments rendered as noise.
+// ---------------------------------------------------------------------------
+typedef struct {
+    float f1, f2;   // formants (Hz); 0 = unvoiced burst
+    int ms;
+} segment_t;
+
+// "ken-ta"
+static const segment_t KEYWORD[] = {
+    {0, 0, 40}, {550, 1850, 160}, {250, 1200, 80}, {0, 0, 40}, {750, 1250, 220},
+};
+// Other words, including ones sharing a syllable with the keyword
+static const segment_t OTHER_WORDS[][5] = {
+    {{750, 1250, 150}, {250, 1200, 70}, {300, 2300, 200}},
+    {{450, 800, 180}, {0, 0, 40}, {550, 1850, 180}},
+    {{0, 0, 40}, {750, 1250, 180}, {0, 0, 40}, {550, 1850, 160}, {250, 1200, 90}},
+    {{0, 0, 40}, {550, 1850, 160}, {250, 1200, 120}},
+    {{300, 2300, 220}, {450, 800, 240}},
+};
+#define OTHER_WORD_COUNT (sizeof(OTHER_WORDS) / sizeof(OTHER_WORDS[0]))
+
+static float resonance(float f, float formant)
+{
+    float x = (f - formant) / 90.0f;
+    return 1.0f / (1.0f + x * x);
+}
+
+// Render *count* segments at pitch *f0*, time-scaled by *stretch*, adding
+// to out[]. Returns the number of samples written.
+static size_t synth_word(int16_t *out, size_t cap, const segment_t *seg, int count,
+                         float f0, float stretch, float gain)
+{
+    size_t pos = 0;
+    float phase = 0;
+    for (int s = 0; s < count && seg[s].ms > 0; s++) {
+        size_t len = (size_t)(seg[s].ms * stretch * SYNTH_RATE / 1000);
+        for (size_t i = 0; i < len && pos < cap; i++, pos++) {
+            float v = 0;
+            if (seg[s].f1 == 0) {
+                v = (rng_uniform() - 0.5f) * 0.6f;
+            } else {
+                phase += 2.0f * 3.14159265f * f0 / SYNTH_RATE;
+                for (int h = 1; h * f0 < 4000; h++) {
+                    float f = h * f0;
+                    float amp = (resonance(f, seg[s].f1) + 0.7f * resonance(f, seg[s].f2)) / h;
+                    v += amp * sinf(h * phase);
+                }
+            }
+            // 10 ms fades at segment edges
+            float edge = (float)(i < len - i ? i : len - i) / (SYNTH_RATE / 100);
+            v *= edge < 1.0f ? edge : 1.0f;
+            float sample = out[pos] + v * gain;
+            out[pos] = (int16_t)(sample > 32767 ? 32767 : (sample < -32768 ? -32768 : sample));
+        }
+    }
+    return pos;
+}
+
+static void add_noise(int16_t *out, size_t n, float amplitude)
+{
+    for (size_t i = 0; i < n; i++) {
+        float sample = out[i] + (rng_uniform() - 0.5f) * 2.0f * amplitude;
+        out[i] = (int16_t)(sample > 32767 ? 32767 : (sample < -32768 ? -32768 : sample));
+    }
+}
+
+static size_t synth_keyword(int16_t *out, size_t cap, float f0, float stretch, float gain)
+{
+    return synth_word(out, cap, KEYWORD, sizeof(KEYWORD) / sizeof(KEYWORD[0]), f0, stretch, gain);
+}
+
+// ---------------------------------------------------------------------------
+// Enrollment
+// ---------------------------------------------------------------------------
+typedef struct {
+    float feat[WAKE_MAX_FRAMES * WAKE_MFCC_DIMS];
+    size_t frames;
+} clip_features_t;
+
+#define MODEL_MAX_BYTES \
+    (16 + WAKE_MAX_TEMPLATES * (2 + WAKE_MAX_FRAMES * WAKE_MFCC_DIMS * sizeof(float)))
+
+static uint8_t model_blob[MODEL_MAX_BYTES];
+
+// Serialise a model (format in wakeword.h) into model_blob. Returns its size.
+static size_t build_model(uint32_t rate, const clip_features_t *clips, int count, float thr)
+{
+    uint16_t n = (uint16_t)count;
+    uint16_t dims = WAKE_MFCC_DIMS;
+    memcpy(model_blob, WAKE_MODEL_MAGIC, 4);
+    memcpy(model_blob + 4, &rate, 4);
+    memcpy(model_blob + 8, &n, 2);
+    memcpy(model_blob + 10, &dims, 2);
+    memcpy(model_blob + 12, &thr, 4);
+
+    size_t len = 16;
+    for (int i = 0; i < count; i++) {
+        uint16_t frames = (uint16_t)clips[i].frames;
+        size_t bytes = clips[i].frames * WAKE_MFCC_DIMS * sizeof(float);
+        memcpy(model_blob + len, &frames, 2);
+        memcpy(model_blob + len + 2, clips[i].feat, bytes);
+        len += 2 + bytes;
+    }
+    return len;
+}
+
+static bool write_model(const char *path, uint32_t rate, const clip_features_t *clips,
+                        int count, float thr)
+{
+    size_t len = build_model(rate, clips, count, thr);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    fwrite(model_blob, 1, len, f);
+    return fclose(f) == 0;
+}
+
+// Threshold from the spread of the enrollment clips, or *thr* if positive.
+static float pick_threshold(const clip_features_t *clips, int count, float thr)
+{
+    if (thr > 0) {
+        return thr;
+    }
+    float worst = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < count; j++) {
+            if (i != j) {
+                float d = wake_dtw_distance(clips[i].feat, clips[i].frames,
+                                            clips[j].feat, clips[j].frames);
+                worst = d > worst ? d : worst;
+            }
+        }
+    }
+    return worst * THRESHOLD_MARGIN;
+}
+
+static int enroll(const char *out_path, char **clip_paths, int count, float thr)
+{
+    if (count < 2 || count > WAKE_MAX_TEMPLATES) {
+        fprintf(stderr, "need 2-%d keyword clips\n", WAKE_MAX_TEMPLATES);
+        return 2;
+    }
+
+    static clip_features_t clips[WAKE_MAX_TEMPLATES];
+    uint32_t rate = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t clip_rate;
+        size_t len;
+        int16_t *pcm = wav_read_mono16(clip_paths[i], &clip_rate, &len);
+        if (!pcm) {
+            return 1;
+        }
+        if (rate && clip_rate != rate) {
+            fprintf(stderr, "%s: all clips must share one sample rate\n", clip_paths[i]);
+            return 1;
+        }
+        rate = clip_rate;
+        clips[i].frames = wake_extract_features(pcm, len, rate, clips[i].feat, WAKE_MAX_FRAMES);
+        free(pcm);
+        if (clips[i].frames < 2) {
+            fprintf(stderr, "%s: no speech found\n", clip_paths[i]);
+            return 1;
+        }
+        if (clips[i].frames == WAKE_MAX_FRAMES) {
+            fprintf(stderr, "%s: longer than %d frames, truncated\n",
+                    clip_paths[i], WAKE_MAX_FRAMES);
+        }
+    }
+
+    thr = pick_threshold(clips, count, thr);
+    if (!write_model(out_path, rate, clips, count, thr)) {
+        return 1;
+    }
+    printf("templates=%d rate=%u threshold=%.2f\n", count, (unsigned)rate, thr);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Evaluation
+// ---------------------------------------------------------------------------
+typedef struct {
+    int files;
+    double seconds;
+    unsigned keywords;
+    unsigned detected;
+    unsigned false_accepts;
+} eval_result_t;
+
+static unsigned run_detector(const int16_t *pcm, size_t len)
+{
+    unsigned detections = 0;
+    wake_reset();
+    for (size_t pos = 0; pos < len; pos += FRAME_LEN) {
+        size_t n = len - pos < FRAME_LEN ? len - pos : FRAME_LEN;
+        detections += wake_process(pcm + pos, n);
+    }
+    return detections;
+}
+
+static void score_file(eval_result_t *r, unsigned expected, unsigned detections)
+{
+    r->files++;
+    r->keywords += expected;
+    r->detected += detections < expected ? detections : expected;
+    r->false_accepts += detections > expected ? detections - expected : 0;
+}
+
+static bool load_model_file(const char *path, uint32_t rate)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    size_t len = fread(model_blob, 1, sizeof(model_blob), f);
+    fclose(f);
+    if (!wake_load_model(model_blob, len, rate)) {
+        fprintf(stderr, "%s: not a wake-word model for %u Hz\n", path, (unsigned)rate);
+        return false;
+    }
+    return true;
+}
+
+static bool eval_corpus(const char *model_path, const char *corpus_path, eval_result_t *r)
+{
+    FILE *f = fopen(corpus_path, "r");
+    if (!f) {
+        perror(corpus_path);
+        return false;
+    }
+
+    char dir[512] = ".";
+    const char *slash = strrchr(corpus_path, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - corpus_path), corpus_path);
+    }
+
+    char line[512];
+    int lineno = 0;
+    uint32_t loaded_rate = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        char name[400];
+        unsigned expected;
+        int n = sscanf(line, "%399s %u", name, &expected);
+        if (n <= 0) {
+            continue;
+        }
+        if (n != 2) {
+            fprintf(stderr, "%s:%d: expected \"<wav> <count>\"\n", corpus_path, lineno);
+            ok = false;
+            break;
+        }
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", name[0] == '/' ? "" : dir, name);
+        uint32_t rate;
+        size_t len;
+        int16_t *pcm = wav_read_mono16(path, &rate, &len);
+        if (!pcm) {
+            ok = false;
+            break;
+        }
+        if (rate != loaded_rate) {
+            ok = load_model_file(model_path, rate);
+            loaded_rate = rate;
+        }
+        if (ok) {
+            score_file(r, expected, run_detector(pcm, len));
+            r->seconds += (double)len / rate;
+        }
+        free(pcm);
+    }
+    fclose(f);
+    return ok;
+}
+
+static void print_result(const eval_result_t *r)
+{
+    wake_stats_t st;
+    wake_get_stats(&st);
+    double hours = r->seconds / 3600.0;
+    double frr = r->keywords ? 100.0 * (r->keywords - r->detected) / r->keywords : 0;
+    double us_per_frame = st.frames ? (double)st.busy_us / st.frames : 0;
+    double frames_per_s = st.frames && r->seconds > 0 ? st.frames / r->seconds : 0;
+    printf("files=%d hours=%.2f keywords=%u detected=%u false_accepts=%u\n"
+           "frr_pct=%.1f fa_per_hour=%.1f us_per_frame=%.1f cpu_pct=%.2f\n",
+           r->files, hours, r->keywords, r->detected, r->false_accepts,
+           frr, hours > 0 ? r->false_accepts / hours : 0,
+           us_per_frame, us_per_frame * frames_per_s / 1e4);
+}
+
+// ---------------------------------------------------------------------------
+// Self-test and demo material
+// ---------------------------------------------------------------------------
+// Enrollment clips: the keyword at a few pitches, speeds and levels, as if
+// recorded a few times by the same speaker.
+static void synth_enrollment(clip_features_t *clips, int count)
+{
+    static int16_t clip[SYNTH_RATE * 2];
+    for (int i = 0; i < count; i++) {
+        memset(clip, 0, sizeof(clip));
+        size_t lead = SYNTH_RATE / 5;
+        size_t len = synth_keyword(clip + lead, SYNTH_RATE, 120.0f + 12.0f * i,
+                                   0.94f + 0.06f * i, 3000.0f * (i + 1));
+        add_noise(clip, lead + len + lead, 30.0f);
+        clips[i].frames = wake_extract_features(clip, lead + len + lead, SYNTH_RATE,
+                                                clips[i].feat, WAKE_MAX_FRAMES);
+    }
+}
+
+static int selftest(float max_frr, float max_fa_per_hour)
+{
+    enum { TEMPLATES = 3, ROUNDS = 60 };
+    static clip_features_t clips[TEMPLATES];
+    synth_enrollment(clips, TEMPLATES);
+    // Load through the blob format, like the device does
+    size_t len = build_model(SYNTH_RATE, clips, TEMPLATES, pick_threshold(clips, TEMPLATES, 0));
+    if (!wake_load_model(model_blob, len, SYNTH_RATE)) {
+        fprintf(stderr, "self-test model rejected\n");
+        return 1;
+    }
+
+    // Each round: two seconds of audio holding the keyword, another word or
+    // a noise burst, at random pitch, speed and level
+    eval_result_t r = {0};
+    static int16_t round_pcm[SYNTH_RATE * 2];
+    const size_t round_len = sizeof(round_pcm) / sizeof(round_pcm[0]);
+    for (int i = 0; i < ROUNDS; i++) {
+        memset(round_pcm, 0, sizeof(round_pcm));
+        size_t lead = SYNTH_RATE / 4 + (size_t)(rng_uniform() * SYNTH_RATE / 4);
+        float f0 = 110.0f + rng_uniform() * 45.0f;
+        float stretch = 0.88f + rng_uniform() * 0.24f;
+        float gain = 2000.0f + rng_uniform() * 8000.0f;
+        size_t cap = round_len - lead;
+
+        bool keyword = i % 2 == 0;
+        if (keyword) {
+            synth_keyword(round_pcm + lead, cap, f0, stretch, gain);
+        } else if (i % 8 == 7) {
+            add_noise(round_pcm + lead, SYNTH_RATE / 2, gain / 4);
+        } else {
+            const segment_t *word = OTHER_WORDS[(i / 2) % OTHER_WORD_COUNT];
+            synth_word(round_pcm + lead, cap, word, 5, f0, stretch, gain);
+        }
+        add_noise(round_pcm, round_len, 30.0f);
+
+        score_file(&r, keyword, run_detector(round_pcm, round_len));
+        r.seconds += (double)round_len / SYNTH_RATE;
+    }
+
+    print_result(&r);
+    double frr = 100.0 * (r.keywords - r.detected) / r.keywords;
+    double fa_per_hour = r.false_accepts / (r.seconds / 3600.0);
+    if (frr > max_frr || fa_per_hour > max_fa_per_hour) {
+        fprintf(stderr, "self-test failed: frr %.1f%% (max %.1f), fa/h %.1f (max %.1f)\n",
+                frr, max_frr, fa_per_hour, max_fa_per_hour);
+        return 1;
+    }
+    return 0;
+}
+
+static int demo(const char *dir)
+{
+    enum { TEMPLATES = 3 };
+    static clip_features_t clips[TEMPLATES];
+    synth_enrollment(clips, TEMPLATES);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/model.bin", dir);
+    if (!write_model(path, SYNTH_RATE, clips, TEMPLATES, pick_threshold(clips, TEMPLATES, 0))) {
+        return 1;
+    }
+
+    // 1 s silence, keyword, 0.3 s pause, a request, then 3 s silence
+    size_t total = SYNTH_RATE * 7;
+    int16_t *pcm = calloc(total, sizeof(int16_t));
+    size_t pos = SYNTH_RATE;
+    pos += synth_keyword(pcm + pos, total - pos, 128.0f, 1.0f, 8000.0f);
+    pos += SYNTH_RATE * 3 / 10;
+    for (int w = 0; w < 2; w++) {
+        pos += synth_word(pcm + pos, total - pos, OTHER_WORDS[w], 5, 128.0f, 1.0f, 8000.0f);
+        pos += SYNTH_RATE / 10;
+    }
+    add_noise(pcm, total, 30.0f);
+
+    snprintf(path, sizeof(path), "%s/demo.wav", dir);
+    bool ok = wav_write_mono16(path, SYNTH_RATE, pcm, total);
+    free(pcm);
+    return ok ? 0 : 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s --enroll MODEL [--threshold T] CLIP.wav...\n"
+            "       %s --model MODEL --eval CORPUS [--max-frr PCT] [--max-fa-per-hour N]\n"
+            "       %s --selftest [--max-frr PCT] [--max-fa-per-hour N]\n"
+            "       %s --demo DIR\n",
+            prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *enroll_path = NULL;
+    const char *model_path = NULL;
+    const char *corpus_path = NULL;
+    const char *demo_dir = NULL;
+    bool run_selftest = false;
+    float thr = 0;
+    float max_frr = 10.0f;
+    float max_fa_per_hour = 20.0f;
+
+    static const struct option opts[] = {
+        {"enroll", required_argument, NULL, 'E'},
+        {"threshold", required_argument, NULL, 'T'},
+        {"model", required_argument, NULL, 'm'},
+        {"eval", required_argument, NULL, 'e'},
+        {"max-frr", required_argument, NULL, 'f'},
+        {"max-fa-per-hour", required_argument, NULL, 'a'},
+        {"selftest", no_argument, NULL, 'S'},
+        {"demo", required_argument, NULL, 'D'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "E:T:m:e:f:a:SD:", opts, NULL)) != -1) {
+        switch (c) {
+        case 'E': enroll_path = optarg; break;
+        case 'T': thr = strtof(optarg, NULL); break;
+        case 'm': model_path = optarg; break;
+        case 'e': corpus_path = optarg; break;
+        case 'f': max_frr = strtof(optarg, NULL); break;
+        case 'a': max_fa_per_hour = strtof(optarg, NULL); break;
+        case 'S': run_selftest = true; break;
+        case 'D': demo_dir = optarg; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+
+    host_clock_start();
+
+    if (enroll_path) {
+        return enroll(enroll_path, argv + optind, argc - optind, thr);
+    }
+    if (run_selftest) {
+        return selftest(max_frr, max_fa_per_hour);
+    }
+    if (demo_dir) {
+        return demo(demo_dir);
+    }
+    if (!model_path || !corpus_path) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    eval_result_t r = {0};
+    if (!eval_corpus(model_path, corpus_path, &r)) {
+        return 1;
+    }
+    print_result(&r);
+
+    double hours = r.seconds / 3600.0;
+    double frr = r.keywords ? 100.0 * (r.keywords - r.detected) / r.keywords : 0;
+    if (frr > max_frr || (hours > 0 && r.false_accepts / hours > max_fa_per_hour)) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "wav.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "wav";
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+int16_t *wav_read_mono16(const char *path, uint32_t *rate, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        ESP_LOGE(TAG, "Cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    uint8_t riff[12];
+    if (fread(riff, 1, sizeof(riff), f) != sizeof(riff) ||
+        memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        ESP_LOGE(TAG, "%s is not a WAV file", path);
+        fclose(f);
+        return NULL;
+    }
+
+    bool fmt_ok = false;
+    uint8_t chunk[8];
+    while (fread(chunk, 1, sizeof(chunk), f) == sizeof(chunk)) {
+        uint32_t size = read_le32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t fmt[16];
+            if (size < sizeof(fmt) || fread(fmt, 1, sizeof(fmt), f) != sizeof(fmt)) {
+                break;
+            }
+            fseek(f, size - sizeof(fmt) + (size & 1), SEEK_CUR);
+            uint16_t format = read_le16(fmt);
+            uint16_t channels = read_le16(fmt + 2);
+            uint16_t bits = read_le16(fmt + 14);
+            *rate = read_le32(fmt + 4);
+            if (format != 1 || channels != 1 || bits != 16) {
+                ESP_LOGE(TAG, "%s: need 16-bit mono PCM (got fmt=%d, %dch, %d-bit)",
+                         path, format, channels, bits);
+                break;
+            }
+            fmt_ok = true;
+        } else if (memcmp(chunk, "data", 4) == 0 && fmt_ok) {
+            *len = size / sizeof(int16_t);
+            int16_t *samples = malloc(*len * sizeof(int16_t) + 1);
+            if (!samples || fread(samples, sizeof(int16_t), *len, f) != *len) {
+                ESP_LOGE(TAG, "%s: truncated data chunk", path);
+                free(samples);
+                break;
+            }
+            fclose(f);
+            return samples;
+        } else {
+            fseek(f, size + (size & 1), SEEK_CUR);
+        }
+    }
+
+    fclose(f);
+    return NULL;
+}
+
+bool wav_write_mono16(const char *path, uint32_t rate, const int16_t *samples, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        ESP_LOGE(TAG, "Cannot create %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    uint32_t data_bytes = (uint32_t)(len * sizeof(int16_t));
+    uint8_t hdr[44];
+    memcpy(hdr, "RIFF", 4);
+    put_le32(hdr + 4, 36 + data_bytes);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le32(hdr + 16, 16);
+    put_le16(hdr + 20, 1);          // PCM
+    put_le16(hdr + 22, 1);          // mono
+    put_le32(hdr + 24, rate);
+    put_le32(hdr + 28, rate * 2);   // byte rate
+    put_le16(hdr + 32, 2);          // block align
+    put_le16(hdr + 34, 16);
+    memcpy(hdr + 36, "data", 4);
+    put_le32(hdr + 40, data_bytes);
+
+    bool ok = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+              fwrite(samples, sizeof(int16_t), len, f) == len;
+    fclose(f);
+    return ok;
+}
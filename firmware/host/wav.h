@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal WAV I/O for the host tools: 16-bit mono PCM only.
+
+// Read a WAV file. Returns a malloc'd sample buffer (caller frees) and fills
+// *rate and *len, or returns NULL with an error logged.
+int16_t *wav_read_mono16(const char *path, uint32_t *rate, size_t *len);
+
+bool wav_write_mono16(const char *path, uint32_t rate, const int16_t *samples, size_t len);
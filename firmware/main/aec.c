@@ -0,0 +1,153 @@
+#include "aec.h"
+
+#include <math.h>
+#include <string.h>
+
+// Step size mu in Q15 (0.25)
+#define AEC_MU_Q15          8192
+
+// Regularisation added to the reference energy (avoids blow-up in silence)
+#define AEC_DELTA           ((int64_t)AEC_TAPS * 64 * 64)
+
+// Geigel double-talk detector: near end is talking if |mic| exceeds this
+// multiple (Q12) of the reference peak in the filter window. Set above 1.0
+// because the mic gain and Sonos volume make the echo louder than the
+// digital reference in some rooms.
+#define AEC_GEIGEL_Q12      8192
+
+// Reference queue (~0.5 s at 16 kHz)
+#define AEC_REF_QUEUE_LEN   8192
+
+// Filter state. The reference history is stored twice back to back so the
+// AEC_TAPS most recent samples are always contiguous.
+static int32_t weights[AEC_TAPS];          // Q24
+static int16_t history[2 * AEC_TAPS];
+static size_t hist_pos;
+static int64_t hist_energy;                // sum of squares over the window
+
+static int16_t ref_queue[AEC_REF_QUEUE_LEN];
+static size_t ref_head;
+static size_t ref_count;
+
+// ERLE accumulators
+static double mic_energy;
+static double residual_energy;
+static aec_stats_t stats;
+
+void aec_reset(void)
+{
+    memset(weights, 0, sizeof(weights));
+    memset(history, 0, sizeof(history));
+    hist_pos = 0;
+    hist_energy = 0;
+    ref_head = 0;
+    ref_count = 0;
+    mic_energy = 0;
+    residual_energy = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+void aec_push_reference(const int16_t *ref, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (ref_count == AEC_REF_QUEUE_LEN) {
+            ref_head = (ref_head + 1) % AEC_REF_QUEUE_LEN;
+            ref_count--;
+        }
+        ref_queue[(ref_head + ref_count) % AEC_REF_QUEUE_LEN] = ref[i];
+        ref_count++;
+    }
+}
+
+bool aec_reference_pending(void)
+{
+    return ref_count > 0;
+}
+
+// Shift one reference sample into the history window.
+static void push_history(int16_t x)
+{
+    int16_t oldest = history[hist_pos];
+    hist_energy += (int32_t)x * x - (int32_t)oldest * oldest;
+
+    history[hist_pos] = x;
+    history[hist_pos + AEC_TAPS] = x;
+    hist_pos = (hist_pos + 1) % AEC_TAPS;
+}
+
+static int16_t cancel_sample(int16_t d)
+{
+    // history[hist_pos .. hist_pos + AEC_TAPS) is oldest -> newest
+    const int16_t *x = &history[hist_pos];
+
+    int64_t acc = 0;
+    int32_t peak = 0;
+    for (int k = 0; k < AEC_TAPS; k++) {
+        acc += (int64_t)weights[k] * x[k];
+        int32_t mag = x[k] < 0 ? -x[k] : x[k];
+        if (mag > peak) {
+            peak = mag;
+        }
+    }
+
+    int32_t e = d - (int32_t)((acc + (1 << 23)) >> 24);
+    if (e > 32767) {
+        e = 32767;
+    } else if (e < -32768) {
+        e = -32768;
+    }
+
+    // Adapt unless the near end is talking (Geigel)
+    int32_t dmag = d < 0 ? -d : d;
+    bool double_talk = dmag > (peak * AEC_GEIGEL_Q12 >> 12);
+    if (!double_talk) {
+        // step = mu * e / (energy + delta), in Q40; weight deltas are
+        // rounded, not truncated, or the bias drags every tap negative
+        int64_t step = ((int64_t)AEC_MU_Q15 * e * (1 << 25)) / (hist_energy + AEC_DELTA);
+        for (int k = 0; k < AEC_TAPS; k++) {
+            weights[k] += (int32_t)((step * x[k] + (1 << 15)) >> 16);
+        }
+    }
+
+    return (int16_t)e;
+}
+
+void aec_process(int16_t *mic, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (ref_count == 0) {
+            if (stats.samples > 0) {
+                stats.underruns++;
+            }
+            continue;  // no reference: pass through
+        }
+
+        push_history(ref_queue[ref_head]);
+        ref_head = (ref_head + 1) % AEC_REF_QUEUE_LEN;
+        ref_count--;
+
+        int16_t d = mic[i];
+        int16_t e = cancel_sample(d);
+        mic[i] = e;
+
+        mic_energy += (double)d * d;
+        residual_energy += (double)e * e;
+        stats.samples++;
+    }
+
+    if (residual_energy > 0 && mic_energy > 0) {
+        stats.erle_db = 10.0f * log10f((float)(mic_energy / residual_energy));
+    }
+}
+
+void aec_get_stats(aec_stats_t *out)
+{
+    *out = stats;
+}
+
+void aec_reset_stats(void)
+{
+    mic_energy = 0;
+    residual_energy = 0;
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Acoustic echo canceller
+//
+// Fixed-point NLMS filter that models the speaker -> room -> mic path from a
+// far-end reference (the TTS audio the server is playing on the Sonos) and
+// subtracts the estimated echo from the mic signal. A Geigel detector
+// freezes adaptation while the near end is talking over the echo.
+//
+// The reference arrives over the network in bursts; aec_push_reference()
+// queues it and aec_process() consumes one reference sample per mic sample.
+// ---------------------------------------------------------------------------
+
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#define AEC_TAPS CONFIG_AEC_TAPS
+#else
+#define AEC_TAPS 256
+#endif
+
+typedef struct {
+    float erle_db;          // echo return loss enhancement while reference was active
+    uint32_t samples;       // mic samples processed against a reference
+    uint32_t underruns;     // mic samples that found the reference queue empty
+} aec_stats_t;
+
+// Clear the filter, reference queue and statistics.
+void aec_reset(void);
+
+// Queue far-end reference samples (same rate as the mic samples passed to
+// aec_process). Oldest samples are dropped if the queue overflows.
+void aec_push_reference(const int16_t *ref, size_t n);
+
+// True while queued reference audio is waiting to be consumed.
+bool aec_reference_pending(void);
+
+// Cancel echo in *mic* in place. Samples without a queued reference pass
+// through unchanged.
+void aec_process(int16_t *mic, size_t n);
+
+void aec_get_stats(aec_stats_t *stats);
+
+// Start a new measurement window without touching the filter.
+void aec_reset_stats(void);
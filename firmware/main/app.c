@@ -0,0 +1,633 @@
+#include "app.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "aec.h"
+#include "dsp.h"
+#include "hal.h"
+#include "led.h"
+#include "protocol.h"
+#include "uplink.h"
+#include "wakeword.h"
+
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+static const char *TAG = "kenta";
+
+// Grace period after button release (microseconds)
+#define WAIT_TIMEOUT_US (3 * 1000 * 1000)
+
+// recv() timeout in PROCESSING state (seconds)
+#define RECV_TIMEOUT_S  120
+
+// Button debounce time (microseconds)
+#define DEBOUNCE_US (30 * 1000)
+
+// Wake-word interactions end after WAKE_SILENCE_MS below this margin over
+// the noise floor, or at the latest after WAKE_MAX_UTTERANCE_US
+#define ENDPOINT_MARGIN_DB    10.0f
+#define WAKE_MAX_UTTERANCE_US (10 * 1000 * 1000)
+
+// How often to log the wake-word detector's CPU use while listening
+#define WAKE_STATS_INTERVAL_US (60 * 1000 * 1000)
+
+static app_config_t config;
+
+// Static buffers (sized for the widest sample format)
+static int32_t i2s_raw[PCM_FRAME_LEN];
+static uint8_t pcm_frame[PCM_FRAME_LEN * 3];
+static size_t pcm_frame_bytes;
+
+// Uplink encoder state for the current interaction
+static uplink_mode_t uplink_mode = UPLINK_PCM;
+static int16_t pcm16[PCM_FRAME_LEN];
+static int16_t adpcm_block[PROTO_ADPCM_BLOCK_SAMPLES];
+static size_t adpcm_fill;
+static dsp_adpcm_state_t adpcm_state;
+static int16_t decim_carry;
+static uint32_t frames_sent;
+
+// Wake word: the last WAKE_PREROLL_MS of mic frames heard while listening,
+// sent ahead of live audio so the request includes the keyword
+static bool listening;
+static int16_t *preroll;
+static size_t preroll_frames;
+static size_t preroll_head;
+static size_t preroll_count;
+
+// Wake-word interaction endpointing
+static bool wake_triggered;
+static float mic_level_db;
+static int64_t recording_start;
+static int64_t last_speech_us;
+static int64_t wake_stats_at;
+static uint64_t wake_stats_busy_us;
+
+// Sample rate the echo canceller was trained at (the uplink rate)
+static uint32_t aec_rate;
+
+// Downlink echo reference
+static uint8_t ref_bytes[PROTO_REF_MAX_BYTES];
+static int16_t ref_samples[PROTO_REF_MAX_BYTES / 2];
+
+// Button debounce state
+static int64_t last_button_change = 0;
+static bool debounced_state = false;  // false = not pressed
+
+// State machine
+static state_t state = STATE_IDLE;
+static int sock = -1;
+static int64_t wait_start = 0;
+static int64_t wait_grace_us = WAIT_TIMEOUT_US;
+static int64_t process_start = 0;
+
+static app_timing_t timing;
+static app_timing_t last_timing;
+
+// ---------------------------------------------------------------------------
+// Button
+// ---------------------------------------------------------------------------
+static bool button_pressed(void)
+{
+    bool raw = hal_button_raw();
+    int64_t now = esp_timer_get_time();
+
+    if (raw != debounced_state) {
+        if (last_button_change == 0) {
+            last_button_change = now;
+        } else if (now - last_button_change > DEBOUNCE_US) {
+            debounced_state = raw;
+            last_button_change = 0;
+        }
+    } else {
+        last_button_change = 0;
+    }
+
+    return debounced_state;
+}
+
+// ---------------------------------------------------------------------------
+// Uplink encoding
+// ---------------------------------------------------------------------------
+
+// Pick the codec for a new interaction and announce it. Returns false if the
+// header could not be sent.
+static bool start_uplink(void)
+{
+    uplink_mode = uplink_choose(hal_wifi_rssi(), config.sample_rate);
+
+    // The echo path model is only valid at the rate it was learned at
+    uint32_t rate = (uplink_mode == UPLINK_ADPCM_HALF_RATE) ? config.sample_rate / 2
+                                                           : config.sample_rate;
+    if (rate != aec_rate) {
+        aec_reset();
+        aec_rate = rate;
+    }
+
+    adpcm_fill = 0;
+    adpcm_state.predictor = 0;
+    adpcm_state.index = 0;
+    decim_carry = 0;
+    frames_sent = 0;
+    timing.uplink = uplink_mode;
+
+    switch (uplink_mode) {
+    case UPLINK_ADPCM:
+        return proto_send_header(sock, PROTO_CODEC_IMA_ADPCM, config.sample_rate, 4);
+    case UPLINK_ADPCM_HALF_RATE:
+        return proto_send_header(sock, PROTO_CODEC_IMA_ADPCM, config.sample_rate / 2, 4);
+    default:
+        return proto_send_header(sock, PROTO_CODEC_PCM, config.sample_rate, config.sample_bits);
+    }
+}
+
+// Encode the completed ADPCM block into pcm_frame.
+static void encode_adpcm_block(void)
+{
+    pcm_frame_bytes = dsp_adpcm_encode_block(&adpcm_state, adpcm_block,
+                                             PROTO_ADPCM_BLOCK_SAMPLES, pcm_frame);
+    adpcm_fill = 0;
+}
+
+// Feed converted samples into the ADPCM block; a full block becomes the next
+// frame to send, otherwise there is nothing to send yet.
+static void encode_adpcm(const int16_t *samples, size_t n)
+{
+    pcm_frame_bytes = 0;
+    memcpy(adpcm_block + adpcm_fill, samples, n * sizeof(int16_t));
+    adpcm_fill += n;
+    if (adpcm_fill == PROTO_ADPCM_BLOCK_SAMPLES) {
+        encode_adpcm_block();
+    }
+}
+
+// Cancel speaker echo in pcm16 if *aec* is set, and encode it for the uplink
+// into pcm_frame / pcm_frame_bytes.
+static void encode_pcm16(bool aec)
+{
+    switch (uplink_mode) {
+    case UPLINK_PCM:
+        if (aec) {
+            aec_process(pcm16, PCM_FRAME_LEN);
+        }
+        pcm_frame_bytes = dsp_s16_to_pcm(pcm16, pcm_frame, PCM_FRAME_LEN, config.sample_bits);
+        break;
+    case UPLINK_ADPCM:
+        if (aec) {
+            aec_process(pcm16, PCM_FRAME_LEN);
+        }
+        encode_adpcm(pcm16, PCM_FRAME_LEN);
+        break;
+    case UPLINK_ADPCM_HALF_RATE:
+        dsp_decimate2(pcm16, pcm16, PCM_FRAME_LEN, &decim_carry);
+        if (aec) {
+            aec_process(pcm16, PCM_FRAME_LEN / 2);
+        }
+        encode_adpcm(pcm16, PCM_FRAME_LEN / 2);
+        break;
+    }
+}
+
+// Read one frame from I2S (256 samples) into i2s_raw and pcm16.
+static bool read_mic(void)
+{
+    if (!hal_audio_read(i2s_raw, PCM_FRAME_LEN)) {
+        return false;
+    }
+    dsp_i2s32_to_s16(i2s_raw, pcm16, PCM_FRAME_LEN);
+    if (listening) {
+        mic_level_db = wake_level_db(pcm16, PCM_FRAME_LEN);
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Read one frame from I2S (256 samples), cancel speaker echo if a reference
+// is queued, and encode it for the uplink into pcm_frame / pcm_frame_bytes.
+// Returns true on success, false on error.
+// ---------------------------------------------------------------------------
+static bool read_i2s_pcm(void)
+{
+    if (!read_mic()) {
+        return false;
+    }
+
+    bool aec = aec_reference_pending();
+    if (uplink_mode == UPLINK_PCM && !aec) {
+        // Keep all 24 bits when there is nothing to cancel
+        pcm_frame_bytes = dsp_i2s32_to_pcm(i2s_raw, pcm_frame, PCM_FRAME_LEN,
+                                           config.sample_bits);
+    } else {
+        encode_pcm16(aec);
+    }
+    return true;
+}
+
+// Read a PROTO_MSG_REF payload (the type byte is already consumed) and queue
+// it for the echo canceller. Returns false on a protocol or socket error.
+static bool recv_reference(void)
+{
+    uint8_t len_le[2];
+    if (!proto_recv_all(sock, len_le, sizeof(len_le))) {
+        return false;
+    }
+    size_t len = len_le[0] | (len_le[1] << 8);
+    if (len > sizeof(ref_bytes) || len % 2 != 0) {
+        ESP_LOGW(TAG, "Bad reference frame length %u", (unsigned)len);
+        return false;
+    }
+    if (!proto_recv_all(sock, ref_bytes, len)) {
+        return false;
+    }
+    for (size_t i = 0; i < len / 2; i++) {
+        ref_samples[i] = (int16_t)(ref_bytes[2 * i] | (ref_bytes[2 * i + 1] << 8));
+    }
+    aec_push_reference(ref_samples, len / 2);
+    return true;
+}
+
+static bool send_pcm_frame(void)
+{
+    if (pcm_frame_bytes == 0) {
+        return true;  // ADPCM block still filling
+    }
+
+    // A send that outlasts half a capture frame eats into the DMA ring
+    int64_t frame_us = (int64_t)PCM_FRAME_LEN * 1000000 / config.sample_rate;
+    int64_t t0 = esp_timer_get_time();
+    if (!proto_send_all(sock, pcm_frame, pcm_frame_bytes)) {
+        return false;
+    }
+    if (esp_timer_get_time() - t0 > frame_us / 2) {
+        timing.stalled_frames++;
+    }
+    frames_sent++;
+    timing.bytes_sent += pcm_frame_bytes;
+    return true;
+}
+
+// Send the zero-padded final ADPCM block, if any.
+static bool flush_uplink(void)
+{
+    if (uplink_mode == UPLINK_PCM || adpcm_fill == 0) {
+        return true;
+    }
+    memset(adpcm_block + adpcm_fill, 0,
+           (PROTO_ADPCM_BLOCK_SAMPLES - adpcm_fill) * sizeof(int16_t));
+    encode_adpcm_block();
+    return send_pcm_frame();
+}
+
+// ---------------------------------------------------------------------------
+// Wake word
+// ---------------------------------------------------------------------------
+
+// Run the detector on one mic frame and keep the frame as pre-roll.
+// Returns true when the keyword was heard.
+static bool listen_for_wake_word(void)
+{
+    if (!read_mic()) {
+        return false;
+    }
+    if (preroll_count == preroll_frames) {
+        preroll_head = (preroll_head + 1) % preroll_frames;
+        preroll_count--;
+    }
+    size_t slot = (preroll_head + preroll_count) % preroll_frames;
+    memcpy(preroll + slot * PCM_FRAME_LEN, pcm16, sizeof(pcm16));
+    preroll_count++;
+    return wake_process(pcm16, PCM_FRAME_LEN);
+}
+
+// Stream the pre-roll ahead of live audio. Drains the buffer.
+static bool send_preroll(void)
+{
+    for (; preroll_count > 0; preroll_count--) {
+        memcpy(pcm16, preroll + preroll_head * PCM_FRAME_LEN, sizeof(pcm16));
+        preroll_head = (preroll_head + 1) % preroll_frames;
+        encode_pcm16(false);
+        if (!send_pcm_frame()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// True once a wake-word request has gone quiet (see ENDPOINT_MARGIN_DB).
+static bool end_of_speech(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (mic_level_db > wake_noise_floor_db() + ENDPOINT_MARGIN_DB) {
+        last_speech_us = now;
+    }
+    return now - last_speech_us > (int64_t)WAKE_SILENCE_MS * 1000 ||
+           now - recording_start > WAKE_MAX_UTTERANCE_US;
+}
+
+static void log_wake_stats(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (now - wake_stats_at < WAKE_STATS_INTERVAL_US) {
+        return;
+    }
+
+    wake_stats_t ws;
+    wake_get_stats(&ws);
+    if (wake_stats_at > 0) {
+        ESP_LOGI(TAG, "Wake word: %.0f us/frame avg, %u us max, %.2f%% CPU, noise floor %.0f dB",
+                 ws.frames ? (double)ws.busy_us / ws.frames : 0.0, (unsigned)ws.max_frame_us,
+                 100.0 * (ws.busy_us - wake_stats_busy_us) / (now - wake_stats_at),
+                 wake_noise_floor_db());
+    }
+    wake_stats_at = now;
+    wake_stats_busy_us = ws.busy_us;
+}
+
+// True once the server has heard the end of speech (PROTO_MSG_STOP). Polls
+// the socket without blocking, between frames of the uplink.
+static bool server_heard_end(void)
+{
+    fd_set readfds;
+    struct timeval tv = {0, 0};
+    FD_ZERO(&readfds);
+    FD_SET(sock, &readfds);
+    if (select(sock + 1, &readfds, NULL, NULL, &tv) <= 0 || !FD_ISSET(sock, &readfds)) {
+        return false;
+    }
+
+    uint8_t msg;
+    if (recv(sock, &msg, 1, 0) != 1) {
+        return false;  // closed: the next send() fails
+    }
+    if (msg != PROTO_MSG_STOP) {
+        ESP_LOGW(TAG, "Unexpected downlink message 0x%02x while recording", msg);
+        return false;
+    }
+    timing.server_endpoint = true;
+    return true;
+}
+
+// Drop the connection after an error and flash red.
+static void abort_to_idle(void)
+{
+    if (state == STATE_RECORDING || state == STATE_WAIT) {
+        // A failed send is the strongest stall signal there is
+        uplink_record(frames_sent + 1, timing.stalled_frames + 1);
+    }
+    proto_close(sock);
+    sock = -1;
+    led_play(LED_ANIM_ERROR_FLASH, LED_COLOR_RED);
+    state = STATE_IDLE;
+}
+
+// ---------------------------------------------------------------------------
+// State machine
+// ---------------------------------------------------------------------------
+void app_init(const app_config_t *cfg)
+{
+    config = *cfg;
+
+    aec_reset();
+    aec_rate = 0;
+
+    listening = false;
+    if (wake_enabled()) {
+        preroll_frames = ((size_t)WAKE_PREROLL_MS * config.sample_rate / 1000 +
+                          PCM_FRAME_LEN - 1) / PCM_FRAME_LEN;
+        preroll = malloc(preroll_frames * PCM_FRAME_LEN * sizeof(int16_t));
+        listening = preroll != NULL;
+        if (!listening) {
+            ESP_LOGE(TAG, "No memory for wake-word pre-roll, push-to-talk only");
+        }
+    }
+
+    // Discard startup I2S samples
+    uplink_mode = UPLINK_PCM;
+    for (int i = 0; i < 8; i++) {
+        read_i2s_pcm();
+    }
+
+    state = STATE_IDLE;
+    sock = -1;
+    ESP_LOGI(TAG, "Audio: %u Hz, %d-bit", (unsigned)config.sample_rate, config.sample_bits);
+    ESP_LOGI(TAG, listening ? "Ready — press button or say the wake word"
+                            : "Ready — press button to talk");
+}
+
+const app_timing_t *app_last_timing(void)
+{
+    return &last_timing;
+}
+
+state_t app_step(void)
+{
+    switch (state) {
+
+    // ==== IDLE: wait for button press or the wake word ====
+    case STATE_IDLE: {
+        // While listening, the blocking mic read paces this loop
+        bool wake = listening && listen_for_wake_word();
+        if (wake || button_pressed()) {
+            memset(&timing, 0, sizeof(timing));
+            timing.wake_word = wake;
+            wake_triggered = wake;
+            if (wake) {
+                ESP_LOGI(TAG, "Wake word detected");
+            }
+            sock = proto_connect(hal_server_ip(), hal_server_port());
+            if (sock >= 0 && !start_uplink()) {
+                ESP_LOGE(TAG, "send() stream header failed");
+                proto_close(sock);
+                sock = -1;
+            }
+            if (sock >= 0 && wake && !send_preroll()) {
+                ESP_LOGE(TAG, "send() pre-roll failed");
+                proto_close(sock);
+                sock = -1;
+            }
+            preroll_count = 0;
+            wake_reset();
+            if (sock < 0) {
+                led_play(LED_ANIM_ERROR_FLASH, LED_COLOR_RED);
+                // Wait for button release before retrying
+                while (button_pressed()) {
+                    hal_delay_ms(50);
+                }
+                break;
+            }
+            led_play(LED_ANIM_SOLID, LED_COLOR_BLUE);
+            recording_start = esp_timer_get_time();
+            last_speech_us = recording_start;
+            state = STATE_RECORDING;
+            ESP_LOGI(TAG, "Recording...");
+        } else if (listening) {
+            log_wake_stats();
+        } else {
+            hal_delay_ms(20);
+        }
+        break;
+    }
+
+    // ==== RECORDING: stream audio while button is held (or, after the wake
+    //      word, until the speaker goes quiet) ====
+    case STATE_RECORDING:
+        if (!read_i2s_pcm()) {
+            ESP_LOGW(TAG, "I2S read error, retrying...");
+            break;
+        }
+        if (!send_pcm_frame()) {
+            ESP_LOGE(TAG, "send() failed, aborting");
+            abort_to_idle();
+            break;
+        }
+
+        // While the button is held a stop from the server stays queued and
+        // ends the grace period as soon as the button is released
+        if (wake_triggered ? end_of_speech() || server_heard_end() : !button_pressed()) {
+            // Button released or speech ended — enter WAIT state. The
+            // silence that ended a wake-word request already served as its
+            // grace period.
+            wait_start = esp_timer_get_time();
+            wait_grace_us = wake_triggered ? 0 : WAIT_TIMEOUT_US;
+            timing.release_us = wait_start;
+            led_play(LED_ANIM_BLINK, LED_COLOR_BLUE);
+            state = STATE_WAIT;
+            ESP_LOGI(TAG, wake_triggered ? "End of speech" : "Button released, waiting 3s...");
+        }
+        break;
+
+    // ==== WAIT: 3s grace period, blink blue ====
+    case STATE_WAIT: {
+        int64_t now = esp_timer_get_time();
+
+        if (button_pressed()) {
+            // Resume recording
+            led_play(LED_ANIM_SOLID, LED_COLOR_BLUE);
+            state = STATE_RECORDING;
+            ESP_LOGI(TAG, "Button pressed again, resuming recording...");
+            break;
+        }
+
+        if (server_heard_end() || now - wait_start >= wait_grace_us) {
+            // Grace period expired or the server heard the end of speech —
+            // send end marker and wait for server
+            ESP_LOGI(TAG, timing.server_endpoint ? "Server heard the end of speech, processing..."
+                                                 : "Grace period expired, processing...");
+            if (!flush_uplink() ||
+                !proto_send_all(sock, PROTO_END_MARKER, PROTO_END_MARKER_LEN)) {
+                ESP_LOGE(TAG, "send() end marker failed");
+                abort_to_idle();
+                break;
+            }
+            uplink_record(frames_sent, timing.stalled_frames);
+            aec_reset_stats();
+
+            // Breathe green while the server works
+            led_play(LED_ANIM_BREATHE, LED_COLOR_GREEN);
+            process_start = esp_timer_get_time();
+            timing.end_sent_us = process_start;
+            state = STATE_PROCESSING;
+        } else {
+            // Keep streaming audio during wait (captures trailing speech)
+            if (!read_i2s_pcm()) {
+                ESP_LOGW(TAG, "I2S read error during wait, retrying...");
+                break;
+            }
+            if (!send_pcm_frame()) {
+                ESP_LOGE(TAG, "send() failed during wait");
+                abort_to_idle();
+            }
+        }
+        break;
+    }
+
+    // ==== PROCESSING: breathe green, wait for server done (or playing) byte ====
+    case STATE_PROCESSING: {
+        // While the server streams the playback reference, keep the echo
+        // canceller converging on live mic audio (nothing is sent).
+        bool converging = aec_reference_pending();
+        if (converging && !read_i2s_pcm()) {
+            ESP_LOGW(TAG, "I2S read error during playback");
+        }
+
+        fd_set readfds;
+        struct timeval tv;
+        FD_ZERO(&readfds);
+        FD_SET(sock, &readfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = converging ? 0 : 100 * 1000;  // 100ms timeout for select
+
+        int ret = select(sock + 1, &readfds, NULL, NULL, &tv);
+
+        if (ret > 0 && FD_ISSET(sock, &readfds)) {
+            uint8_t msg;
+            int n = recv(sock, &msg, 1, 0);
+            if (n == 1 && msg == PROTO_MSG_REF) {
+                if (!recv_reference()) {
+                    ESP_LOGE(TAG, "Reference frame error, returning to idle");
+                    abort_to_idle();
+                }
+                break;
+            }
+            if (n == 1 && msg == PROTO_MSG_STOP) {
+                // The server's endpointer fired while our end marker was
+                // already on the way; the stream is over either way
+                ESP_LOGD(TAG, "Late stop after end marker, ignored");
+                break;
+            }
+            if (n == 1 && msg == PROTO_MSG_DONE) {
+                ESP_LOGI(TAG, "Server done, back to idle");
+            } else if (n == 1 && msg == PROTO_MSG_PLAYING) {
+                // The reply plays on without us; a new press may queue
+                // behind it or interrupt it, as the server decides
+                ESP_LOGI(TAG, "Reply playing, ready for the next question");
+                timing.released_early = true;
+            } else {
+                ESP_LOGW(TAG, "Unexpected recv result (n=%d), returning to idle", n);
+            }
+
+            aec_stats_t aec;
+            aec_get_stats(&aec);
+            if (aec.samples > 0) {
+                ESP_LOGI(TAG, "AEC: ERLE %.1f dB over %u ms (%u underruns)",
+                         aec.erle_db, (unsigned)(aec.samples * 1000ULL / aec_rate),
+                         (unsigned)aec.underruns);
+            }
+            timing.aec_erle_db = aec.erle_db;
+            timing.aec_samples = aec.samples;
+            timing.done_us = esp_timer_get_time();
+            last_timing = timing;
+            proto_close(sock);
+            sock = -1;
+            led_play(LED_ANIM_OFF, LED_COLOR_GREEN);
+            state = STATE_IDLE;
+            break;
+        }
+
+        if (ret < 0) {
+            ESP_LOGE(TAG, "select() error, returning to idle");
+            abort_to_idle();
+            break;
+        }
+
+        // Overall timeout check (use process_start, not wait_start)
+        int64_t now = esp_timer_get_time();
+        if (now - process_start > (int64_t)RECV_TIMEOUT_S * 1000 * 1000) {
+            ESP_LOGW(TAG, "Processing timeout (%ds), returning to idle", RECV_TIMEOUT_S);
+            abort_to_idle();
+            break;
+        }
+        break;
+    }
+    }
+
+    return state;
+}
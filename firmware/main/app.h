@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "uplink.h"
+
+// ---------------------------------------------------------------------------
+// Push-to-talk / wake-word state machine, independent of ESP-IDF drivers. Talks to the
+// hardware only through hal.h and led.h so it also runs in the host simulator.
+// ---------------------------------------------------------------------------
+
+// Samples per I2S read / TCP send
+#define PCM_FRAME_LEN 256
+
+// Audio format announced in the stream header (see protocol.h)
+typedef struct {
+    uint32_t sample_rate;   // Hz
+    uint8_t sample_bits;    // 16 or 24
+} app_config_t;
+
+typedef enum {
+    STATE_IDLE,
+    STATE_RECORDING,
+    STATE_WAIT,
+    STATE_PROCESSING,
+} state_t;
+
+// Timestamps of the last completed interaction, for latency measurements.
+typedef struct {
+    int64_t release_us;     // button released (entered STATE_WAIT)
+    int64_t end_sent_us;    // end marker sent (entered STATE_PROCESSING)
+    int64_t done_us;        // done (or playing) byte received
+    uint32_t bytes_sent;    // audio payload bytes streamed
+    uint32_t stalled_frames;  // frames whose send() outlasted half a frame
+    uplink_mode_t uplink;   // codec chosen for the interaction
+    float aec_erle_db;      // echo cancellation achieved during playback
+    uint32_t aec_samples;   // mic samples processed against a reference
+    bool wake_word;         // started by the wake word rather than the button
+    bool released_early;    // freed at playback start rather than its end
+    bool server_endpoint;   // recording ended by the server's PROTO_MSG_STOP
+} app_timing_t;
+
+// Discard startup samples and reset the state machine. *cfg* is copied.
+// Load the wake-word model (wakeword.h) first to listen for it in IDLE.
+void app_init(const app_config_t *cfg);
+
+// Run one iteration of the state machine. Returns the state after the step.
+state_t app_step(void);
+
+const app_timing_t *app_last_timing(void);
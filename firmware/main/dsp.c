@@ -0,0 +1,166 @@
+#include "dsp.h"
+
+size_t dsp_i2s32_to_pcm(const int32_t *in, uint8_t *out, size_t samples, int bits)
+{
+    uint8_t *p = out;
+    if (bits == 24) {
+        for (size_t i = 0; i < samples; i++) {
+            uint32_t s = (uint32_t)in[i] >> 8;
+            *p++ = s & 0xFF;
+            *p++ = (s >> 8) & 0xFF;
+            *p++ = (s >> 16) & 0xFF;
+        }
+    } else {
+        for (size_t i = 0; i < samples; i++) {
+            uint32_t s = (uint32_t)in[i] >> 16;
+            *p++ = s & 0xFF;
+            *p++ = (s >> 8) & 0xFF;
+        }
+    }
+    return p - out;
+}
+
+void dsp_i2s32_to_s16(const int32_t *in, int16_t *out, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = (int16_t)(in[i] >> 16);
+    }
+}
+
+size_t dsp_s16_to_pcm(const int16_t *in, uint8_t *out, size_t samples, int bits)
+{
+    uint8_t *p = out;
+    for (size_t i = 0; i < samples; i++) {
+        uint16_t s = (uint16_t)in[i];
+        if (bits == 24) {
+            *p++ = 0;
+        }
+        *p++ = s & 0xFF;
+        *p++ = (s >> 8) & 0xFF;
+    }
+    return p - out;
+}
+
+void dsp_decimate2(const int16_t *in, int16_t *out, size_t samples, int16_t *carry)
+{
+    int32_t prev = *carry;
+    for (size_t i = 0; i + 1 < samples; i += 2) {
+        out[i / 2] = (int16_t)((prev + 2 * in[i] + in[i + 1]) / 4);
+        prev = in[i + 1];
+    }
+    *carry = (int16_t)prev;
+}
+
+// ---------------------------------------------------------------------------
+// IMA ADPCM
+// ---------------------------------------------------------------------------
+static const int8_t adpcm_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+static const int16_t adpcm_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static uint8_t adpcm_encode_sample(dsp_adpcm_state_t *st, int16_t sample)
+{
+    int step = adpcm_step_table[st->index];
+    int diff = sample - st->predictor;
+    uint8_t code = 0;
+    if (diff < 0) {
+        code = 8;
+        diff = -diff;
+    }
+
+    // Quantise and reconstruct exactly as the decoder will
+    int delta = step >> 3;
+    if (diff >= step) {
+        code |= 4;
+        diff -= step;
+        delta += step;
+    }
+    if (diff >= step >> 1) {
+        code |= 2;
+        diff -= step >> 1;
+        delta += step >> 1;
+    }
+    if (diff >= step >> 2) {
+        code |= 1;
+        delta += step >> 2;
+    }
+
+    int predictor = st->predictor + ((code & 8) ? -delta : delta);
+    if (predictor > 32767) {
+        predictor = 32767;
+    } else if (predictor < -32768) {
+        predictor = -32768;
+    }
+    st->predictor = (int16_t)predictor;
+
+    int index = st->index + adpcm_index_table[code];
+    st->index = (uint8_t)(index < 0 ? 0 : (index > 88 ? 88 : index));
+    return code;
+}
+
+size_t dsp_adpcm_encode_block(dsp_adpcm_state_t *st, const int16_t *in,
+                              size_t samples, uint8_t *out)
+{
+    out[0] = (uint16_t)st->predictor & 0xFF;
+    out[1] = ((uint16_t)st->predictor >> 8) & 0xFF;
+    out[2] = st->index;
+    out[3] = 0;
+
+    uint8_t *p = out + DSP_ADPCM_HEADER_LEN;
+    for (size_t i = 0; i + 1 < samples; i += 2) {
+        uint8_t lo = adpcm_encode_sample(st, in[i]);
+        uint8_t hi = adpcm_encode_sample(st, in[i + 1]);
+        *p++ = lo | (hi << 4);
+    }
+    return p - out;
+}
+
+size_t dsp_adpcm_decode_block(const uint8_t *in, size_t bytes, int16_t *out)
+{
+    if (bytes < DSP_ADPCM_HEADER_LEN) {
+        return 0;
+    }
+    int predictor = (int16_t)(in[0] | (in[1] << 8));
+    int index = in[2] > 88 ? 88 : in[2];
+
+    size_t n = 0;
+    for (size_t i = DSP_ADPCM_HEADER_LEN; i < bytes; i++) {
+        for (int shift = 0; shift <= 4; shift += 4) {
+            uint8_t code = (in[i] >> shift) & 0x0F;
+            int step = adpcm_step_table[index];
+            int delta = step >> 3;
+            if (code & 4) {
+                delta += step;
+            }
+            if (code & 2) {
+                delta += step >> 1;
+            }
+            if (code & 1) {
+                delta += step >> 2;
+            }
+            predictor += (code & 8) ? -delta : delta;
+            if (predictor > 32767) {
+                predictor = 32767;
+            } else if (predictor < -32768) {
+                predictor = -32768;
+            }
+            index += adpcm_index_table[code];
+            index = index < 0 ? 0 : (index > 88 ? 88 : index);
+            out[n++] = (int16_t)predictor;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Audio sample processing shared by the firmware and the host simulator.
+// ---------------------------------------------------------------------------
+
+// Convert left-justified 32-bit I2S words (INMP441: 24 valid bits) to packed
+// little-endian PCM of *bits* (16 or 24) per sample by keeping the top bits.
+// Returns the number of bytes written to *out*.
+size_t dsp_i2s32_to_pcm(const int32_t *in, uint8_t *out, size_t samples, int bits);
+
+// Same conversion to native 16-bit samples, for further processing.
+void dsp_i2s32_to_s16(const int32_t *in, int16_t *out, size_t samples);
+
+// Pack 16-bit samples as little-endian PCM of *bits* (16 or 24) per sample.
+// Returns the number of bytes written to *out*.
+size_t dsp_s16_to_pcm(const int16_t *in, uint8_t *out, size_t samples, int bits);
+
+// Halve the sample rate with a [1 2 1]/4 low-pass. *samples* must be even;
+// writes samples / 2 values. *carry* holds the last odd input between calls
+// (initialise to 0).
+void dsp_decimate2(const int16_t *in, int16_t *out, size_t samples, int16_t *carry);
+
+// ---------------------------------------------------------------------------
+// IMA ADPCM (4 bits per sample)
+//
+// Each block is self-contained so the decoder can resynchronise:
+//   s16 predictor, u8 step index, u8 reserved, then one nibble per sample,
+//   low nibble first.
+// ---------------------------------------------------------------------------
+#define DSP_ADPCM_HEADER_LEN 4
+#define DSP_ADPCM_BLOCK_BYTES(samples) (DSP_ADPCM_HEADER_LEN + (samples) / 2)
+
+typedef struct {
+    int16_t predictor;
+    uint8_t index;
+} dsp_adpcm_state_t;
+
+// Encode an even number of samples into one block. Returns bytes written.
+size_t dsp_adpcm_encode_block(dsp_adpcm_state_t *st, const int16_t *in,
+                              size_t samples, uint8_t *out);
+
+// Decode one block of *bytes* (header included) into 2 * (bytes - header)
+// samples. Returns the number of samples written, 0 for a short block.
+size_t dsp_adpcm_decode_block(const uint8_t *in, size_t bytes, int16_t *out);
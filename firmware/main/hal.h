@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Platform hooks used by the portable state machine (app.c).
+//
+// main.c implements these on the ESP32; host/hal_host.c implements them for
+// the Linux simulator (WAV-backed I2S, scripted button, plain BSD sockets).
+// ---------------------------------------------------------------------------
+
+// Raw button level, true while pressed. Debouncing is done in app.c.
+bool hal_button_raw(void);
+
+// Blocking read of exactly *samples* raw 32-bit I2S words, paced in real time.
+// Returns false on a read error.
+bool hal_audio_read(int32_t *raw, size_t samples);
+
+// Signal strength of the current WiFi link in dBm, or 0 if unknown.
+int hal_wifi_rssi(void);
+
+// Sleep the calling task.
+void hal_delay_ms(uint32_t ms);
+
+// Address of the backend server.
+const char *hal_server_ip(void);
+uint16_t hal_server_port(void);
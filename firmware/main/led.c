@@ -0,0 +1,188 @@
+#include "led.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "led";
+
+// RGB LED pins (common cathode, active high)
+#define PIN_LED_R   4
+#define PIN_LED_G   18
+#define PIN_LED_B   19
+
+// LEDC PWM
+#define LED_PWM_MODE     LEDC_LOW_SPEED_MODE
+#define LED_PWM_TIMER    LEDC_TIMER_0
+#define LED_PWM_FREQ_HZ  5000
+#define LED_PWM_RES      LEDC_TIMER_10_BIT
+#define LED_DUTY_MAX     ((1 << 10) - 1)
+
+// Animation timing (milliseconds)
+#define LED_TICK_MS           20
+#define BLINK_HALF_PERIOD_MS  333
+#define BREATHE_PERIOD_MS     2000
+#define ERROR_FLASH_MS        500
+
+#define LED_QUEUE_LEN   8
+#define LED_TASK_STACK  2048
+#define LED_TASK_PRIO   (tskIDLE_PRIORITY + 2)
+
+typedef enum {
+    LED_CMD_PLAY,
+    LED_CMD_BRIGHTNESS,
+} led_cmd_type_t;
+
+typedef struct {
+    led_cmd_type_t type;
+    led_anim_t anim;
+    led_color_t color;
+    uint8_t brightness;
+} led_cmd_t;
+
+// Indexed by led_color_t
+static const ledc_channel_t led_channels[3] = {LEDC_CHANNEL_0, LEDC_CHANNEL_1, LEDC_CHANNEL_2};
+static const int led_pins[3] = {PIN_LED_R, PIN_LED_G, PIN_LED_B};
+
+static QueueHandle_t led_queue;
+static uint8_t brightness = CONFIG_LED_BRIGHTNESS;
+
+// ---------------------------------------------------------------------------
+// PWM output
+// ---------------------------------------------------------------------------
+
+// Drive *color* at *level* (0..LED_DUTY_MAX, before brightness scaling) and
+// turn the other two channels off.
+static void led_write(led_color_t color, uint32_t level)
+{
+    uint32_t duty = level * brightness / 100;
+    for (int i = 0; i < 3; i++) {
+        ledc_set_duty(LED_PWM_MODE, led_channels[i], i == (int)color ? duty : 0);
+        ledc_update_duty(LED_PWM_MODE, led_channels[i]);
+    }
+}
+
+// Triangle wave squared for a perceptually even fade.
+static uint32_t breathe_level(uint32_t elapsed_ms)
+{
+    const uint32_t half = BREATHE_PERIOD_MS / 2;
+    uint32_t phase = elapsed_ms % BREATHE_PERIOD_MS;
+    uint32_t t = phase < half ? phase : BREATHE_PERIOD_MS - phase;
+    return (uint32_t)((uint64_t)t * t * LED_DUTY_MAX / ((uint64_t)half * half));
+}
+
+// ---------------------------------------------------------------------------
+// Animation task
+// ---------------------------------------------------------------------------
+static void led_task(void *arg)
+{
+    led_anim_t anim = LED_ANIM_OFF;
+    led_color_t color = LED_COLOR_RED;
+    int64_t anim_start = 0;
+    led_cmd_t cmd;
+
+    while (1) {
+        // Static animations sleep until the next command; moving ones tick.
+        bool animating = (anim == LED_ANIM_BLINK || anim == LED_ANIM_BREATHE ||
+                          anim == LED_ANIM_ERROR_FLASH);
+        TickType_t wait = animating ? pdMS_TO_TICKS(LED_TICK_MS) : portMAX_DELAY;
+
+        if (xQueueReceive(led_queue, &cmd, wait) == pdTRUE) {
+            if (cmd.type == LED_CMD_BRIGHTNESS) {
+                brightness = cmd.brightness;
+            } else {
+                anim = cmd.anim;
+                color = cmd.color;
+                anim_start = esp_timer_get_time();
+            }
+        }
+
+        uint32_t elapsed_ms = (uint32_t)((esp_timer_get_time() - anim_start) / 1000);
+
+        switch (anim) {
+        case LED_ANIM_OFF:
+            led_write(color, 0);
+            break;
+        case LED_ANIM_SOLID:
+            led_write(color, LED_DUTY_MAX);
+            break;
+        case LED_ANIM_BLINK:
+            led_write(color, (elapsed_ms / BLINK_HALF_PERIOD_MS) % 2 == 0 ? LED_DUTY_MAX : 0);
+            break;
+        case LED_ANIM_BREATHE:
+            led_write(color, breathe_level(elapsed_ms));
+            break;
+        case LED_ANIM_ERROR_FLASH:
+            if (elapsed_ms < ERROR_FLASH_MS) {
+                led_write(color, LED_DUTY_MAX);
+            } else {
+                anim = LED_ANIM_OFF;
+                led_write(color, 0);
+            }
+            break;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+void led_init(void)
+{
+    ledc_timer_config_t timer_cfg = {
+        .speed_mode = LED_PWM_MODE,
+        .duty_resolution = LED_PWM_RES,
+        .timer_num = LED_PWM_TIMER,
+        .freq_hz = LED_PWM_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&timer_cfg));
+
+    for (int i = 0; i < 3; i++) {
+        ledc_channel_config_t ch_cfg = {
+            .gpio_num = led_pins[i],
+            .speed_mode = LED_PWM_MODE,
+            .channel = led_channels[i],
+            .timer_sel = LED_PWM_TIMER,
+            .duty = 0,
+            .hpoint = 0,
+        };
+        ESP_ERROR_CHECK(ledc_channel_config(&ch_cfg));
+    }
+
+    led_queue = xQueueCreate(LED_QUEUE_LEN, sizeof(led_cmd_t));
+    xTaskCreate(led_task, "led", LED_TASK_STACK, NULL, LED_TASK_PRIO, NULL);
+    ESP_LOGI(TAG, "LED initialized (brightness %d%%)", brightness);
+}
+
+void led_play(led_anim_t anim, led_color_t color)
+{
+    led_cmd_t cmd = {
+        .type = LED_CMD_PLAY,
+        .anim = anim,
+        .color = color,
+    };
+    if (xQueueSend(led_queue, &cmd, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "LED queue full, dropping animation %d", anim);
+    }
+}
+
+void led_set_brightness(uint8_t percent)
+{
+    if (percent < 1) {
+        percent = 1;
+    } else if (percent > 100) {
+        percent = 100;
+    }
+    led_cmd_t cmd = {
+        .type = LED_CMD_BRIGHTNESS,
+        .brightness = percent,
+    };
+    if (xQueueSend(led_queue, &cmd, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "LED queue full, dropping brightness change");
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Non-blocking RGB LED driver
+//
+// Animations run on a dedicated task driving the LEDC PWM peripheral. Callers
+// post commands to a queue and return immediately, so LED feedback never
+// stalls audio capture or networking.
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    LED_ANIM_OFF,
+    LED_ANIM_SOLID,
+    LED_ANIM_BLINK,        // on/off at ~1.5 Hz
+    LED_ANIM_BREATHE,      // smooth fade in/out, 2 s period
+    LED_ANIM_ERROR_FLASH,  // solid for ERROR_FLASH_MS, then off
+} led_anim_t;
+
+typedef enum {
+    LED_COLOR_RED,
+    LED_COLOR_GREEN,
+    LED_COLOR_BLUE,
+} led_color_t;
+
+void led_init(void);
+
+// Queue an animation. Replaces whatever is currently playing.
+void led_play(led_anim_t anim, led_color_t color);
+
+// Global brightness ceiling in percent (1-100), applied to every animation.
+void led_set_brightness(uint8_t percent);
@@ -1,17 +1,23 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/i2s_std.h"
 #include "driver/gpio.h"
-#include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "nvs_flash.h"
-#include "lwip/sockets.h"
+#include "nvs.h"
 #include "mdns.h"
+#include "app.h"
+#include "hal.h"
+#include "led.h"
+#include "protocol.h"
+#include "uplink.h"
+#include "wakeword.h"
 
 static const char *TAG = "kenta";
 
@@ -21,7 +27,6 @@ static const char *TAG = "kenta";
 
 // Server — fallback IP from menuconfig, prefer mDNS resolution
 #define SERVER_IP     CONFIG_SERVER_IP
-#define SERVER_PORT   12345
 #define MDNS_HOSTNAME "kenta"
 #define MDNS_RESOLVE_RETRIES 5
 #define MDNS_RESOLVE_TIMEOUT_MS 3000
@@ -32,58 +37,27 @@ static const char *TAG = "kenta";
 #define PIN_WS   25
 #define PIN_SD   33
 
-// Button & LED pins
+// Button pin
 #define PIN_BUTTON  13
-#define PIN_LED_R   4
-#define PIN_LED_G   18
-#define PIN_LED_B   19
 
-// Audio
-#define SAMPLE_RATE   16000
+// NVS overrides for the Kconfig audio format
+#define NVS_NAMESPACE      "kenta"
+#define NVS_KEY_RATE       "sample_rate"
+#define NVS_KEY_BITS       "sample_bits"
+#define NVS_KEY_WAKE_MODEL "wake_model"     // blob from host/kenta_wake
+#define NVS_KEY_BRIGHTNESS "led_brightness" // u8 percent, overrides CONFIG_LED_BRIGHTNESS
+
+// I2S
 #define SAMPLE_BITS   I2S_DATA_BIT_WIDTH_32BIT
 #define DMA_BUF_COUNT 4
 #define DMA_BUF_LEN   256
 
-// Read 256 samples per I2S read
-#define PCM_FRAME_LEN 256
-
-// Grace period after button release (microseconds)
-#define WAIT_TIMEOUT_US (3 * 1000 * 1000)
-
-// recv() timeout in PROCESSING state (seconds)
-#define RECV_TIMEOUT_S  120
-
-// Button debounce time (microseconds)
-#define DEBOUNCE_US (30 * 1000)
-
-// Error LED flash duration (microseconds)
-#define ERROR_FLASH_US (500 * 1000)
-
-// End marker expected by server
-static const uint8_t END_MARKER[4] = {0xDE, 0xAD, 0xBE, 0xEF};
-
-// State machine
-typedef enum {
-    STATE_IDLE,
-    STATE_RECORDING,
-    STATE_WAIT,
-    STATE_PROCESSING,
-} state_t;
-
 static i2s_chan_handle_t rx_chan;
 static SemaphoreHandle_t wifi_ready;
 
-// Static buffers
-static int32_t i2s_raw[PCM_FRAME_LEN];
-static int16_t pcm_frame[PCM_FRAME_LEN];
-
 // Resolved server IP (filled by mDNS or fallback)
 static char resolved_ip[64] = {0};
 
-// Button debounce state
-static int64_t last_button_change = 0;
-static bool debounced_state = false;  // false = not pressed (button is active low)
-
 // ---------------------------------------------------------------------------
 // Button
 // ---------------------------------------------------------------------------
@@ -99,78 +73,6 @@ static void button_init(void)
     gpio_config(&cfg);
 }
 
-static bool button_pressed(void)
-{
-    bool raw = (gpio_get_level(PIN_BUTTON) == 0);  // active low
-    int64_t now = esp_timer_get_time();
-
-    if (raw != debounced_state) {
-        if (last_button_change == 0) {
-            last_button_change = now;
-        } else if (now - last_button_change > DEBOUNCE_US) {
-            debounced_state = raw;
-            last_button_change = 0;
-        }
-    } else {
-        last_button_change = 0;
-    }
-
-    return debounced_state;
-}
-
-// ---------------------------------------------------------------------------
-// RGB LED
-// ---------------------------------------------------------------------------
-static void led_init(void)
-{
-    gpio_config_t cfg = {
-        .pin_bit_mask = (1ULL << PIN_LED_R) | (1ULL << PIN_LED_G) | (1ULL << PIN_LED_B),
-        .mode = GPIO_MODE_OUTPUT,
-        .pull_up_en = GPIO_PULLUP_DISABLE,
-        .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_DISABLE,
-    };
-    gpio_config(&cfg);
-}
-
-static void led_off(void)
-{
-    gpio_set_level(PIN_LED_R, 0);
-    gpio_set_level(PIN_LED_G, 0);
-    gpio_set_level(PIN_LED_B, 0);
-}
-
-static void led_solid_blue(void)
-{
-    gpio_set_level(PIN_LED_R, 0);
-    gpio_set_level(PIN_LED_G, 0);
-    gpio_set_level(PIN_LED_B, 1);
-}
-
-static void led_solid_green(void)
-{
-    gpio_set_level(PIN_LED_R, 0);
-    gpio_set_level(PIN_LED_G, 1);
-    gpio_set_level(PIN_LED_B, 0);
-}
-
-static void led_solid_red(void)
-{
-    gpio_set_level(PIN_LED_R, 1);
-    gpio_set_level(PIN_LED_G, 0);
-    gpio_set_level(PIN_LED_B, 0);
-}
-
-static void led_flash_red(void)
-{
-    led_solid_red();
-    int64_t start = esp_timer_get_time();
-    while (esp_timer_get_time() - start < ERROR_FLASH_US) {
-        vTaskDelay(pdMS_TO_TICKS(50));
-    }
-    led_off();
-}
-
 // ---------------------------------------------------------------------------
 // WiFi
 // ---------------------------------------------------------------------------
@@ -242,10 +144,87 @@ static bool resolve_mdns_hostname(void)
     return false;
 }
 
+// ---------------------------------------------------------------------------
+// Audio format: Kconfig default, optionally overridden from NVS
+// ---------------------------------------------------------------------------
+static void load_audio_config(app_config_t *cfg)
+{
+    cfg->sample_rate = CONFIG_AUDIO_SAMPLE_RATE;
+    cfg->sample_bits = CONFIG_AUDIO_SAMPLE_BITS;
+
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;  // nothing stored yet
+    }
+
+    uint32_t rate = cfg->sample_rate;
+    uint8_t bits = cfg->sample_bits;
+    nvs_get_u32(nvs, NVS_KEY_RATE, &rate);
+    nvs_get_u8(nvs, NVS_KEY_BITS, &bits);
+    nvs_close(nvs);
+
+    if (proto_format_supported(rate, bits)) {
+        cfg->sample_rate = rate;
+        cfg->sample_bits = bits;
+    } else {
+        ESP_LOGW(TAG, "Ignoring unsupported NVS audio format %u Hz / %d-bit",
+                 (unsigned)rate, bits);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// LED brightness: Kconfig default (applied by led_init), optionally
+// overridden per device from NVS
+// ---------------------------------------------------------------------------
+static void load_led_brightness(void)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    uint8_t percent;
+    if (nvs_get_u8(nvs, NVS_KEY_BRIGHTNESS, &percent) == ESP_OK) {
+        led_set_brightness(percent);
+    }
+    nvs_close(nvs);
+}
+
+// ---------------------------------------------------------------------------
+// Wake-word model (NVS blob, enrolled with host/kenta_wake)
+// ---------------------------------------------------------------------------
+static void load_wake_model(uint32_t sample_rate)
+{
+#ifdef CONFIG_WAKEWORD
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        ESP_LOGI(TAG, "No wake-word model, push-to-talk only");
+        return;
+    }
+
+    size_t len = 0;
+    void *blob = NULL;
+    if (nvs_get_blob(nvs, NVS_KEY_WAKE_MODEL, NULL, &len) == ESP_OK) {
+        blob = malloc(len);
+    }
+    if (blob && nvs_get_blob(nvs, NVS_KEY_WAKE_MODEL, blob, &len) == ESP_OK) {
+        if (wake_load_model(blob, len, sample_rate)) {
+            ESP_LOGI(TAG, "Wake-word model loaded (%u bytes)", (unsigned)len);
+        } else {
+            ESP_LOGW(TAG, "Wake-word model invalid or not enrolled at %u Hz",
+                     (unsigned)sample_rate);
+        }
+    } else {
+        ESP_LOGI(TAG, "No wake-word model, push-to-talk only");
+    }
+    free(blob);  // wake_load_model() copies the templates
+    nvs_close(nvs);
+#endif
+}
+
 // ---------------------------------------------------------------------------
 // I2S
 // ---------------------------------------------------------------------------
-static void i2s_init(void)
+static void i2s_init(uint32_t sample_rate)
 {
     i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
     chan_cfg.dma_desc_num = DMA_BUF_COUNT;
@@ -253,7 +232,7 @@ static void i2s_init(void)
     ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, NULL, &rx_chan));
 
     i2s_std_config_t std_cfg = {
-        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(SAMPLE_RATE),
+        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(sample_rate),
         .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(SAMPLE_BITS, I2S_SLOT_MODE_MONO),
         .gpio_cfg = {
             .mclk = I2S_GPIO_UNUSED,
@@ -276,17 +255,21 @@ static void i2s_init(void)
 }
 
 // ---------------------------------------------------------------------------
-// Read one PCM frame from I2S (256 samples), convert to 16-bit
-// Returns true on success, false on error.
+// HAL (see hal.h)
 // ---------------------------------------------------------------------------
-static bool read_i2s_pcm(void)
+bool hal_button_raw(void)
+{
+    return gpio_get_level(PIN_BUTTON) == 0;  // active low
+}
+
+bool hal_audio_read(int32_t *raw, size_t samples)
 {
     size_t bytes_read;
-    int samples_got = 0;
+    size_t samples_got = 0;
 
-    while (samples_got < PCM_FRAME_LEN) {
-        int need = PCM_FRAME_LEN - samples_got;
-        esp_err_t err = i2s_channel_read(rx_chan, i2s_raw + samples_got,
+    while (samples_got < samples) {
+        size_t need = samples - samples_got;
+        esp_err_t err = i2s_channel_read(rx_chan, raw + samples_got,
                          need * sizeof(int32_t), &bytes_read, portMAX_DELAY);
         if (err != ESP_OK) {
             ESP_LOGW(TAG, "i2s_channel_read error: %s", esp_err_to_name(err));
@@ -294,38 +277,31 @@ static bool read_i2s_pcm(void)
         }
         samples_got += bytes_read / sizeof(int32_t);
     }
-
-    for (int i = 0; i < PCM_FRAME_LEN; i++) {
-        pcm_frame[i] = (int16_t)(i2s_raw[i] >> 16);
-    }
     return true;
 }
 
-// ---------------------------------------------------------------------------
-// TCP
-// ---------------------------------------------------------------------------
-static int tcp_connect(void)
+int hal_wifi_rssi(void)
 {
-    struct sockaddr_in dest = {
-        .sin_family = AF_INET,
-        .sin_port = htons(SERVER_PORT),
-    };
-    inet_pton(AF_INET, resolved_ip, &dest.sin_addr);
-
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        ESP_LOGE(TAG, "Socket creation failed");
-        return -1;
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return 0;
     }
+    return ap.rssi;
+}
 
-    if (connect(sock, (struct sockaddr *)&dest, sizeof(dest)) != 0) {
-        ESP_LOGE(TAG, "TCP connect to %s:%d failed", resolved_ip, SERVER_PORT);
-        close(sock);
-        return -1;
-    }
+void hal_delay_ms(uint32_t ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
 
-    ESP_LOGI(TAG, "Connected to server");
-    return sock;
+const char *hal_server_ip(void)
+{
+    return resolved_ip;
+}
+
+uint16_t hal_server_port(void)
+{
+    return SERVER_PORT;
 }
 
 // ---------------------------------------------------------------------------
@@ -336,10 +312,13 @@ void app_main(void)
     wifi_ready = xSemaphoreCreateBinary();
 
     wifi_init();
-    i2s_init();
+
+    app_config_t cfg;
+    load_audio_config(&cfg);
+    i2s_init(cfg.sample_rate);
     button_init();
     led_init();
-    led_off();
+    load_led_brightness();
 
     // Wait for WiFi
     ESP_LOGI(TAG, "Waiting for WiFi...");
@@ -352,167 +331,15 @@ void app_main(void)
         resolved_ip[sizeof(resolved_ip) - 1] = '\0';
     }
 
-    // Discard startup I2S samples
-    for (int i = 0; i < 8; i++) {
-        read_i2s_pcm();
-    }
-
-    ESP_LOGI(TAG, "Ready — press button to talk");
-
-    state_t state = STATE_IDLE;
-    int sock = -1;
-    int64_t wait_start = 0;
-    int64_t process_start = 0;
-    bool led_on = false;
-    int64_t last_blink = 0;
+#ifdef CONFIG_UPLINK_ADAPTIVE
+    uplink_init(true);
+#else
+    uplink_init(false);
+#endif
+    load_wake_model(cfg.sample_rate);
+    app_init(&cfg);
 
     while (1) {
-        switch (state) {
-
-        // ==== IDLE: wait for button press ====
-        case STATE_IDLE:
-            if (button_pressed()) {
-                sock = tcp_connect();
-                if (sock < 0) {
-                    led_flash_red();
-                    // Wait for button release before retrying
-                    while (button_pressed()) {
-                        vTaskDelay(pdMS_TO_TICKS(50));
-                    }
-                    break;
-                }
-                led_solid_blue();
-                state = STATE_RECORDING;
-                ESP_LOGI(TAG, "Recording...");
-            } else {
-                vTaskDelay(pdMS_TO_TICKS(20));
-            }
-            break;
-
-        // ==== RECORDING: stream audio while button is held ====
-        case STATE_RECORDING:
-            if (!read_i2s_pcm()) {
-                ESP_LOGW(TAG, "I2S read error, retrying...");
-                break;
-            }
-            if (send(sock, pcm_frame, PCM_FRAME_LEN * sizeof(int16_t), 0) < 0) {
-                ESP_LOGE(TAG, "send() failed, aborting");
-                close(sock);
-                sock = -1;
-                led_flash_red();
-                state = STATE_IDLE;
-                break;
-            }
-
-            if (!button_pressed()) {
-                // Button released — enter WAIT state
-                wait_start = esp_timer_get_time();
-                last_blink = wait_start;
-                led_on = true;  // start with LED on (already blue)
-                state = STATE_WAIT;
-                ESP_LOGI(TAG, "Button released, waiting 3s...");
-            }
-            break;
-
-        // ==== WAIT: 3s grace period, blink blue ====
-        case STATE_WAIT: {
-            int64_t now = esp_timer_get_time();
-
-            // Blink blue at ~1.5 Hz (toggle every 333ms)
-            if (now - last_blink > 333 * 1000) {
-                led_on = !led_on;
-                gpio_set_level(PIN_LED_B, led_on ? 1 : 0);
-                last_blink = now;
-            }
-
-            if (button_pressed()) {
-                // Resume recording
-                led_solid_blue();
-                state = STATE_RECORDING;
-                ESP_LOGI(TAG, "Button pressed again, resuming recording...");
-                break;
-            }
-
-            if (now - wait_start > WAIT_TIMEOUT_US) {
-                // Grace period expired — send end marker and wait for server
-                ESP_LOGI(TAG, "Grace period expired, processing...");
-                if (send(sock, END_MARKER, sizeof(END_MARKER), 0) < 0) {
-                    ESP_LOGE(TAG, "send() end marker failed");
-                    close(sock);
-                    sock = -1;
-                    led_flash_red();
-                    state = STATE_IDLE;
-                    break;
-                }
-
-                // Switch to solid green
-                led_solid_green();
-                process_start = esp_timer_get_time();
-                state = STATE_PROCESSING;
-            } else {
-                // Keep streaming audio during wait (captures trailing speech)
-                if (!read_i2s_pcm()) {
-                    ESP_LOGW(TAG, "I2S read error during wait, retrying...");
-                    break;
-                }
-                if (send(sock, pcm_frame, PCM_FRAME_LEN * sizeof(int16_t), 0) < 0) {
-                    ESP_LOGE(TAG, "send() failed during wait");
-                    close(sock);
-                    sock = -1;
-                    led_flash_red();
-                    state = STATE_IDLE;
-                }
-            }
-            break;
-        }
-
-        // ==== PROCESSING: solid green, wait for server done byte ====
-        case STATE_PROCESSING: {
-            fd_set readfds;
-            struct timeval tv;
-            FD_ZERO(&readfds);
-            FD_SET(sock, &readfds);
-            tv.tv_sec = 0;
-            tv.tv_usec = 100 * 1000;  // 100ms timeout for select
-
-            int ret = select(sock + 1, &readfds, NULL, NULL, &tv);
-
-            if (ret > 0 && FD_ISSET(sock, &readfds)) {
-                uint8_t done_byte;
-                int n = recv(sock, &done_byte, 1, 0);
-                if (n == 1 && done_byte == 0x01) {
-                    ESP_LOGI(TAG, "Server done, back to idle");
-                } else {
-                    ESP_LOGW(TAG, "Unexpected recv result (n=%d), returning to idle", n);
-                }
-                close(sock);
-                sock = -1;
-                led_off();
-                state = STATE_IDLE;
-                break;
-            }
-
-            if (ret < 0) {
-                ESP_LOGE(TAG, "select() error, returning to idle");
-                close(sock);
-                sock = -1;
-                led_flash_red();
-                state = STATE_IDLE;
-                break;
-            }
-
-            // Overall timeout check (use process_start, not wait_start)
-            int64_t now = esp_timer_get_time();
-            if (now - process_start > (int64_t)RECV_TIMEOUT_S * 1000 * 1000) {
-                ESP_LOGW(TAG, "Processing timeout (%ds), returning to idle", RECV_TIMEOUT_S);
-                close(sock);
-                sock = -1;
-                led_flash_red();
-                state = STATE_IDLE;
-                break;
-            }
-            break;
-        }
-        }
+        app_step();
     }
 }
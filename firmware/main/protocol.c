@@ -0,0 +1,98 @@
+#include "protocol.h"
+
+#include "esp_log.h"
+
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static const char *TAG = "proto";
+
+const uint8_t PROTO_END_MARKER[PROTO_END_MARKER_LEN] = {0xDE, 0xAD, 0xBE, 0xEF};
+
+bool proto_format_supported(uint32_t sample_rate, uint8_t bits)
+{
+    bool rate_ok = (sample_rate == 8000 || sample_rate == 12000 ||
+                    sample_rate == 16000 || sample_rate == 24000);
+    return rate_ok && (bits == 16 || bits == 24);
+}
+
+int proto_connect(const char *ip, uint16_t port)
+{
+    struct sockaddr_in dest = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+    inet_pton(AF_INET, ip, &dest.sin_addr);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Socket creation failed");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *)&dest, sizeof(dest)) != 0) {
+        ESP_LOGE(TAG, "TCP connect to %s:%d failed", ip, port);
+        close(sock);
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Connected to server");
+    return sock;
+}
+
+bool proto_send_all(int sock, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0) {
+        int n = send(sock, p, len, 0);
+        if (n < 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool proto_send_header(int sock, uint8_t codec, uint32_t sample_rate, uint8_t bits)
+{
+    uint8_t hdr[PROTO_HEADER_LEN] = {
+        'K', 'N', 'T', 'A',
+        PROTO_VERSION,
+        codec,
+        bits,
+        1,  // mono
+        sample_rate & 0xFF,
+        (sample_rate >> 8) & 0xFF,
+        (sample_rate >> 16) & 0xFF,
+        (sample_rate >> 24) & 0xFF,
+    };
+    return proto_send_all(sock, hdr, sizeof(hdr));
+}
+
+bool proto_recv_all(int sock, void *data, size_t len)
+{
+    uint8_t *p = data;
+    while (len > 0) {
+        int n = recv(sock, p, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+void proto_close(int sock)
+{
+    if (sock >= 0) {
+        close(sock);
+    }
+}
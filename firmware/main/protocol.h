@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Wire protocol between the device and server.py
+//
+// One push-to-talk interaction is one TCP connection:
+//   device -> server: stream header, LE PCM, then END_MARKER
+//   server -> device: downlink messages, one type byte each:
+//     PROTO_MSG_REF   u16 LE length, then 16-bit LE PCM at the stream's
+//                     sample rate: the audio currently playing on the
+//                     speaker, sent in real time as the echo reference
+//     PROTO_MSG_DONE  playback has finished (no payload, always last)
+//     PROTO_MSG_STOP  the server heard the end of speech (no payload, may
+//                     arrive while recording): finish the stream with
+//                     END_MARKER now instead of waiting out the grace period
+//     PROTO_MSG_PLAYING  the reply has started playing and the device is
+//                     free for its next interaction (no payload, sent
+//                     instead of PROTO_MSG_DONE when the server releases
+//                     devices early, always last)
+//
+// Stream header (12 bytes, little-endian):
+//   0  magic "KNTA"
+//   4  u8  version (PROTO_VERSION; 2 = the device acts on PROTO_MSG_STOP)
+//   5  u8  codec (PROTO_CODEC_*)
+//   6  u8  bits per sample (16 or 24 for PCM, 4 for ADPCM)
+//   7  u8  channels (1)
+//   8  u32 sample rate in Hz (8000, 12000, 16000 or 24000)
+//
+// ADPCM streams are a sequence of dsp.h ADPCM blocks of
+// PROTO_ADPCM_BLOCK_SAMPLES samples each; the last block is zero-padded.
+//
+// Streams without a header are treated as 16 kHz 16-bit mono by the server.
+// ---------------------------------------------------------------------------
+
+#define SERVER_PORT 12345
+
+#define PROTO_HEADER_LEN 12
+#define PROTO_VERSION    2
+#define PROTO_CODEC_PCM  0
+#define PROTO_CODEC_IMA_ADPCM 1
+
+#define PROTO_ADPCM_BLOCK_SAMPLES 256
+
+#define PROTO_END_MARKER_LEN 4
+extern const uint8_t PROTO_END_MARKER[PROTO_END_MARKER_LEN];
+
+#define PROTO_MSG_DONE 0x01
+#define PROTO_MSG_REF  0x02
+#define PROTO_MSG_PLAYING 0x03
+#define PROTO_MSG_STOP 0x04
+
+// Largest PROTO_MSG_REF payload the device accepts
+#define PROTO_REF_MAX_BYTES 2048
+
+// True if the server accepts this sample rate / bit depth combination.
+bool proto_format_supported(uint32_t sample_rate, uint8_t bits);
+
+// Connect to the server. Returns a socket, or -1 on failure.
+int proto_connect(const char *ip, uint16_t port);
+
+// Send the whole buffer, retrying short writes. Returns false on error.
+bool proto_send_all(int sock, const void *data, size_t len);
+
+// Receive exactly *len* bytes. Returns false on error or disconnect.
+bool proto_recv_all(int sock, void *data, size_t len);
+
+// Announce the audio format. Must be the first thing sent on a connection.
+bool proto_send_header(int sock, uint8_t codec, uint32_t sample_rate, uint8_t bits);
+
+void proto_close(int sock);
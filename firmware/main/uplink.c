@@ -0,0 +1,74 @@
+#include "uplink.h"
+
+#include "esp_log.h"
+#include "protocol.h"
+
+static const char *TAG = "uplink";
+
+// RSSI thresholds (dBm) below which we step down a tier
+#define RSSI_ADPCM       (-67)
+#define RSSI_HALF_RATE   (-75)
+
+// Stalled-frame ratio (percent, smoothed) above which we step down a tier
+#define STALL_PCT_ADPCM       5
+#define STALL_PCT_HALF_RATE   20
+
+// Weight of the newest interaction in the stall average (percent)
+#define STALL_EWMA_NEW_PCT    50
+
+static bool adaptive_enabled;
+static uint32_t stall_pct_avg;  // smoothed stalled-frame percentage
+
+void uplink_init(bool adaptive)
+{
+    adaptive_enabled = adaptive;
+    stall_pct_avg = 0;
+}
+
+uplink_mode_t uplink_choose(int rssi, uint32_t sample_rate)
+{
+    if (!adaptive_enabled) {
+        return UPLINK_PCM;
+    }
+
+    uplink_mode_t mode = UPLINK_PCM;
+    if (rssi != 0 && rssi < RSSI_HALF_RATE) {
+        mode = UPLINK_ADPCM_HALF_RATE;
+    } else if (rssi != 0 && rssi < RSSI_ADPCM) {
+        mode = UPLINK_ADPCM;
+    }
+
+    if (stall_pct_avg >= STALL_PCT_HALF_RATE) {
+        mode = UPLINK_ADPCM_HALF_RATE;
+    } else if (stall_pct_avg >= STALL_PCT_ADPCM && mode < UPLINK_ADPCM) {
+        mode = UPLINK_ADPCM;
+    }
+
+    // Half rate only where the result is still a rate the server accepts
+    if (mode == UPLINK_ADPCM_HALF_RATE && !proto_format_supported(sample_rate / 2, 16)) {
+        mode = UPLINK_ADPCM;
+    }
+
+    ESP_LOGI(TAG, "RSSI %d dBm, stalls %u%% -> %s",
+             rssi, (unsigned)stall_pct_avg, uplink_mode_name(mode));
+    return mode;
+}
+
+void uplink_record(uint32_t frames, uint32_t stalled_frames)
+{
+    if (frames == 0) {
+        return;
+    }
+    uint32_t pct = stalled_frames * 100 / frames;
+    stall_pct_avg = (pct * STALL_EWMA_NEW_PCT + stall_pct_avg * (100 - STALL_EWMA_NEW_PCT)) / 100;
+}
+
+const char *uplink_mode_name(uplink_mode_t mode)
+{
+    switch (mode) {
+    case UPLINK_PCM: return "PCM";
+    case UPLINK_ADPCM: return "ADPCM";
+    case UPLINK_ADPCM_HALF_RATE: return "ADPCM/2";
+    }
+    return "?";
+}
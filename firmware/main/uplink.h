@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Adaptive uplink codec selection
+//
+// Picks the cheapest encoding needed for the current link before each
+// interaction, from live RSSI and the share of frames whose send() stalled
+// in recent interactions. Tiers, in increasing compression:
+//   PCM                  rate x bits          e.g. 256 kbit/s at 16 kHz/16-bit
+//   ADPCM                rate x 4 bits        64 kbit/s
+//   ADPCM at half rate   rate / 2 x 4 bits    32 kbit/s
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    UPLINK_PCM,
+    UPLINK_ADPCM,
+    UPLINK_ADPCM_HALF_RATE,
+} uplink_mode_t;
+
+// With *adaptive* false, uplink_choose() always returns UPLINK_PCM.
+void uplink_init(bool adaptive);
+
+// Choose the mode for the next interaction. *rssi* is in dBm (0 if unknown).
+uplink_mode_t uplink_choose(int rssi, uint32_t sample_rate);
+
+// Report how many of an interaction's frames stalled in send().
+void uplink_record(uint32_t frames, uint32_t stalled_frames);
+
+const char *uplink_mode_name(uplink_mode_t mode);
@@ -0,0 +1,541 @@
+#include "wakeword.h"
+
+#include <math.h>
+#include <string.h>
+#include "esp_timer.h"
+
+// Front end: 16 ms hop at every rate, window of two hops (at most FFT_MAX)
+#define FFT_MAX         512
+#define HOP_MS          16
+#define MEL_BANDS       24
+#define MEL_LOW_HZ      100.0f
+#define MEL_HIGH_HZ     4000.0f
+#define PREEMPHASIS     0.97f
+#define MEL_FLOOR       1e-3f   // -30 dB
+
+// A match has to cover between half and twice the template's duration...
+#define MATCH_MIN_STRETCH   0.5f
+#define MATCH_MAX_STRETCH   2.0f
+// ...and average this far above the noise floor over that span.
+#define SPEECH_MARGIN_DB    10.0f
+
+// The noise floor follows drops immediately and rises slowly (~1 dB/s), so
+// speech barely moves it.
+#define NOISE_RISE_DB       0.02f
+
+#define LEVEL_HISTORY       (2 * WAKE_MAX_FRAMES)    // MATCH_MAX_STRETCH templates
+
+// Enrollment trims a clip to the frames within this of its loudest frame
+#define TRIM_RANGE_DB       25.0f
+
+#define COST_INF            1e30f
+
+// Feature tables, rebuilt when the sample rate changes
+static uint32_t table_rate;
+static size_t win_len;
+static size_t hop_len;
+static size_t fft_len;
+static float window[FFT_MAX];
+static float twiddle_re[FFT_MAX / 2];
+static float twiddle_im[FFT_MAX / 2];
+static float mel_bin[MEL_BANDS + 2];    // band edges in FFT bins
+static float dct[WAKE_MFCC_DIMS][MEL_BANDS];
+
+static float fft_re[FFT_MAX];
+static float fft_im[FFT_MAX];
+
+// Model
+static float templates[WAKE_MAX_TEMPLATES][WAKE_MAX_FRAMES][WAKE_MFCC_DIMS];
+static uint16_t template_len[WAKE_MAX_TEMPLATES];
+static int template_count;
+static float threshold;
+static uint32_t model_rate;
+
+// Streaming state: one open DTW column per template. For every template
+// frame, the cheapest path ending there: accumulated cost, steps taken and
+// the input frame it started at.
+static float path_cost[WAKE_MAX_TEMPLATES][WAKE_MAX_FRAMES];
+static uint16_t path_steps[WAKE_MAX_TEMPLATES][WAKE_MAX_FRAMES];
+static uint32_t path_start[WAKE_MAX_TEMPLATES][WAKE_MAX_FRAMES];
+
+static int16_t live_buf[FFT_MAX];
+static size_t live_fill;
+static uint32_t frame_index;
+static float level_hist[LEVEL_HISTORY];
+static float noise_floor;
+static bool noise_floor_valid;
+static uint32_t refractory;
+
+static wake_stats_t stats;
+
+// ---------------------------------------------------------------------------
+// Feature extraction
+// ---------------------------------------------------------------------------
+static float hz_to_mel(float hz)
+{
+    return 2595.0f * log10f(1.0f + hz / 700.0f);
+}
+
+static float mel_to_hz(float mel)
+{
+    return 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f);
+}
+
+static void setup_tables(uint32_t rate)
+{
+    if (rate == table_rate) {
+        return;
+    }
+    table_rate = rate;
+    hop_len = rate * HOP_MS / 1000;
+    win_len = 2 * hop_len < FFT_MAX ? 2 * hop_len : FFT_MAX;
+    for (fft_len = 64; fft_len < win_len; fft_len *= 2) {
+    }
+
+    const float pi = 3.14159265f;
+    for (size_t i = 0; i < win_len; i++) {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * pi * i / (win_len - 1));
+    }
+    for (size_t k = 0; k < fft_len / 2; k++) {
+        twiddle_re[k] = cosf(2.0f * pi * k / fft_len);
+        twiddle_im[k] = -sinf(2.0f * pi * k / fft_len);
+    }
+
+    float high = MEL_HIGH_HZ < rate / 2.0f - 100.0f ? MEL_HIGH_HZ : rate / 2.0f - 100.0f;
+    float mel_lo = hz_to_mel(MEL_LOW_HZ);
+    float mel_hi = hz_to_mel(high);
+    for (int b = 0; b < MEL_BANDS + 2; b++) {
+        float hz = mel_to_hz(mel_lo + (mel_hi - mel_lo) * b / (MEL_BANDS + 1));
+        mel_bin[b] = hz * fft_len / rate;
+    }
+
+    for (int d = 0; d < WAKE_MFCC_DIMS; d++) {
+        for (int b = 0; b < MEL_BANDS; b++) {
+            // c0 (overall level) is skipped so matching ignores loudness
+            dct[d][b] = cosf(pi * (d + 1) * (b + 0.5f) / MEL_BANDS) * sqrtf(2.0f / MEL_BANDS);
+        }
+    }
+}
+
+// In-place radix-2 FFT of fft_re/fft_im.
+static void fft(void)
+{
+    size_t n = fft_len;
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            float t = fft_re[i];
+            fft_re[i] = fft_re[j];
+            fft_re[j] = t;
+            t = fft_im[i];
+            fft_im[i] = fft_im[j];
+            fft_im[j] = t;
+        }
+    }
+    for (size_t len = 2; len <= n; len <<= 1) {
+        size_t step = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t k = 0; k < len / 2; k++) {
+                float wr = twiddle_re[k * step];
+                float wi = twiddle_im[k * step];
+                size_t a = i + k;
+                size_t b = a + len / 2;
+                float tr = fft_re[b] * wr - fft_im[b] * wi;
+                float ti = fft_re[b] * wi + fft_im[b] * wr;
+                fft_re[b] = fft_re[a] - tr;
+                fft_im[b] = fft_im[a] - ti;
+                fft_re[a] += tr;
+                fft_im[a] += ti;
+            }
+        }
+    }
+}
+
+float wake_level_db(const int16_t *pcm, size_t n)
+{
+    float energy = 0;
+    for (size_t i = 0; i < n; i++) {
+        energy += (float)pcm[i] * pcm[i];
+    }
+    return 10.0f * log10f(energy / (n ? n : 1) + 1.0f);
+}
+
+// MFCCs of one window of win_len samples.
+static void compute_mfcc(const int16_t *x, float *mfcc)
+{
+    for (size_t i = 0; i < fft_len; i++) {
+        if (i < win_len) {
+            float prev = i > 0 ? x[i - 1] : x[0];
+            fft_re[i] = (x[i] - PREEMPHASIS * prev) * window[i];
+        } else {
+            fft_re[i] = 0;
+        }
+        fft_im[i] = 0;
+    }
+    fft();
+
+    float mel[MEL_BANDS];
+    float peak = 0;
+    for (int b = 0; b < MEL_BANDS; b++) {
+        float lo = mel_bin[b];
+        float mid = mel_bin[b + 1];
+        float hi = mel_bin[b + 2];
+        float sum = 0;
+        for (size_t k = (size_t)lo + 1; k < hi && k <= fft_len / 2; k++) {
+            float w = k < mid ? (k - lo) / (mid - lo) : (hi - k) / (hi - mid);
+            sum += w * (fft_re[k] * fft_re[k] + fft_im[k] * fft_im[k]);
+        }
+        mel[b] = sum;
+        peak = sum > peak ? sum : peak;
+    }
+
+    // Clamp bands to a fixed range below the frame's strongest one, so the
+    // shape of quiet bands (mostly background noise) doesn't depend on how
+    // loud the speaker is
+    float log_mel[MEL_BANDS];
+    float floor = peak * MEL_FLOOR + 1.0f;
+    for (int b = 0; b < MEL_BANDS; b++) {
+        log_mel[b] = logf(mel[b] > floor ? mel[b] : floor);
+    }
+
+    for (int d = 0; d < WAKE_MFCC_DIMS; d++) {
+        float c = 0;
+        for (int b = 0; b < MEL_BANDS; b++) {
+            c += dct[d][b] * log_mel[b];
+        }
+        mfcc[d] = c;
+    }
+}
+
+static float frame_distance(const float *a, const float *b)
+{
+    float sum = 0;
+    for (int d = 0; d < WAKE_MFCC_DIMS; d++) {
+        float diff = a[d] - b[d];
+        sum += diff * diff;
+    }
+    return sqrtf(sum);
+}
+
+// ---------------------------------------------------------------------------
+// Model
+// ---------------------------------------------------------------------------
+static const uint8_t *read_u16(const uint8_t *p, uint16_t *v)
+{
+    *v = (uint16_t)(p[0] | (p[1] << 8));
+    return p + 2;
+}
+
+bool wake_load_model(const void *blob, size_t len, uint32_t sample_rate)
+{
+    const uint8_t *p = blob;
+    const uint8_t *end = p + len;
+
+    template_count = 0;
+    if (len < 16 || memcmp(p, WAKE_MODEL_MAGIC, 4) != 0) {
+        return false;
+    }
+
+    uint32_t rate;
+    uint16_t count;
+    uint16_t dims;
+    float thr;
+    memcpy(&rate, p + 4, 4);  // both targets are little-endian
+    read_u16(p + 8, &count);
+    read_u16(p + 10, &dims);
+    memcpy(&thr, p + 12, 4);
+    p += 16;
+
+    if (rate != sample_rate || dims != WAKE_MFCC_DIMS ||
+        count == 0 || count > WAKE_MAX_TEMPLATES) {
+        return false;
+    }
+
+    for (int t = 0; t < count; t++) {
+        uint16_t frames;
+        if (end - p < 2) {
+            return false;
+        }
+        p = read_u16(p, &frames);
+        size_t bytes = (size_t)frames * WAKE_MFCC_DIMS * sizeof(float);
+        if (frames < 2 || frames > WAKE_MAX_FRAMES || (size_t)(end - p) < bytes) {
+            return false;
+        }
+        memcpy(templates[t], p, bytes);
+        template_len[t] = frames;
+        p += bytes;
+    }
+
+    setup_tables(sample_rate);
+    model_rate = sample_rate;
+    threshold = thr;
+    template_count = count;
+    memset(&stats, 0, sizeof(stats));
+    noise_floor_valid = false;
+    wake_reset();
+    return true;
+}
+
+bool wake_enabled(void)
+{
+    return template_count > 0;
+}
+
+void wake_reset(void)
+{
+    for (int t = 0; t < WAKE_MAX_TEMPLATES; t++) {
+        for (int j = 0; j < WAKE_MAX_FRAMES; j++) {
+            path_cost[t][j] = COST_INF;
+            path_steps[t][j] = 1;
+        }
+    }
+    live_fill = 0;
+    refractory = 0;
+    stats.best_score = COST_INF;
+}
+
+// ---------------------------------------------------------------------------
+// Streaming detection
+// ---------------------------------------------------------------------------
+
+// Advance template *t*'s DTW column by one input frame. Paths may start at
+// any input frame (subsequence matching); each step takes the predecessor
+// with the lowest mean cost.
+static void advance_path(int t, const float *mfcc)
+{
+    float *cost = path_cost[t];
+    uint16_t *steps = path_steps[t];
+    uint32_t *start = path_start[t];
+
+    float diag_cost = cost[0];
+    uint16_t diag_steps = steps[0];
+    uint32_t diag_start = start[0];
+
+    cost[0] = frame_distance(mfcc, templates[t][0]);
+    steps[0] = 1;
+    start[0] = frame_index;
+
+    for (int j = 1; j < template_len[t]; j++) {
+        float d = frame_distance(mfcc, templates[t][j]);
+
+        // diagonal (old j-1), horizontal (old j), vertical (new j-1)
+        float best_cost = diag_cost;
+        uint16_t best_steps = diag_steps;
+        uint32_t best_start = diag_start;
+        if ((cost[j] + d) / (steps[j] + 1) < (best_cost + d) / (best_steps + 1)) {
+            best_cost = cost[j];
+            best_steps = steps[j];
+            best_start = start[j];
+        }
+        if ((cost[j - 1] + d) / (steps[j - 1] + 1) < (best_cost + d) / (best_steps + 1)) {
+            best_cost = cost[j - 1];
+            best_steps = steps[j - 1];
+            best_start = start[j - 1];
+        }
+
+        diag_cost = cost[j];
+        diag_steps = steps[j];
+        diag_start = start[j];
+
+        cost[j] = best_cost + d;
+        steps[j] = best_steps + 1;
+        start[j] = best_start;
+    }
+}
+
+// Check whether template *t* has a complete, plausible match ending now.
+static bool path_matches(int t, float *score)
+{
+    int last = template_len[t] - 1;
+    *score = path_cost[t][last] / path_steps[t][last];
+    if (*score > threshold) {
+        return false;
+    }
+
+    uint32_t span = frame_index - path_start[t][last] + 1;
+    if (span < MATCH_MIN_STRETCH * template_len[t] || span > MATCH_MAX_STRETCH * template_len[t]) {
+        return false;
+    }
+
+    float level = 0;
+    for (uint32_t i = 0; i < span; i++) {
+        level += level_hist[(frame_index - i) % LEVEL_HISTORY];
+    }
+    return level / span > noise_floor + SPEECH_MARGIN_DB;
+}
+
+static bool process_frame(const int16_t *x)
+{
+    float level = wake_level_db(x + win_len - hop_len, hop_len);
+    level_hist[frame_index % LEVEL_HISTORY] = level;
+    if (!noise_floor_valid || level < noise_floor) {
+        noise_floor = level;
+        noise_floor_valid = true;
+    } else {
+        noise_floor += NOISE_RISE_DB;
+    }
+
+    float mfcc[WAKE_MFCC_DIMS];
+    compute_mfcc(x, mfcc);
+
+    bool detected = false;
+    for (int t = 0; t < template_count; t++) {
+        advance_path(t, mfcc);
+        float score;
+        bool match = path_matches(t, &score);
+        if (score < stats.best_score) {
+            stats.best_score = score;
+        }
+        if (match && refractory == 0) {
+            detected = true;
+        }
+    }
+
+    if (refractory > 0) {
+        refractory--;
+    }
+    if (detected) {
+        stats.detections++;
+        // Don't fire again on the tail of the same utterance
+        refractory = WAKE_MAX_FRAMES;
+        for (int t = 0; t < template_count; t++) {
+            for (int j = 0; j < template_len[t]; j++) {
+                path_cost[t][j] = COST_INF;
+                path_steps[t][j] = 1;
+            }
+        }
+    }
+
+    frame_index++;
+    stats.frames++;
+    return detected;
+}
+
+bool wake_process(const int16_t *pcm, size_t n)
+{
+    if (!wake_enabled()) {
+        return false;
+    }
+    setup_tables(model_rate);
+
+    bool detected = false;
+    while (n > 0) {
+        size_t take = win_len - live_fill < n ? win_len - live_fill : n;
+        memcpy(live_buf + live_fill, pcm, take * sizeof(int16_t));
+        live_fill += take;
+        pcm += take;
+        n -= take;
+
+        if (live_fill == win_len) {
+            int64_t t0 = esp_timer_get_time();
+            detected |= process_frame(live_buf);
+            uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+            stats.busy_us += us;
+            if (us > stats.max_frame_us) {
+                stats.max_frame_us = us;
+            }
+            memmove(live_buf, live_buf + hop_len, (win_len - hop_len) * sizeof(int16_t));
+            live_fill = win_len - hop_len;
+        }
+    }
+    return detected;
+}
+
+float wake_noise_floor_db(void)
+{
+    return noise_floor;
+}
+
+void wake_get_stats(wake_stats_t *out)
+{
+    *out = stats;
+}
+
+// ---------------------------------------------------------------------------
+// Enrollment
+// ---------------------------------------------------------------------------
+size_t wake_extract_features(const int16_t *pcm, size_t n, uint32_t sample_rate,
+                             float *feat, size_t max_frames)
+{
+    setup_tables(sample_rate);
+    if (n < win_len) {
+        return 0;
+    }
+    size_t total = (n - win_len) / hop_len + 1;
+
+    // Trim to the span of frames close to the loudest one
+    float peak = 0;
+    for (size_t f = 0; f < total; f++) {
+        float level = wake_level_db(pcm + f * hop_len, win_len);
+        if (level > peak) {
+            peak = level;
+        }
+    }
+    size_t first = total;
+    size_t last = 0;
+    for (size_t f = 0; f < total; f++) {
+        if (wake_level_db(pcm + f * hop_len, win_len) > peak - TRIM_RANGE_DB) {
+            if (first == total) {
+                first = f;
+            }
+            last = f;
+        }
+    }
+    if (first == total) {
+        return 0;
+    }
+
+    size_t frames = last - first + 1 < max_frames ? last - first + 1 : max_frames;
+    for (size_t f = 0; f < frames; f++) {
+        compute_mfcc(pcm + (first + f) * hop_len, feat + f * WAKE_MFCC_DIMS);
+    }
+    return frames;
+}
+
+float wake_dtw_distance(const float *a, size_t na, const float *b, size_t nb)
+{
+    static float prev_cost[WAKE_MAX_FRAMES];
+    static float cur_cost[WAKE_MAX_FRAMES];
+    static uint16_t prev_steps[WAKE_MAX_FRAMES];
+    static uint16_t cur_steps[WAKE_MAX_FRAMES];
+
+    if (na == 0 || nb == 0 || nb > WAKE_MAX_FRAMES) {
+        return COST_INF;
+    }
+
+    for (size_t i = 0; i < na; i++) {
+        for (size_t j = 0; j < nb; j++) {
+            float d = frame_distance(a + i * WAKE_MFCC_DIMS, b + j * WAKE_MFCC_DIMS);
+            float best_cost = COST_INF;
+            uint16_t best_steps = 1;
+            if (i == 0 && j == 0) {
+                best_cost = 0;
+                best_steps = 0;
+            }
+            if (i > 0 && j > 0 &&
+                (prev_cost[j - 1] + d) / (prev_steps[j - 1] + 1) < (best_cost + d) / (best_steps + 1)) {
+                best_cost = prev_cost[j - 1];
+                best_steps = prev_steps[j - 1];
+            }
+            if (i > 0 &&
+                (prev_cost[j] + d) / (prev_steps[j] + 1) < (best_cost + d) / (best_steps + 1)) {
+                best_cost = prev_cost[j];
+                best_steps = prev_steps[j];
+            }
+            if (j > 0 &&
+                (cur_cost[j - 1] + d) / (cur_steps[j - 1] + 1) < (best_cost + d) / (best_steps + 1)) {
+                best_cost = cur_cost[j - 1];
+                best_steps = cur_steps[j - 1];
+            }
+            cur_cost[j] = best_cost + d;
+            cur_steps[j] = best_steps + 1;
+        }
+        memcpy(prev_cost, cur_cost, nb * sizeof(float));
+        memcpy(prev_steps, cur_steps, nb * sizeof(uint16_t));
+    }
+    return prev_cost[nb - 1] / prev_steps[nb - 1];
+}
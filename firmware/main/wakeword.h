@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ---------------------------------------------------------------------------
+// Wake-word detector
+//
+// Template-matching keyword spotter small enough to run on every mic frame:
+// 12 MFCCs per hop (32 ms window, 16 ms hop at 16 kHz) matched against a
+// handful of enrolled examples of the keyword with streaming subsequence DTW.
+// A match must also span a plausible duration and stand clear of the
+// tracked noise floor.
+//
+// Models are enrolled offline from recordings with host/kenta_wake, which
+// uses the same feature extraction as the device, and stored as a blob:
+//   0  magic "KWW1"
+//   4  u32 sample rate (features are rate-specific)
+//   8  u16 template count, u16 coefficients per frame (WAKE_MFCC_DIMS)
+//  12  f32 detection threshold (mean DTW distance per path step)
+//  16  per template: u16 frame count, then frames x dims f32, little-endian
+// ---------------------------------------------------------------------------
+
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#endif
+
+#ifdef CONFIG_WAKEWORD
+#define WAKE_PREROLL_MS CONFIG_WAKEWORD_PREROLL_MS
+#define WAKE_SILENCE_MS CONFIG_WAKEWORD_SILENCE_MS
+#else
+#define WAKE_PREROLL_MS 1200
+#define WAKE_SILENCE_MS 900
+#endif
+
+#define WAKE_MODEL_MAGIC     "KWW1"
+#define WAKE_MFCC_DIMS       12
+#define WAKE_MAX_TEMPLATES   4
+#define WAKE_MAX_FRAMES      96   // ~1.5 s at 16 kHz
+
+typedef struct {
+    uint32_t frames;        // feature frames analysed
+    uint32_t detections;
+    uint64_t busy_us;       // time spent in wake_process()
+    uint32_t max_frame_us;  // slowest single feature frame
+    float best_score;       // lowest DTW distance seen since the last reset
+} wake_stats_t;
+
+// Load a model blob for audio at *sample_rate*. Returns false (and leaves
+// detection disabled) if the blob is malformed or enrolled at another rate.
+bool wake_load_model(const void *blob, size_t len, uint32_t sample_rate);
+
+// True once a model is loaded.
+bool wake_enabled(void);
+
+// Forget the streaming match state, e.g. after an interaction.
+void wake_reset(void);
+
+// Feed mic samples. Returns true if the keyword ended within them.
+bool wake_process(const int16_t *pcm, size_t n);
+
+// Background level of the mic in dB, tracked while listening.
+float wake_noise_floor_db(void);
+
+// Level of a block of samples in dB (re 1 LSB RMS), on the same scale as
+// wake_noise_floor_db().
+float wake_level_db(const int16_t *pcm, size_t n);
+
+void wake_get_stats(wake_stats_t *stats);
+
+// ---------------------------------------------------------------------------
+// Enrollment helpers (used by the host tool)
+// ---------------------------------------------------------------------------
+
+// Extract MFCC frames from a recording of the keyword, trimmed to the span
+// with speech energy. Writes at most *max_frames* x WAKE_MFCC_DIMS values to
+// *feat* and returns the frame count.
+size_t wake_extract_features(const int16_t *pcm, size_t n, uint32_t sample_rate,
+                             float *feat, size_t max_frames);
+
+// Mean per-step DTW distance between two feature sequences (whole-sequence
+// alignment), on the same scale as the model threshold.
+float wake_dtw_distance(const float *a, size_t na, const float *b, size_t nb);
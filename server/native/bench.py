@@ -0,0 +1,100 @@
+"""
+Compare the native DSP module against the server's Python fallbacks.
+
+    cmake -S server/native -B build-native && cmake --build build-native
+    PYTHONPATH=build-native python server/native/bench.py [--seconds 10]
+
+Each operation runs on the same audio both ways; the output must match and
+the table shows the best time of a few runs.
+"""
+
+import argparse
+import importlib.util
+import math
+import os
+import random
+import struct
+import sys
+import time
+from pathlib import Path
+
+os.environ.setdefault("OPENAI_API_KEY", "unused")  # the client is built at import, never called
+
+SERVER_DIR = Path(__file__).resolve().parent.parent
+sys.path.insert(0, str(SERVER_DIR))
+import server  # noqa: E402
+import test_client  # noqa: E402
+
+try:
+    import kenta_dsp
+except ImportError:
+    sys.exit("kenta_dsp not found: build server/native and put it on PYTHONPATH")
+
+
+def speech_like(seconds: float, rate: int = 16000) -> bytes:
+    """Tone bursts with quiet gaps and a little noise, as 16-bit PCM."""
+    rng = random.Random(1)
+    samples = []
+    for i in range(int(seconds * rate)):
+        burst = (i // (rate // 2)) % 3 != 2
+        tone = 8000 * math.sin(2 * math.pi * 220 * i / rate) if burst else 0.0
+        samples.append(int(tone + rng.gauss(0, 30)))
+    return struct.pack(f"<{len(samples)}h", *samples)
+
+
+def best_of(fn, runs: int) -> tuple[float, object]:
+    best, result = math.inf, None
+    for _ in range(runs):
+        start = time.perf_counter()
+        result = fn()
+        best = min(best, time.perf_counter() - start)
+    return best, result
+
+
+def vad_frames(pcm: bytes):
+    vad = server.EnergyVad()
+    frame = 2 * 16000 * server.ENDPOINT_FRAME_MS // 1000
+    return [vad(pcm[i : i + frame], 16000) for i in range(0, len(pcm) - frame + 1, frame)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--seconds", type=float, default=10.0, help="audio length (default: 10)")
+    parser.add_argument("--runs", type=int, default=3, help="runs per measurement (default: 3)")
+    args = parser.parse_args()
+
+    pcm = speech_like(args.seconds)
+    pcm24 = b"".join(b"\x00" + pcm[i : i + 2] for i in range(0, len(pcm), 2))
+    stereo = b"".join(pcm[i : i + 2] * 2 for i in range(0, len(pcm), 2))
+    adpcm = bytes(random.Random(2).randbytes(len(pcm) // 4))
+    fmt = server.DEFAULT_FORMAT
+
+    cases = [
+        ("adpcm_decode", server, lambda: server.adpcm_decode(adpcm)),
+        ("pcm_to_16bit (24-bit)", server, lambda: server.pcm_to_16bit(pcm24, 3)),
+        ("resample_pcm16 16k->24k", server, lambda: server.resample_pcm16(pcm, 16000, 24000)),
+        ("trim_silence", server, lambda: server.trim_silence(pcm, fmt)),
+        ("encode_flac", server, lambda: server.encode_flac(pcm, fmt)),
+        ("EnergyVad (20 ms frames)", server, lambda: vad_frames(pcm)),
+        ("_stereo_to_mono", test_client, lambda: test_client._stereo_to_mono(stereo, 2)),
+        ("_convert_sample_width 2->3", test_client,
+         lambda: test_client._convert_sample_width(pcm, 2, 3)),
+    ]
+
+    print(f"{args.seconds:g} s of 16 kHz audio, best of {args.runs}")
+    print(f"{'operation':<28}{'python ms':>12}{'native ms':>12}{'speedup':>10}")
+    for name, module, fn in cases:
+        native_s, native_out = best_of(fn, args.runs)
+        module.kenta_dsp = None
+        try:
+            python_s, python_out = best_of(fn, args.runs)
+        finally:
+            module.kenta_dsp = kenta_dsp
+        if native_out != python_out:
+            sys.exit(f"{name}: native and Python results differ")
+        print(f"{name:<28}{python_s * 1000:>12.2f}{native_s * 1000:>12.2f}"
+              f"{python_s / native_s:>9.0f}x")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,579 @@
+// ---------------------------------------------------------------------------
+// kenta_dsp: native versions of the server's per-sample audio loops.
+//
+// Every function takes any buffer-protocol object (bytes, bytearray,
+// memoryview) without copying it, writes its result straight into a new
+// bytes object and releases the GIL while it runs, so the pipeline's worker
+// threads can convert audio in parallel. Results are identical to the Python
+// fallbacks in server.py and test_client.py. The loops are kept simple enough
+// for the compiler to vectorize at -O3.
+// ---------------------------------------------------------------------------
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dsp.h"
+
+static int16_t load_s16(const uint8_t *p)
+{
+    return (int16_t)(p[0] | (p[1] << 8));
+}
+
+static void store_s16(uint8_t *p, int32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+// Sample of *width* bytes scaled to the full 32-bit range (8-bit is unsigned)
+static int32_t load_sample(const uint8_t *p, int width)
+{
+    switch (width) {
+    case 1:
+        return (int32_t)((uint32_t)(p[0] - 128) << 24);
+    case 2:
+        return (int32_t)((uint32_t)load_s16(p) << 16);
+    case 3:
+        return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+    default:
+        return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+                         ((uint32_t)p[3] << 24));
+    }
+}
+
+static void store_sample(uint8_t *p, int32_t s, int width)
+{
+    switch (width) {
+    case 1:
+        p[0] = (uint8_t)((s >> 24) + 128);
+        break;
+    case 2:
+        store_s16(p, s >> 16);
+        break;
+    case 3:
+        p[0] = (uint8_t)(s >> 8);
+        p[1] = (uint8_t)(s >> 16);
+        p[2] = (uint8_t)(s >> 24);
+        break;
+    default:
+        p[0] = (uint8_t)s;
+        p[1] = (uint8_t)(s >> 8);
+        p[2] = (uint8_t)(s >> 16);
+        p[3] = (uint8_t)(s >> 24);
+        break;
+    }
+}
+
+static int check_width(int width)
+{
+    if (width < 1 || width > 4) {
+        PyErr_Format(PyExc_ValueError, "Unsupported sample width: %d", width);
+        return 0;
+    }
+    return 1;
+}
+
+// New bytes object of *len* bytes to be filled in place; NULL on error.
+static PyObject *new_bytes(Py_ssize_t len, uint8_t **out)
+{
+    PyObject *result = PyBytes_FromStringAndSize(NULL, len);
+    if (result) {
+        *out = (uint8_t *)PyBytes_AS_STRING(result);
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Format conversion
+// ---------------------------------------------------------------------------
+PyDoc_STRVAR(convert_width_doc,
+"convert_width(pcm, from_width, to_width) -> bytes\n\n"
+"Convert PCM between sample widths (1/2/3/4 bytes, 8-bit unsigned).\n"
+"Narrowing keeps the top bytes of each sample.");
+
+static PyObject *convert_width(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    int from, to;
+    if (!PyArg_ParseTuple(args, "y*ii:convert_width", &in, &from, &to)) {
+        return NULL;
+    }
+    PyObject *result = NULL;
+    if (check_width(from) && check_width(to)) {
+        Py_ssize_t samples = in.len / from;
+        uint8_t *out = NULL;
+        result = new_bytes(samples * to, &out);
+        if (result) {
+            const uint8_t *src = in.buf;
+            Py_BEGIN_ALLOW_THREADS
+            if (from == 3 && to == 2) {
+                for (Py_ssize_t i = 0; i < samples; i++) {
+                    out[2 * i] = src[3 * i + 1];
+                    out[2 * i + 1] = src[3 * i + 2];
+                }
+            } else {
+                for (Py_ssize_t i = 0; i < samples; i++) {
+                    store_sample(out + i * to, load_sample(src + i * from, from), to);
+                }
+            }
+            Py_END_ALLOW_THREADS
+        }
+    }
+    PyBuffer_Release(&in);
+    return result;
+}
+
+PyDoc_STRVAR(to_mono_doc,
+"to_mono(pcm, sample_width) -> bytes\n\n"
+"Average the channels of interleaved stereo PCM (rounding down).");
+
+static PyObject *to_mono(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    int width;
+    if (!PyArg_ParseTuple(args, "y*i:to_mono", &in, &width)) {
+        return NULL;
+    }
+    PyObject *result = NULL;
+    if (check_width(width)) {
+        Py_ssize_t frames = in.len / (2 * width);
+        uint8_t *out = NULL;
+        result = new_bytes(frames * width, &out);
+        if (result) {
+            const uint8_t *src = in.buf;
+            Py_BEGIN_ALLOW_THREADS
+            if (width == 2) {
+                for (Py_ssize_t i = 0; i < frames; i++) {
+                    int32_t sum = load_s16(src + 4 * i) + load_s16(src + 4 * i + 2);
+                    store_s16(out + 2 * i, sum >> 1);
+                }
+            } else {
+                for (Py_ssize_t i = 0; i < frames; i++) {
+                    const uint8_t *p = src + 2 * i * width;
+                    int64_t sum = (int64_t)load_sample(p, width) + load_sample(p + width, width);
+                    store_sample(out + i * width, (int32_t)(sum >> 1), width);
+                }
+            }
+            Py_END_ALLOW_THREADS
+        }
+    }
+    PyBuffer_Release(&in);
+    return result;
+}
+
+PyDoc_STRVAR(resample16_doc,
+"resample16(pcm, from_rate, to_rate) -> bytes\n\n"
+"Resample 16-bit mono PCM using linear interpolation.");
+
+static PyObject *resample16(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    int from, to;
+    if (!PyArg_ParseTuple(args, "y*ii:resample16", &in, &from, &to)) {
+        return NULL;
+    }
+    Py_ssize_t samples = in.len / 2;
+    if (from <= 0 || to <= 0) {
+        PyBuffer_Release(&in);
+        PyErr_SetString(PyExc_ValueError, "sample rates must be positive");
+        return NULL;
+    }
+    if (samples == 0 || from == to) {
+        PyObject *result = PyBytes_FromStringAndSize(in.buf, in.len);
+        PyBuffer_Release(&in);
+        return result;
+    }
+
+    double ratio = (double)from / to;
+    Py_ssize_t out_len = (Py_ssize_t)(samples / ratio);
+    uint8_t *out = NULL;
+    PyObject *result = new_bytes(out_len * 2, &out);
+    if (result) {
+        const uint8_t *src = in.buf;
+        Py_BEGIN_ALLOW_THREADS
+        for (Py_ssize_t i = 0; i < out_len; i++) {
+            double pos = i * ratio;
+            Py_ssize_t idx = (Py_ssize_t)pos;
+            double frac = pos - idx;
+            double val = load_s16(src + 2 * idx);
+            if (idx + 1 < samples) {
+                val = val * (1.0 - frac) + load_s16(src + 2 * idx + 2) * frac;
+            }
+            int32_t v = (int32_t)val;
+            store_s16(out + 2 * i, v > 32767 ? 32767 : (v < -32768 ? -32768 : v));
+        }
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&in);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Levels
+// ---------------------------------------------------------------------------
+static int64_t energy16(const uint8_t *p, Py_ssize_t samples)
+{
+    int64_t sum = 0;
+    for (Py_ssize_t i = 0; i < samples; i++) {
+        int32_t x = load_s16(p + 2 * i);
+        sum += x * x;
+    }
+    return sum;
+}
+
+PyDoc_STRVAR(rms16_doc,
+"rms16(pcm) -> float\n\n"
+"Root mean square of 16-bit PCM, 0.0 for an empty buffer.");
+
+static PyObject *rms16(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    if (!PyArg_ParseTuple(args, "y*:rms16", &in)) {
+        return NULL;
+    }
+    Py_ssize_t samples = in.len / 2;
+    int64_t sum = energy16(in.buf, samples);
+    PyBuffer_Release(&in);
+    return PyFloat_FromDouble(samples ? sqrt((double)sum / samples) : 0.0);
+}
+
+PyDoc_STRVAR(loud_span_doc,
+"loud_span(pcm, frame, min_power) -> (first, last) | None\n\n"
+"Indices of the first and last *frame*-sample frame of 16-bit PCM whose\n"
+"mean power exceeds *min_power*, or None if there is none.");
+
+static PyObject *loud_span(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    Py_ssize_t frame;
+    double min_power;
+    if (!PyArg_ParseTuple(args, "y*nd:loud_span", &in, &frame, &min_power)) {
+        return NULL;
+    }
+    if (frame <= 0) {
+        PyBuffer_Release(&in);
+        PyErr_SetString(PyExc_ValueError, "frame must be positive");
+        return NULL;
+    }
+    const uint8_t *src = in.buf;
+    Py_ssize_t frames = in.len / 2 / frame;
+    double min_energy = min_power * frame;
+    Py_ssize_t first = -1, last = -1;
+
+    // Only the silence is scanned, from each end
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i = 0; i < frames && first < 0; i++) {
+        if (energy16(src + 2 * i * frame, frame) > min_energy) {
+            first = i;
+        }
+    }
+    for (Py_ssize_t i = frames - 1; first >= 0 && i >= first && last < 0; i--) {
+        if (energy16(src + 2 * i * frame, frame) > min_energy) {
+            last = i;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&in);
+    if (first < 0) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("nn", first, last);
+}
+
+// ---------------------------------------------------------------------------
+// IMA ADPCM
+// ---------------------------------------------------------------------------
+PyDoc_STRVAR(adpcm_decode_doc,
+"adpcm_decode(data, block_bytes) -> bytes\n\n"
+"Decode IMA ADPCM blocks (see firmware/main/dsp.h) to 16-bit LE PCM.\n"
+"A trailing partial block is ignored.");
+
+static PyObject *adpcm_decode(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    Py_ssize_t block;
+    if (!PyArg_ParseTuple(args, "y*n:adpcm_decode", &in, &block)) {
+        return NULL;
+    }
+    if (block <= DSP_ADPCM_HEADER_LEN) {
+        PyBuffer_Release(&in);
+        PyErr_SetString(PyExc_ValueError, "block_bytes too small");
+        return NULL;
+    }
+    Py_ssize_t blocks = in.len / block;
+    Py_ssize_t block_samples = 2 * (block - DSP_ADPCM_HEADER_LEN);
+    int16_t *pcm = PyMem_Malloc(block_samples * sizeof(int16_t));
+    uint8_t *out = NULL;
+    PyObject *result = pcm ? new_bytes(blocks * block_samples * 2, &out) : PyErr_NoMemory();
+    if (result) {
+        const uint8_t *src = in.buf;
+        Py_BEGIN_ALLOW_THREADS
+        for (Py_ssize_t b = 0; b < blocks; b++) {
+            dsp_adpcm_decode_block(src + b * block, block, pcm);
+            for (Py_ssize_t i = 0; i < block_samples; i++) {
+                store_s16(out + 2 * (b * block_samples + i), pcm[i]);
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+    PyMem_Free(pcm);
+    PyBuffer_Release(&in);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// FLAC frames (fixed predictors, one Rice partition)
+//
+// Mirrors _flac_frames_python in server.py decision for decision, so both
+// produce the same bytes.
+// ---------------------------------------------------------------------------
+#define FLAC_MAX_ORDER 4
+#define FLAC_MAX_RICE_PARAM 14
+
+typedef struct {
+    uint8_t *p;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+} bitwriter_t;
+
+static void put_bits(bitwriter_t *bw, uint64_t v, int n)
+{
+    while (n > 32) {
+        put_bits(bw, v >> 32, n - 32);
+        n = 32;
+    }
+    bw->acc = (bw->acc << n) | (v & ((1ull << n) - 1));
+    bw->bits += n;
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        bw->p[bw->pos++] = (uint8_t)(bw->acc >> bw->bits);
+    }
+}
+
+static void put_zeros(bitwriter_t *bw, uint64_t n)
+{
+    for (; n > 32; n -= 32) {
+        put_bits(bw, 0, 32);
+    }
+    put_bits(bw, 0, (int)n);
+}
+
+static uint8_t crc8(const uint8_t *p, size_t n)
+{
+    uint8_t crc = 0;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint16_t crc16_table[256];  // filled at import
+
+static void crc16_init(void)
+{
+    for (int i = 0; i < 256; i++) {
+        uint16_t c = (uint16_t)(i << 8);
+        for (int b = 0; b < 8; b++) {
+            c = (c & 0x8000) ? (uint16_t)((c << 1) ^ 0x8005) : (uint16_t)(c << 1);
+        }
+        crc16_table[i] = c;
+    }
+}
+
+static uint16_t crc16(const uint8_t *p, size_t n)
+{
+    uint16_t crc = 0;
+    for (size_t i = 0; i < n; i++) {
+        crc = (uint16_t)((crc << 8) ^ crc16_table[(crc >> 8) ^ p[i]]);
+    }
+    return crc;
+}
+
+static uint64_t zigzag(int64_t r)
+{
+    return r >= 0 ? (uint64_t)r << 1 : ((uint64_t)(-r) << 1) - 1;
+}
+
+// One subframe for *n* samples of *bps* bits; *d* and *best* are scratch.
+static void flac_subframe(bitwriter_t *bw, const int64_t *x, size_t n, int bps,
+                          int64_t *d, int64_t *best)
+{
+    size_t same = 1;
+    while (same < n && x[same] == x[0]) {
+        same++;
+    }
+    if (same == n) {
+        put_bits(bw, 0x00, 8);  // CONSTANT
+        put_bits(bw, (uint64_t)x[0], bps);
+        return;
+    }
+
+    // Order n's residual is the n-th difference; keep the smallest
+    int order = 0;
+    uint64_t best_cost = 0;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = best[i] = x[i];
+        best_cost += (uint64_t)(x[i] < 0 ? -x[i] : x[i]);
+    }
+    for (int o = 1; o <= FLAC_MAX_ORDER && (size_t)o < n; o++) {
+        uint64_t cost = 0;
+        for (size_t i = 0; i + o < n; i++) {
+            d[i] = d[i + 1] - d[i];
+            cost += (uint64_t)(d[i] < 0 ? -d[i] : d[i]);
+        }
+        if (cost < best_cost) {
+            best_cost = cost;
+            order = o;
+            memcpy(best, d, (n - o) * sizeof(*d));
+        }
+    }
+
+    size_t m = n - order;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < m; i++) {
+        sum += zigzag(best[i]);
+    }
+    int k = 0;
+    uint64_t k_cost = UINT64_MAX;
+    for (int c = 0; c <= FLAC_MAX_RICE_PARAM; c++) {
+        uint64_t cost = m * (uint64_t)(c + 1) + (sum >> c);
+        if (cost < k_cost) {
+            k_cost = cost;
+            k = c;
+        }
+    }
+    uint64_t bits = m * (uint64_t)(k + 1);
+    for (size_t i = 0; i < m; i++) {
+        bits += zigzag(best[i]) >> k;
+    }
+
+    if (order * (uint64_t)bps + 10 + bits >= n * (uint64_t)bps) {
+        put_bits(bw, 0x02, 8);  // VERBATIM
+        for (size_t i = 0; i < n; i++) {
+            put_bits(bw, (uint64_t)x[i], bps);
+        }
+        return;
+    }
+    put_bits(bw, (uint64_t)((0x08 | order) << 1), 8);  // FIXED
+    for (int i = 0; i < order; i++) {
+        put_bits(bw, (uint64_t)x[i], bps);
+    }
+    put_bits(bw, 0, 2 + 4);  // 4-bit Rice parameters, partition order 0
+    put_bits(bw, (uint64_t)k, 4);
+    for (size_t i = 0; i < m; i++) {
+        uint64_t u = zigzag(best[i]);
+        put_zeros(bw, u >> k);
+        put_bits(bw, 1, 1);
+        if (k) {
+            put_bits(bw, u, k);
+        }
+    }
+}
+
+PyDoc_STRVAR(flac_frames_doc,
+"flac_frames(pcm, sample_width, block_size) -> bytes\n\n"
+"FLAC frames for mono 16- or 24-bit PCM, the stream header not included.");
+
+static PyObject *flac_frames(PyObject *self, PyObject *args)
+{
+    Py_buffer in;
+    int width;
+    Py_ssize_t block;
+    if (!PyArg_ParseTuple(args, "y*in:flac_frames", &in, &width, &block)) {
+        return NULL;
+    }
+    if ((width != 2 && width != 3) || block < 16 || block > 65535) {
+        PyBuffer_Release(&in);
+        PyErr_SetString(PyExc_ValueError, "unsupported sample width or block size");
+        return NULL;
+    }
+    Py_ssize_t samples = in.len / width;
+    Py_ssize_t blocks = (samples + block - 1) / block;
+    int bps = 8 * width;
+    int64_t *scratch = PyMem_Malloc(3 * block * sizeof(int64_t));
+    uint8_t *out = NULL;
+    PyObject *result = scratch ? new_bytes(samples * width + blocks * 24, &out) : PyErr_NoMemory();
+    if (!result) {
+        PyMem_Free(scratch);
+        PyBuffer_Release(&in);
+        return NULL;
+    }
+
+    bitwriter_t bw = {out, 0, 0, 0};
+    const uint8_t *src = in.buf;
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t b = 0; b < blocks; b++) {
+        size_t n = (size_t)(samples - b * block < block ? samples - b * block : block);
+        int64_t *x = scratch;
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *p = src + (b * block + i) * width;
+            x[i] = width == 2 ? load_s16(p) : (load_sample(p, 3) >> 8);
+        }
+
+        size_t start = bw.pos;
+        put_bits(&bw, 0xFFF8, 16);  // sync, fixed block size
+        put_bits(&bw, 0x70, 8);     // block size in 16 bits below, rate from STREAMINFO
+        put_bits(&bw, 0x00, 8);     // mono, sample size from STREAMINFO
+        uint64_t num = (uint64_t)b;  // frame number, UTF-8 style
+        if (num < 0x80) {
+            put_bits(&bw, num, 8);
+        } else {
+            int len = 2;
+            while (num >= 1ull << (5 * len + 1)) {
+                len++;
+            }
+            put_bits(&bw, ((0xFF00u >> len) & 0xFF) | (num >> (6 * (len - 1))), 8);
+            for (int i = len - 2; i >= 0; i--) {
+                put_bits(&bw, 0x80 | ((num >> (6 * i)) & 0x3F), 8);
+            }
+        }
+        put_bits(&bw, n - 1, 16);
+        put_bits(&bw, crc8(out + start, bw.pos - start), 8);
+
+        flac_subframe(&bw, x, n, bps, scratch + block, scratch + 2 * block);
+        if (bw.bits) {
+            put_bits(&bw, 0, 8 - bw.bits);
+        }
+        put_bits(&bw, crc16(out + start, bw.pos - start), 16);
+    }
+    Py_END_ALLOW_THREADS
+    PyMem_Free(scratch);
+    PyBuffer_Release(&in);
+    _PyBytes_Resize(&result, (Py_ssize_t)bw.pos);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Module
+// ---------------------------------------------------------------------------
+static PyMethodDef kenta_dsp_methods[] = {
+    {"convert_width", convert_width, METH_VARARGS, convert_width_doc},
+    {"to_mono", to_mono, METH_VARARGS, to_mono_doc},
+    {"resample16", resample16, METH_VARARGS, resample16_doc},
+    {"rms16", rms16, METH_VARARGS, rms16_doc},
+    {"loud_span", loud_span, METH_VARARGS, loud_span_doc},
+    {"adpcm_decode", adpcm_decode, METH_VARARGS, adpcm_decode_doc},
+    {"flac_frames", flac_frames, METH_VARARGS, flac_frames_doc},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef kenta_dsp_module = {
+    PyModuleDef_HEAD_INIT,
+    "kenta_dsp",
+    "Native audio DSP for the Kenta server (optional, see server/native).",
+    -1,
+    kenta_dsp_methods,
+};
+
+PyMODINIT_FUNC PyInit_kenta_dsp(void)
+{
+    crc16_init();
+    return PyModule_Create(&kenta_dsp_module);
+}
@@ -1,24 +1,42 @@
 import argparse
+import asyncio
+import base64
+import hashlib
+import json
+import math
 import queue
+import re
+import secrets
+import shutil
 import signal
 import socket
+import sqlite3
+import struct
+import subprocess
 import wave
 import io
 import os
-import shutil
 import time
 import logging
 import threading
-import tempfile
-from http.server import HTTPServer, SimpleHTTPRequestHandler
+import weakref
+from collections import OrderedDict, deque
+from collections.abc import AsyncIterator, Iterable, Iterator
+from concurrent.futures import ThreadPoolExecutor
+from dataclasses import dataclass
 from functools import partial
-from pathlib import Path
+from xml.etree import ElementTree
 
 from dotenv import load_dotenv
 from openai import OpenAI
 import soco
 from zeroconf import Zeroconf, ServiceInfo
 
+try:
+    import kenta_dsp  # optional native audio loops, built from server/native
+except ImportError:
+    kenta_dsp = None
+
 load_dotenv()
 
 # ---------------------------------------------------------------------------
@@ -28,22 +46,168 @@ TCP_HOST = "0.0.0.0"
 TCP_PORT = 12345
 HTTP_PORT = 8731
 
+# Audio format of streams that arrive without a header (older firmware)
 SAMPLE_RATE = 16000
 SAMPLE_WIDTH = 2  # 16-bit = 2 bytes
 CHANNELS = 1
 END_MARKER = b"\xDE\xAD\xBE\xEF"
+
+# Downlink messages (see firmware/main/protocol.h)
 DONE_BYTE = b"\x01"
+MSG_REF = 0x02  # u16 LE length + 16-bit PCM echo reference
+MSG_PLAYING = 0x03  # reply started playing, device is free (instead of DONE)
+MSG_STOP = 0x04  # end of speech heard, device should end the stream
+REF_FRAME_MS = 20
+
+# With --early-done the device is released (MSG_PLAYING) as soon as its reply
+# starts playing, so a follow-up can be recorded while it is still speaking.
+# A new recording from that device then either waits for the reply to finish
+# ("queue") or cuts it off ("interrupt"). "" keeps the device busy until the
+# reply has played.
+EARLY_DONE = ""
+
+# Stream header announced by the device: magic, version, codec, bits,
+# channels, sample rate (see firmware/main/protocol.h)
+STREAM_MAGIC = b"KNTA"
+STREAM_HEADER = struct.Struct("<4sBBBBI")
+STREAM_VERSION = 2
+STREAM_VERSION_STOP = 2  # first version whose devices act on MSG_STOP
+CODEC_PCM = 0
+CODEC_IMA_ADPCM = 1
+CODEC_NAMES = {CODEC_PCM: "PCM", CODEC_IMA_ADPCM: "ADPCM"}
+ADPCM_BLOCK_SAMPLES = 256  # samples per self-contained ADPCM block
+ADPCM_BLOCK_BYTES = 4 + ADPCM_BLOCK_SAMPLES // 2
+SUPPORTED_SAMPLE_RATES = (8000, 12000, 16000, 24000)
+SUPPORTED_SAMPLE_WIDTHS = (2, 3)  # 16-bit, 24-bit
 
 OPENAI_MODEL_CHAT = "gpt-4o"
+OPENAI_MODEL_SUMMARY = "gpt-4o-mini"
 OPENAI_MODEL_TTS = "gpt-4o-mini-tts"
 OPENAI_MODEL_STT = "gpt-4o-mini-transcribe"
 OPENAI_TTS_VOICE = "onyx"
+OPENAI_TTS_PCM_RATE = 24000  # response_format="pcm" is 24 kHz 16-bit mono
+
+# Speech-to-text backend (--stt): "realtime" streams audio to the OpenAI
+# Realtime transcription API while the user is talking, "batch" uploads the
+# whole utterance at the end, "faster-whisper" and "whisper.cpp" transcribe
+# it on this machine, "local" is an offline stand-in for testing.
+STT_BACKEND = "realtime"
+STT_BACKENDS = ("realtime", "batch", "faster-whisper", "whisper.cpp", "local")
+OPENAI_REALTIME_URL = "wss://api.openai.com/v1/realtime?intent=transcription"
+OPENAI_REALTIME_RATE = 24000  # pcm16 input must be 24 kHz mono
+STT_FINAL_TIMEOUT = 10  # seconds to wait for the final transcript
+LOCAL_STT_WINDOW_S = 0.5  # audio per LocalTranscriber decoding step
+
+# The local Whisper backends load one model at startup and keep it resident.
+# At most LOCAL_STT_WORKERS utterances are decoded at once, each on
+# LOCAL_STT_THREADS cores, so the STT stage's workers can't oversubscribe the
+# CPU. faster-whisper runs int8-quantized; for whisper.cpp, pick a quantized
+# model (e.g. "base-q8_0").
+WHISPER_MODEL = "base"  # model name or path (--whisper-model)
+WHISPER_RATE = 16000  # Whisper's input sample rate
+LOCAL_STT_WORKERS = 1
+LOCAL_STT_THREADS = os.cpu_count() or 4
+
+# Leading and trailing silence is cut before an utterance is uploaded for
+# batch transcription (--trim-threshold DB, 0 disables; --trim-pad MS).
+# Frames quieter than the threshold (dB re 1 LSB RMS) count as silence.
+TRIM_THRESHOLD_DB = 45.0
+TRIM_PAD_MS = 300  # kept on either side of the speech
+TRIM_FRAME_MS = 10
+
+# Batch uploads are compressed before they leave the house (--upload-codec):
+# "flac" is lossless, "opus" (needs ffmpeg on PATH, otherwise FLAC is sent)
+# is a quarter the size again, "wav" uploads the raw PCM.
+UPLOAD_CODEC = "flac"
+UPLOAD_CODECS = ("wav", "flac", "opus")
+UPLOAD_OPUS_BITRATE = 24000  # bit/s, plenty for speech recognition
+UPLOAD_ENCODE_TIMEOUT = 10  # seconds for ffmpeg
+FLAC_BLOCK_SIZE = 4096  # samples per FLAC frame
+
+# Stream the TTS audio back to the device as an echo reference while the
+# Sonos plays it (enabled with --aec-reference). TTS is then served as WAV.
+AEC_REFERENCE = False
+SONOS_START_TIMEOUT = 5  # seconds to wait for PLAYING before giving up
+SONOS_POLL_INTERVAL = 0.2  # seconds between transport state polls
+SONOS_DONE_STATES = ("STOPPED", "PAUSED_PLAYBACK", "NO_MEDIA_PRESENT")
+
+# Transport state changes are pushed by the Sonos (UPnP AVTransport events,
+# NOTIFY requests to our HTTP server); polling is only the fallback.
+SONOS_UPNP_PORT = 1400
+SONOS_AVTRANSPORT_EVENTS = "/MediaRenderer/AVTransport/Event"
+SONOS_EVENT_CALLBACK = "/upnp/avtransport"
+SONOS_SUBSCRIPTION_TIMEOUT = 1800  # seconds requested per subscription
+SONOS_RESUBSCRIBE_INTERVAL = 30  # seconds between attempts while unsubscribed
+SONOS_EVENT_CHECK = 5  # seconds between safety polls while waiting on events
+SONOS_REQUEST_TIMEOUT = 5  # seconds for a SUBSCRIBE/UNSUBSCRIBE round trip
+
+# Replies are spoken sentence by sentence while the model is still writing.
+# Segments shorter than MIN_SEGMENT_CHARS are merged with the next sentence;
+# run-on sentences are cut at a clause boundary after MAX_SEGMENT_CHARS.
+MIN_SEGMENT_CHARS = 20
+MAX_SEGMENT_CHARS = 200
+TTS_WORKERS = 4  # segments synthesized concurrently, across all replies
+TTS_FIRST_BYTE_TIMEOUT = 30  # seconds to wait for the first TTS audio
+TTS_STREAM_TIMEOUT = 10  # seconds a growing TTS artifact may stall while served
+TTS_STORE_MAX_BYTES = 64 * 1024 * 1024  # ~20 min of 24 kHz PCM
+TTS_STORE_TTL = 600  # seconds before an artifact is evicted even if still referenced
+
+# Synthesized audio is cached by content (--tts-cache DIR, "" for memory only)
+TTS_CACHE_DIR = os.path.join(os.path.expanduser("~"), ".cache", "kenta", "tts")
+TTS_CACHE_MEMORY_BYTES = 16 * 1024 * 1024
+TTS_CACHE_DISK_BYTES = 256 * 1024 * 1024
+
+MSG_DIDNT_CATCH = "Sorry, I didn't catch that. Could you try again?"
+# Synthesized at startup so they never wait on the TTS API
+CANNED_PHRASES = (MSG_DIDNT_CATCH,)
 
 HISTORY_TIMEOUT = 7200  # seconds (2 hours) of inactivity before clearing history
-MAX_HISTORY_MESSAGES = 20  # max user+assistant message pairs kept
+# Prompts carry at most HISTORY_TOKEN_BUDGET tokens of past turns; older
+# turns are folded into a rolling summary in the background.
+HISTORY_TOKEN_BUDGET = 1500
+MAX_HISTORY_MESSAGES = 100  # hard cap on messages kept per session
+# Conversations are logged to SQLite so they survive restarts (--history-db
+# PATH, "" to keep them in memory only)
+HISTORY_DB = os.path.join(os.path.expanduser("~"), ".local", "share", "kenta", "history.db")
+HISTORY_COMPACT_INTERVAL = 3600  # seconds between background compactions
+
+# Server-side endpointing: once the uplink has had ENDPOINT_MIN_SPEECH_MS of
+# speech followed by ENDPOINT_SILENCE_MS of silence, the device is told to
+# stop (--endpoint-silence MS, 0 disables). Speech is detected with webrtcvad
+# if it is installed, otherwise by level over a tracked noise floor.
+ENDPOINT_SILENCE_MS = 800
+ENDPOINT_MIN_SPEECH_MS = 300
+ENDPOINT_FRAME_MS = 20
+ENDPOINT_MARGIN_DB = 10.0  # speech level over the noise floor
+ENDPOINT_FLOOR_DB = 40.0  # initial noise floor, dB re 1 LSB RMS
+ENDPOINT_WEBRTC_MODE = 2  # webrtcvad aggressiveness, 0-3
 
 MAX_AUDIO_BUFFER = 3 * 1024 * 1024  # ~95s of 16kHz 16-bit mono
+UPLINK_BUFFERS = 8  # MAX_AUDIO_BUFFER-sized receive buffers kept for reuse
 RECV_TIMEOUT = 30  # seconds
+MAX_EVENT_BYTES = 64 * 1024  # largest NOTIFY body read from the Sonos
+HTTP_HEADER_TIMEOUT = 10  # seconds for a client to send its request headers
+
+# Blocking SDK calls run in bounded per-stage thread pools off the event loop
+STT_WORKERS = 8  # concurrent transcriber calls across all devices
+LLM_WORKERS = 4  # concurrent chat completions
+
+# OpenAI HTTP connections are pooled and kept warm so the first question
+# after a quiet spell doesn't pay for TCP and TLS handshakes. HTTP/2 is used
+# if the h2 package is installed.
+OPENAI_MAX_CONNECTIONS = STT_WORKERS + LLM_WORKERS + TTS_WORKERS + 2
+OPENAI_KEEPALIVE_EXPIRY = 300  # seconds an idle pooled connection is kept
+OPENAI_WARM_CONNECTIONS = 3  # opened at startup: one each for STT, chat, TTS
+# While idle, one connection is refreshed shortly before the pool would expire it
+OPENAI_REWARM_IDLE = OPENAI_KEEPALIVE_EXPIRY - 30
+OPENAI_WARM_HEADER = "X-Kenta-Warm-Up"  # marks warm-up requests, which aren't traffic
+OPENAI_CONNECT_TIMEOUT = 5
+# Per-stage read timeouts (seconds); a streamed response may pause this long
+OPENAI_STT_TIMEOUT = 30
+OPENAI_CHAT_TIMEOUT = 30
+OPENAI_TTS_TIMEOUT = 30
+OPENAI_SUMMARY_TIMEOUT = 60
+OPENAI_WARM_TIMEOUT = 10
 
 SONOS_SPEAKER_NAME = "Sovrum"
 
@@ -52,9 +216,12 @@ SYSTEM_PROMPT = (
     "conversational, suitable for being spoken aloud. Aim for 1-3 sentences "
     "unless the user asks for detail."
 )
-
-# Module-level TTS directory, set during main()
-TTS_DIR: str | None = None
+SUMMARY_PROMPT = (
+    "You maintain a running summary of a spoken conversation between a user "
+    "and a voice assistant. Merge the new turns into the summary. Keep facts, "
+    "names, open questions and what the user is reading; drop small talk. "
+    "Reply with the summary only, at most 120 words."
+)
 
 # ---------------------------------------------------------------------------
 # Logging
@@ -68,14 +235,385 @@ log = logging.getLogger("esp_server")
 # ---------------------------------------------------------------------------
 # OpenAI client
 # ---------------------------------------------------------------------------
-client = OpenAI()
+class ConnectionStats:
+    """Counts OpenAI requests and how many went over a reused connection.
+
+    Fed by an httpx response hook: a response arriving on a network stream
+    seen before used a pooled connection, anything else paid for a new
+    handshake.  Warm-up requests open connections but aren't counted, and
+    don't make the pool look busy.
+    """
+
+    MAX_TRACKED = 64  # recent connections remembered
+
+    def __init__(self):
+        self.requests = 0
+        self.reused = 0
+        self.last_used = 0.0  # time.monotonic() of the last real response
+        # Keyed by id(); the streams are kept alive so ids aren't recycled
+        self._streams: OrderedDict[int, object] = OrderedDict()
+        self._lock = threading.Lock()
+
+    def on_response(self, response):
+        stream = response.extensions.get("network_stream")
+        warm_up = OPENAI_WARM_HEADER in response.request.headers
+        with self._lock:
+            if not warm_up:
+                self.requests += 1
+                self.last_used = time.monotonic()
+            if stream is None:
+                return
+            if id(stream) in self._streams:
+                self.reused += not warm_up
+                self._streams.move_to_end(id(stream))
+            else:
+                self._streams[id(stream)] = stream
+                if len(self._streams) > self.MAX_TRACKED:
+                    self._streams.popitem(last=False)
+
+    def stats(self) -> str:
+        with self._lock:
+            rate = 100 * self.reused / self.requests if self.requests else 0
+            return (f"{self.requests} requests, {self.reused} on reused connections "
+                    f"({rate:.0f}%)")
+
+
+openai_connections = ConnectionStats()
+
+
+def make_openai_client() -> OpenAI:
+    """OpenAI client with a sized keep-alive pool that reports reuse."""
+    try:
+        import httpx  # installed with openai
+    except ImportError:
+        return OpenAI()
+    try:
+        import h2  # noqa: F401  optional, enables HTTP/2
+        http2 = True
+    except ImportError:
+        http2 = False
+    http_client = httpx.Client(
+        http2=http2,
+        limits=httpx.Limits(
+            max_connections=OPENAI_MAX_CONNECTIONS,
+            max_keepalive_connections=OPENAI_MAX_CONNECTIONS,
+            keepalive_expiry=OPENAI_KEEPALIVE_EXPIRY,
+        ),
+        timeout=httpx.Timeout(OPENAI_CHAT_TIMEOUT, connect=OPENAI_CONNECT_TIMEOUT),
+        event_hooks={"response": [openai_connections.on_response]},
+    )
+    return OpenAI(http_client=http_client)
+
+
+client = make_openai_client()
+
+
+def warm_up_openai(connections: int = OPENAI_WARM_CONNECTIONS):
+    """Open (or refresh) pooled connections with cheap concurrent requests."""
+    start = time.monotonic()
+    with ThreadPoolExecutor(max_workers=connections, thread_name_prefix="warm") as pool:
+        futures = [pool.submit(client.models.retrieve, OPENAI_MODEL_CHAT,
+                               timeout=OPENAI_WARM_TIMEOUT,
+                               extra_headers={OPENAI_WARM_HEADER: "1"})
+                   for _ in range(connections)]
+    failed = sum(1 for f in futures if f.exception())
+    if failed:
+        log.warning("OpenAI warm-up: %d of %d requests failed", failed, connections)
+    log.info("OpenAI warm-up took %.0f ms; %s",
+             (time.monotonic() - start) * 1000, openai_connections.stats())
+
+
+def keep_openai_warm_forever():
+    """Warm the pool at startup, then keep one connection alive while idle."""
+    warm_up_openai()
+    warmed = time.monotonic()
+    while True:
+        due = max(openai_connections.last_used, warmed) + OPENAI_REWARM_IDLE
+        if time.monotonic() < due:
+            time.sleep(due - time.monotonic())
+            continue
+        warm_up_openai(1)
+        warmed = time.monotonic()
 
 # ---------------------------------------------------------------------------
-# Conversation history (cleared after HISTORY_TIMEOUT of inactivity)
+# Conversation history, one per device (cleared after HISTORY_TIMEOUT of
+# inactivity)
 # ---------------------------------------------------------------------------
-conversation_history: list[dict] = []
-last_message_time: float = 0.0
-history_lock = threading.Lock()
+DEFAULT_SESSION = "default"
+
+
+class ConversationStore:
+    """Append-only log of conversation turns in SQLite, in WAL mode.
+
+    Each turn is one small transaction, so appends cost the same however
+    long the log gets and a crash loses at most the turn being written.
+    Sessions are read lazily and only their most recent messages, so
+    startup doesn't depend on how much history has piled up.  compact()
+    drops messages no session can load any more and checkpoints the WAL,
+    which keeps recovery after a crash short.
+    """
+
+    def __init__(self, path: str):
+        if path != ":memory:":
+            os.makedirs(os.path.dirname(os.path.abspath(path)), exist_ok=True)
+        self._db = sqlite3.connect(path, check_same_thread=False, isolation_level=None)
+        self._lock = threading.Lock()
+        with self._lock:
+            self._db.execute("PRAGMA journal_mode=WAL")
+            self._db.execute("PRAGMA synchronous=NORMAL")
+            self._db.execute(
+                "CREATE TABLE IF NOT EXISTS messages ("
+                " id INTEGER PRIMARY KEY,"
+                " session TEXT NOT NULL,"
+                " role TEXT NOT NULL,"
+                " content TEXT NOT NULL,"
+                " created REAL NOT NULL)")
+            self._db.execute(
+                "CREATE INDEX IF NOT EXISTS messages_session ON messages (session, id)")
+
+    def load(self, session: str, limit: int) -> list[tuple[str, str, float]]:
+        """The last *limit* messages of *session* as (role, content, created), oldest first."""
+        with self._lock:
+            rows = self._db.execute(
+                "SELECT role, content, created FROM messages WHERE session = ?"
+                " ORDER BY id DESC LIMIT ?", (session, limit)).fetchall()
+        return rows[::-1]
+
+    def append(self, session: str, messages: list[dict], created: float):
+        with self._lock:
+            self._db.execute("BEGIN")
+            self._db.executemany(
+                "INSERT INTO messages (session, role, content, created) VALUES (?, ?, ?, ?)",
+                [(session, m["role"], m["content"], created) for m in messages])
+            self._db.execute("COMMIT")
+
+    def compact(self, keep: int):
+        """Keep only the last *keep* messages of each session."""
+        with self._lock:
+            deleted = self._db.execute(
+                "DELETE FROM messages WHERE id IN ("
+                " SELECT id FROM (SELECT id, ROW_NUMBER() OVER"
+                "  (PARTITION BY session ORDER BY id DESC) AS age FROM messages)"
+                " WHERE age > ?)", (keep,)).rowcount
+            self._db.execute("PRAGMA wal_checkpoint(TRUNCATE)")
+        if deleted:
+            log.info("History compacted: %d old messages removed", deleted)
+
+    def close(self):
+        with self._lock:
+            self._db.close()
+
+
+def compact_history_forever(store: ConversationStore, interval: float = HISTORY_COMPACT_INTERVAL):
+    """Background thread body: compact the history log every *interval* seconds."""
+    while True:
+        time.sleep(interval)
+        try:
+            store.compact(MAX_HISTORY_MESSAGES)
+        except Exception:
+            log.warning("History compaction failed", exc_info=True)
+
+
+# Set in main() unless --history-db ""
+history_store: ConversationStore | None = None
+
+
+def count_tokens(text: str) -> int:
+    """Rough token count of one message (~4 characters per token plus framing).
+
+    Only used to budget prompt size, so an estimate is good enough and
+    avoids a tokenizer dependency.
+    """
+    return len(text) // 4 + 4
+
+
+def summarize_turns(summary: str, turns: list[dict]) -> str:
+    """Fold *turns* into the rolling *summary* with a small, fast model."""
+    transcript = "\n".join(f"{m['role']}: {m['content']}" for m in turns)
+    response = client.chat.completions.create(
+        model=OPENAI_MODEL_SUMMARY,
+        timeout=OPENAI_SUMMARY_TIMEOUT,
+        messages=[
+            {"role": "system", "content": SUMMARY_PROMPT},
+            {"role": "user",
+             "content": f"Summary so far: {summary or '(none)'}\n\nNew turns:\n{transcript}"},
+        ],
+    )
+    return response.choices[0].message.content.strip()
+
+
+# Summaries are written one at a time, off the request path
+summary_executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="summary")
+
+
+class Conversation:
+    """Chat history for one session.
+
+    A turn reads a snapshot with begin(), calls the model without holding
+    any lock, and then commit()s the user message and reply together, so
+    the history only ever holds complete pairs and a slow reply never
+    blocks anyone else.  With a *store*, the recent history is loaded from
+    it on creation and every committed turn is appended to it.
+
+    Each message's token count is computed once when it is added.  Prompts
+    include the newest turns that fit in HISTORY_TOKEN_BUDGET; once the
+    history outgrows the budget, a background job folds the oldest turns
+    into a rolling summary that is sent ahead of them.
+    """
+
+    def __init__(self, session: str = DEFAULT_SESSION, store: ConversationStore | None = None):
+        self.session = session
+        self.store = store
+        self.messages: deque[dict] = deque()
+        self.tokens: deque[int] = deque()  # per message, parallel to messages
+        self.history_tokens = 0
+        self.summary = ""
+        self.last_message_time = 0.0
+        self.turns = 0  # committed turns, to spot overlapping ones
+        self._epoch = 0  # bumped when the history is cleared
+        self._summarizing = False
+        self._lock = threading.Lock()
+        if store:
+            self._restore()
+
+    def _restore(self):
+        rows = self.store.load(self.session, MAX_HISTORY_MESSAGES)
+        if not rows:
+            return
+        # Only the current stretch of conversation: stop at an inactivity gap
+        start = len(rows) - 1
+        while start > 0 and rows[start][2] - rows[start - 1][2] <= HISTORY_TIMEOUT:
+            start -= 1
+        if rows[start][0] == "assistant":
+            start += 1  # reply of a pair cut off by the limit
+        for role, content, _ in rows[start:]:
+            self._push({"role": role, "content": content})
+        self.last_message_time = rows[-1][2]
+        log.info("Session %s: restored %d messages", self.session, len(self.messages))
+        self._maybe_summarize()
+
+    def _push(self, message: dict):
+        n = count_tokens(message["content"])
+        self.messages.append(message)
+        self.tokens.append(n)
+        self.history_tokens += n
+
+    def _pop_oldest(self):
+        self.messages.popleft()
+        self.history_tokens -= self.tokens.popleft()
+
+    def _clear(self):
+        self.messages.clear()
+        self.tokens.clear()
+        self.history_tokens = 0
+        self.summary = ""
+        self._epoch += 1
+
+    def begin(self, user_text: str) -> tuple[list[dict], int]:
+        """Return the messages to send for *user_text* and the turn it follows."""
+        with self._lock:
+            now = time.time()
+            if self.last_message_time and now - self.last_message_time > HISTORY_TIMEOUT:
+                log.info("Conversation inactive for >%ds — clearing history", HISTORY_TIMEOUT)
+                self._clear()
+            self.last_message_time = now
+
+            # Newest turns that fit the budget; anything older is (or is
+            # about to be) covered by the summary
+            recent: list[dict] = []
+            used = 0
+            for message, n in zip(reversed(self.messages), reversed(self.tokens)):
+                if used + n > HISTORY_TOKEN_BUDGET:
+                    break
+                recent.append(message)
+                used += n
+            if recent and recent[-1]["role"] == "assistant":
+                recent.pop()  # never start on half a pair
+            recent.reverse()
+
+            messages = [{"role": "system", "content": SYSTEM_PROMPT}]
+            if self.summary:
+                messages.append({"role": "system",
+                                 "content": f"Summary of the conversation so far: {self.summary}"})
+            messages += [*recent, {"role": "user", "content": user_text}]
+            log.info("Prompt: %d of %d history messages, ~%d tokens of history",
+                     len(recent), len(self.messages), used)
+            return messages, self.turns
+
+    def commit(self, user_text: str, reply: str, turn: int):
+        """Append a finished turn started by begin()."""
+        with self._lock:
+            if turn != self.turns:
+                log.info("Another turn finished first, appending after it")
+            turn_messages = [
+                {"role": "user", "content": user_text},
+                {"role": "assistant", "content": reply},
+            ]
+            for message in turn_messages:
+                self._push(message)
+            self.turns += 1
+            self.last_message_time = time.time()
+            if self.store:
+                try:
+                    self.store.append(self.session, turn_messages, self.last_message_time)
+                except sqlite3.Error:
+                    log.warning("Could not save turn to history", exc_info=True)
+
+            # Hard cap in case summaries fall behind
+            while len(self.messages) > MAX_HISTORY_MESSAGES:
+                self._pop_oldest()  # oldest user msg
+                self._pop_oldest()  # its assistant reply
+            self._maybe_summarize()
+
+    def _maybe_summarize(self):
+        # Called with _lock held (or before the conversation is shared)
+        if self.history_tokens > HISTORY_TOKEN_BUDGET and not self._summarizing:
+            self._summarizing = True
+            summary_executor.submit(self._summarize)
+
+    def _summarize(self):
+        """Fold the oldest turns into the summary until the rest fits in half the budget."""
+        try:
+            with self._lock:
+                count, remaining = 0, self.history_tokens
+                while count < len(self.messages) - 2 and remaining > HISTORY_TOKEN_BUDGET // 2:
+                    remaining -= self.tokens[count] + self.tokens[count + 1]
+                    count += 2
+                old = [self.messages[i] for i in range(count)]
+                summary, epoch = self.summary, self._epoch
+            if not old:
+                return
+
+            start = time.monotonic()
+            summary = summarize_turns(summary, old)
+
+            with self._lock:
+                if self._epoch != epoch:
+                    return  # cleared meanwhile
+                folded = {id(m) for m in old}
+                while self.messages and id(self.messages[0]) in folded:
+                    self._pop_oldest()
+                self.summary = summary
+            log.info("Session %s: summarized %d messages in %.0f ms, %d left (~%d tokens)",
+                     self.session, len(old), (time.monotonic() - start) * 1000,
+                     len(self.messages), self.history_tokens)
+        except Exception:
+            log.warning("Summarizing conversation failed", exc_info=True)
+        finally:
+            with self._lock:
+                self._summarizing = False
+
+
+conversations: dict[str, Conversation] = {}
+conversations_lock = threading.Lock()
+
+
+def get_conversation(session: str) -> Conversation:
+    with conversations_lock:
+        conversation = conversations.get(session)
+        if conversation is None:
+            conversation = conversations[session] = Conversation(session, history_store)
+        return conversation
 
 
 # ---------------------------------------------------------------------------
@@ -93,153 +631,1351 @@ def get_local_ip() -> str:
         s.close()
 
 
-def pcm_to_wav(pcm_data: bytes) -> io.BytesIO:
-    """Wrap raw PCM bytes in a WAV container (in-memory)."""
-    buf = io.BytesIO()
-    with wave.open(buf, "wb") as wf:
-        wf.setnchannels(CHANNELS)
-        wf.setsampwidth(SAMPLE_WIDTH)
-        wf.setframerate(SAMPLE_RATE)
-        wf.writeframes(pcm_data)
-    buf.seek(0)
-    buf.name = "audio.wav"  # OpenAI SDK needs a .name with audio extension
-    return buf
+@dataclass(frozen=True)
+class AudioFormat:
+    """PCM format of one uplink stream, as negotiated in the stream header."""
+
+    sample_rate: int = SAMPLE_RATE
+    sample_width: int = SAMPLE_WIDTH  # of the decoded PCM
+    channels: int = CHANNELS
+    codec: int = CODEC_PCM  # as sent on the wire
+
+    @property
+    def bytes_per_second(self) -> int:
+        return self.sample_rate * self.sample_width * self.channels
+
+
+DEFAULT_FORMAT = AudioFormat()
+
+
+def pcm_to_wav(pcm_data: bytes, fmt: AudioFormat = DEFAULT_FORMAT) -> "WavStream":
+    """Wrap raw PCM bytes in a WAV container (in-memory, the PCM isn't copied)."""
+    return WavStream(pcm_data, fmt)
+
+
+def wav_header(fmt: AudioFormat, data_bytes: int) -> bytes:
+    """44-byte WAV header for *data_bytes* of PCM in *fmt*."""
+    block_align = fmt.channels * fmt.sample_width
+    return struct.pack(
+        "<4sI4s4sIHHIIHH4sI",
+        b"RIFF", 36 + data_bytes, b"WAVE",
+        b"fmt ", 16, 1, fmt.channels, fmt.sample_rate,
+        fmt.sample_rate * block_align, block_align, fmt.sample_width * 8,
+        b"data", data_bytes,
+    )
+
+
+class WavStream(io.RawIOBase):
+    """A WAV file read from a separate header and the PCM where it already lies.
+
+    Reads (and the upload) walk the header and then the caller's buffer, so
+    wrapping a recording never joins the two into a new copy.  *pcm* must
+    not change while the stream is in use.
+    """
+
+    name = "audio.wav"  # OpenAI SDK needs a .name with audio extension
+
+    def __init__(self, pcm: bytes, fmt: AudioFormat = DEFAULT_FORMAT):
+        super().__init__()
+        pcm = memoryview(pcm).cast("B")
+        self._parts = (memoryview(wav_header(fmt, len(pcm))), pcm)
+        self._size = sum(len(part) for part in self._parts)
+        self._pos = 0
+
+    def readable(self) -> bool:
+        return True
+
+    def seekable(self) -> bool:
+        return True
+
+    def readinto(self, b) -> int:
+        out = memoryview(b).cast("B")
+        written = start = 0
+        for part in self._parts:
+            offset = self._pos - start
+            if 0 <= offset < len(part) and written < len(out):
+                chunk = part[offset : offset + len(out) - written]
+                out[written : written + len(chunk)] = chunk
+                written += len(chunk)
+                self._pos += len(chunk)
+            start += len(part)
+        return written
+
+    def seek(self, offset: int, whence: int = io.SEEK_SET) -> int:
+        base = {io.SEEK_SET: 0, io.SEEK_CUR: self._pos, io.SEEK_END: self._size}[whence]
+        self._pos = max(0, base + offset)
+        return self._pos
+
+    def tell(self) -> int:
+        return self._pos
+
+
+class BufferPool:
+    """Receive buffers of one size, reused across interactions.
+
+    A buffer handed back with release() only goes back into the pool once
+    nothing views it any more, so a memoryview of it kept downstream can
+    never see its audio overwritten by the next interaction.
+    """
+
+    def __init__(self, size: int, keep: int):
+        self.size = size
+        self.allocated = 0  # buffers created so far
+        self._keep = keep
+        self._free: list[bytearray] = []
+        self._lock = threading.Lock()
+
+    def acquire(self) -> bytearray:
+        with self._lock:
+            if self._free:
+                return self._free.pop()
+            self.allocated += 1
+        return bytearray(self.size)
+
+    def release(self, buf: bytearray):
+        try:
+            del buf[-1]  # a bytearray with live views can't be resized
+        except BufferError:
+            return  # still viewed: left to the garbage collector
+        buf.append(0)
+        with self._lock:
+            if len(self._free) < self._keep:
+                self._free.append(buf)
+
+
+uplink_buffers = BufferPool(MAX_AUDIO_BUFFER, UPLINK_BUFFERS)
+
+
+def pcm_to_16bit(pcm: bytes, sample_width: int) -> bytes:
+    """Reduce 24-bit PCM to 16-bit by keeping the top two bytes of each sample."""
+    if sample_width == 2:
+        return pcm
+    if kenta_dsp is not None:
+        return kenta_dsp.convert_width(pcm, sample_width, 2)
+    return b"".join(pcm[i + 1 : i + 3] for i in range(0, len(pcm) - 2, 3))
+
+
+def resample_pcm16(pcm: bytes, from_rate: int, to_rate: int) -> bytes:
+    """Resample 16-bit mono PCM using linear interpolation."""
+    num_samples = len(pcm) // 2
+    if num_samples == 0 or from_rate == to_rate:
+        return pcm
+    if kenta_dsp is not None:
+        return kenta_dsp.resample16(pcm, from_rate, to_rate)
+    samples = struct.unpack(f"<{num_samples}h", pcm[: num_samples * 2])
+
+    ratio = from_rate / to_rate
+    out_len = int(num_samples / ratio)
+    out = []
+    for i in range(out_len):
+        src_pos = i * ratio
+        idx = int(src_pos)
+        frac = src_pos - idx
+        if idx + 1 < num_samples:
+            val = samples[idx] * (1.0 - frac) + samples[idx + 1] * frac
+        else:
+            val = samples[idx]
+        out.append(max(-32768, min(32767, int(val))))
+    return struct.pack(f"<{len(out)}h", *out)
+
+
+class StreamResampler:
+    """resample_pcm16 over a stream that arrives in chunks.
+
+    Resampling each chunk on its own would hold the last sample at every
+    boundary and drop fractional output samples.  Instead input is resampled
+    in whole periods of the rate ratio, plus one sample of lookahead to
+    interpolate into, and the rest is carried over to the next chunk.  The
+    output of feed()s followed by flush() is that of resampling the whole
+    stream at once.
+    """
+
+    def __init__(self, from_rate: int, to_rate: int):
+        self.from_rate, self.to_rate = from_rate, to_rate
+        g = math.gcd(from_rate, to_rate)
+        self._period_in, self._period_out = from_rate // g, to_rate // g  # samples
+        self._pending = bytearray()
+
+    def feed(self, pcm16: bytes) -> bytes:
+        if self.from_rate == self.to_rate:
+            return bytes(pcm16)
+        self._pending += pcm16
+        periods = (len(self._pending) // 2 - 1) // self._period_in
+        if periods <= 0:
+            return b""
+        used = periods * self._period_in
+        out = resample_pcm16(bytes(self._pending[: 2 * used + 2]), self.from_rate, self.to_rate)
+        del self._pending[: 2 * used]
+        return out[: 2 * periods * self._period_out]
+
+    def flush(self) -> bytes:
+        """Resample what's left, holding the last sample as resample_pcm16 does."""
+        out = resample_pcm16(bytes(self._pending), self.from_rate, self.to_rate)
+        self._pending.clear()
+        return out
+
+
+def _loud_span_numpy(np, pcm16: bytes, frame: int, min_power: float) -> tuple[int, int] | None:
+    frames = len(pcm16) // 2 // frame
+    samples = np.frombuffer(pcm16, dtype="<i2", count=frames * frame).astype(np.float32)
+    power = np.square(samples).reshape(frames, frame).mean(axis=1)
+    loud = np.flatnonzero(power > min_power)
+    return (int(loud[0]), int(loud[-1])) if loud.size else None
+
+
+def _loud_span_python(pcm16: bytes, frame: int, min_power: float) -> tuple[int, int] | None:
+    samples = memoryview(pcm16[: len(pcm16) // 2 * 2]).cast("h")
+    frames = len(samples) // frame
+
+    def loud(i: int) -> bool:
+        return sum(x * x for x in samples[i * frame : (i + 1) * frame]) > min_power * frame
+
+    # Only the silence is scanned, from each end
+    first = next((i for i in range(frames) if loud(i)), None)
+    if first is None:
+        return None
+    return first, next(i for i in range(frames - 1, first - 1, -1) if loud(i))
+
+
+def trim_silence(pcm: bytes, fmt: AudioFormat, threshold_db: float = TRIM_THRESHOLD_DB,
+                 pad_ms: int = TRIM_PAD_MS) -> tuple[bytes, float]:
+    """Cut leading and trailing silence, keeping *pad_ms* around the speech.
+
+    Returns the trimmed PCM and the seconds removed.  Audio with no frame
+    louder than *threshold_db* is returned whole rather than dropped.  Uses
+    kenta_dsp or numpy if either is installed.
+    """
+    frame = fmt.sample_rate * TRIM_FRAME_MS // 1000
+    pcm16 = pcm_to_16bit(pcm, fmt.sample_width)
+    min_power = (10 ** (threshold_db / 20) - 1) ** 2  # level = 20 log10(rms + 1)
+    if kenta_dsp is not None:
+        span = kenta_dsp.loud_span(pcm16, frame, min_power)
+    else:
+        try:
+            import numpy  # optional, vectorized
+            span = _loud_span_numpy(numpy, pcm16, frame, min_power)
+        except ImportError:
+            span = _loud_span_python(pcm16, frame, min_power)
+    if span is None:
+        return pcm, 0.0
+
+    total = len(pcm) // fmt.sample_width
+    pad = fmt.sample_rate * pad_ms // 1000
+    start = max(0, span[0] * frame - pad)
+    end = min(total, (span[1] + 1) * frame + pad)
+    return pcm[start * fmt.sample_width : end * fmt.sample_width], \
+        (total - (end - start)) / fmt.sample_rate
+
+
+# ---------------------------------------------------------------------------
+# IMA ADPCM (uplink codec used by devices on weak links)
+# ---------------------------------------------------------------------------
+_ADPCM_INDEX_TABLE = (-1, -1, -1, -1, 2, 4, 6, 8) * 2
+_ADPCM_STEP_TABLE = (
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+)
+
+
+def adpcm_decode(data: bytes) -> bytes:
+    """Decode IMA ADPCM blocks (see firmware/main/dsp.h) to 16-bit LE PCM.
+
+    Each block starts with the encoder state (s16 predictor, u8 step index,
+    u8 reserved) followed by two samples per byte, low nibble first.  A
+    trailing partial block is ignored.
+    """
+    if kenta_dsp is not None:
+        return kenta_dsp.adpcm_decode(data, ADPCM_BLOCK_BYTES)
+    out = []
+    steps = _ADPCM_STEP_TABLE
+    index_table = _ADPCM_INDEX_TABLE
+    for start in range(0, len(data) - ADPCM_BLOCK_BYTES + 1, ADPCM_BLOCK_BYTES):
+        predictor, index, _ = struct.unpack_from("<hBB", data, start)
+        index = min(index, 88)
+        for byte in data[start + 4 : start + ADPCM_BLOCK_BYTES]:
+            for code in (byte & 0x0F, byte >> 4):
+                step = steps[index]
+                delta = step >> 3
+                if code & 4:
+                    delta += step
+                if code & 2:
+                    delta += step >> 1
+                if code & 1:
+                    delta += step >> 2
+                predictor += -delta if code & 8 else delta
+                predictor = max(-32768, min(32767, predictor))
+                index = max(0, min(88, index + index_table[code]))
+                out.append(predictor)
+    return struct.pack(f"<{len(out)}h", *out)
+
+
+# ---------------------------------------------------------------------------
+# Upload encoding (FLAC, Opus) for batch transcription
+# ---------------------------------------------------------------------------
+def _crc_table(poly: int, width: int) -> tuple[int, ...]:
+    top, mask = 1 << (width - 1), (1 << width) - 1
+    table = []
+    for i in range(256):
+        crc = i << (width - 8)
+        for _ in range(8):
+            crc = ((crc << 1) ^ poly if crc & top else crc << 1) & mask
+        table.append(crc)
+    return tuple(table)
+
+
+_CRC8_TABLE = _crc_table(0x07, 8)
+_CRC16_TABLE = _crc_table(0x8005, 16)
+
+
+def _crc8(data: bytes) -> int:
+    crc = 0
+    for byte in data:
+        crc = _CRC8_TABLE[crc ^ byte]
+    return crc
+
+
+def _crc16(data: bytes) -> int:
+    crc = 0
+    for byte in data:
+        crc = ((crc << 8) & 0xFFFF) ^ _CRC16_TABLE[(crc >> 8) ^ byte]
+    return crc
+
+
+def _flac_frame_number(n: int) -> bytes:
+    """Frame number in FLAC's UTF-8-like variable-length coding."""
+    if n < 0x80:
+        return bytes([n])
+    length = 2
+    while n >= 1 << (5 * length + 1):
+        length += 1
+    tail = [0x80 | (n >> (6 * i)) & 0x3F for i in range(length - 2, -1, -1)]
+    return bytes([((0xFF00 >> length) & 0xFF) | (n >> (6 * (length - 1)))] + tail)
+
+
+def _flac_subframe(x: list[int], bps: int) -> str:
+    """One subframe as a string of bits: CONSTANT, FIXED order 0-4 or VERBATIM."""
+    mask = (1 << bps) - 1
+    if x.count(x[0]) == len(x):
+        return "00000000" + format(x[0] & mask, f"0{bps}b")
+
+    # Order n's residual is the n-th difference; keep the smallest
+    order, residual, best = 0, x, sum(map(abs, x))
+    diffs = x
+    for o in range(1, min(4, len(x) - 1) + 1):
+        diffs = [b - a for a, b in zip(diffs, diffs[1:])]
+        cost = sum(map(abs, diffs))
+        if cost < best:
+            order, residual, best = o, diffs, cost
+
+    u = [r << 1 if r >= 0 else (-r << 1) - 1 for r in residual]
+    m, total = len(u), sum(u)
+    k = min(range(15), key=lambda c: m * (c + 1) + (total >> c))
+    bits = m * (k + 1) + sum(v >> k for v in u)
+    if order * bps + 10 + bits >= len(x) * bps:
+        return "00000010" + "".join(format(v & mask, f"0{bps}b") for v in x)
+
+    warmup = "".join(format(v & mask, f"0{bps}b") for v in x[:order])
+    if k:
+        low = (1 << k) - 1
+        codes = "".join("0" * (v >> k) + "1" + format(v & low, f"0{k}b") for v in u)
+    else:
+        codes = "".join("0" * v + "1" for v in u)
+    return format((0x08 | order) << 1, "08b") + warmup + "000000" + format(k, "04b") + codes
+
+
+def _flac_frames_python(pcm: bytes, sample_width: int, block: int) -> bytes:
+    if sample_width == 2:
+        samples = memoryview(pcm).cast("h").tolist()
+    else:
+        samples = [int.from_bytes(pcm[i : i + 3], "little", signed=True)
+                   for i in range(0, len(pcm) - 2, 3)]
+    out = bytearray()
+    for number, start in enumerate(range(0, len(samples), block)):
+        x = samples[start : start + block]
+        head = b"\xff\xf8\x70\x00" + _flac_frame_number(number) + (len(x) - 1).to_bytes(2, "big")
+        bits = _flac_subframe(x, 8 * sample_width)
+        bits += "0" * (-len(bits) % 8)
+        frame = head + bytes([_crc8(head)]) + int(bits, 2).to_bytes(len(bits) // 8, "big")
+        out += frame + _crc16(frame).to_bytes(2, "big")
+    return bytes(out)
+
+
+def encode_flac(pcm: bytes, fmt: AudioFormat, block: int = FLAC_BLOCK_SIZE) -> bytes:
+    """Encode mono 16- or 24-bit PCM as a FLAC file.
+
+    Each frame uses the best of FLAC's fixed predictors with one Rice
+    partition: far simpler than libFLAC, and about as good on speech.
+    Uses kenta_dsp if it is installed.
+    """
+    if fmt.sample_width not in (2, 3) or fmt.channels != 1:
+        raise ValueError(f"unsupported format {fmt}")
+    samples = len(pcm) // fmt.sample_width
+    pcm = memoryview(pcm).cast("B")[: samples * fmt.sample_width]
+    if kenta_dsp is not None:
+        frames = kenta_dsp.flac_frames(pcm, fmt.sample_width, block)
+    else:
+        frames = _flac_frames_python(pcm, fmt.sample_width, block)
+    bps = 8 * fmt.sample_width
+    streaminfo = (
+        struct.pack(">HH", block, block) + bytes(6)  # frame sizes unknown
+        + ((fmt.sample_rate << 44) | ((fmt.channels - 1) << 41) | ((bps - 1) << 36)
+           | samples).to_bytes(8, "big")
+        + hashlib.md5(pcm).digest()
+    )
+    return b"fLaC" + bytes([0x80, 0, 0, len(streaminfo)]) + streaminfo + frames
+
+
+def encode_opus(pcm: bytes, fmt: AudioFormat, bitrate: int = UPLOAD_OPUS_BITRATE) -> bytes:
+    """Encode PCM as Ogg Opus with ffmpeg. Raises OSError or CalledProcessError."""
+    ffmpeg = shutil.which("ffmpeg")
+    if ffmpeg is None:
+        raise FileNotFoundError("ffmpeg not found")
+    result = subprocess.run(
+        [ffmpeg, "-hide_banner", "-loglevel", "error",
+         "-f", f"s{8 * fmt.sample_width}le", "-ar", str(fmt.sample_rate),
+         "-ac", str(fmt.channels), "-i", "pipe:0",
+         "-c:a", "libopus", "-b:a", str(bitrate), "-application", "voip",
+         "-f", "ogg", "pipe:1"],
+        input=pcm, capture_output=True, check=True, timeout=UPLOAD_ENCODE_TIMEOUT,
+    )
+    return result.stdout
+
+
+def encode_upload(pcm: bytes, fmt: AudioFormat, codec: str = UPLOAD_CODEC) -> io.RawIOBase:
+    """Return *pcm* as an audio file for the transcription API, in *codec*.
+
+    Opus falls back to FLAC if ffmpeg is missing or fails, and anything that
+    can't be encoded is sent as WAV.  Logs the encode time and the size
+    saved.
+    """
+    if codec == "wav":
+        return pcm_to_wav(pcm, fmt)
+    start = time.monotonic()
+    data = None
+    if codec == "opus":
+        try:
+            data, name = encode_opus(pcm, fmt), "audio.ogg"
+        except (OSError, subprocess.SubprocessError) as e:
+            log.warning("Opus encoding failed (%s), sending FLAC", e)
+    if data is None:
+        try:
+            data, name = encode_flac(pcm, fmt), "audio.flac"
+        except ValueError as e:
+            log.warning("FLAC encoding failed (%s), sending WAV", e)
+            return pcm_to_wav(pcm, fmt)
+    wav_bytes = len(pcm) + 44
+    log.info("Encoded %s in %.0f ms: %d -> %d bytes (%.1fx)", name,
+             (time.monotonic() - start) * 1000, wav_bytes, len(data),
+             wav_bytes / max(1, len(data)))
+    upload = io.BytesIO(data)
+    upload.name = name  # the API goes by the extension
+    return upload
 
 
 # ---------------------------------------------------------------------------
 # OpenAI: Speech-to-Text
 # ---------------------------------------------------------------------------
-def transcribe_audio(wav_file: io.BytesIO) -> str:
-    """Send WAV audio to OpenAI Whisper and return the transcription."""
+def transcribe_audio(wav_file: io.RawIOBase) -> str:
+    """Send an audio file (WAV, FLAC or Ogg, by .name) to OpenAI Whisper and return the transcription."""
     log.info("Transcribing audio...")
     result = client.audio.transcriptions.create(
         model=OPENAI_MODEL_STT,
         file=wav_file,
+        timeout=OPENAI_STT_TIMEOUT,
     )
     text = result.text.strip()
     log.info("Transcription: %s", text)
     return text
 
 
-# ---------------------------------------------------------------------------
-# OpenAI: Chat Completion
-# ---------------------------------------------------------------------------
-def chat_completion(user_text: str) -> str:
-    """Send user text to ChatGPT and return the assistant reply.
+class Transcriber:
+    """Speech-to-text for one utterance, fed while the device is still talking.
 
-    The lock is held for the entire API call to prevent history mutation
-    between read and write.  This serializes requests, but matches the
-    single-threaded processor_loop design.
+    feed() is called in the STT stage with decoded PCM as it comes
+    off the socket.  finish() is called once after the end marker with the
+    whole utterance, for PCM streams a view of the pooled receive buffer
+    that is only valid during the call, and returns the final transcript.
+    close() releases resources if finish() is never reached.
     """
-    global last_message_time
 
-    log.info("Getting chat completion...")
+    def feed(self, pcm: bytes, fmt: AudioFormat):
+        raise NotImplementedError
+
+    def finish(self, pcm: memoryview) -> str:
+        raise NotImplementedError
+
+    def close(self):
+        pass
+
+
+class BatchTranscriber(Transcriber):
+    """Transcribe the whole utterance in one request at the end."""
+
+    def __init__(self):
+        self._fmt = DEFAULT_FORMAT
+
+    def feed(self, pcm: bytes, fmt: AudioFormat):
+        self._fmt = fmt  # the audio itself is handed over whole to finish()
+
+    def finish(self, pcm: memoryview) -> str:
+        if not pcm:
+            return ""
+        pcm = memoryview(pcm)  # trimmed and wrapped without copying
+        if TRIM_THRESHOLD_DB:
+            pcm, trimmed = trim_silence(pcm, self._fmt, TRIM_THRESHOLD_DB, TRIM_PAD_MS)
+            log.info("Trimmed %.1fs of silence, transcribing %.1fs",
+                     trimmed, len(pcm) / self._fmt.bytes_per_second)
+        return self._transcribe(pcm)
+
+    def _transcribe(self, pcm: memoryview) -> str:
+        return transcribe_audio(encode_upload(pcm, self._fmt, UPLOAD_CODEC))
 
-    with history_lock:
-        now = time.time()
-        if last_message_time and now - last_message_time > HISTORY_TIMEOUT:
-            log.info("Conversation inactive for >%ds — clearing history", HISTORY_TIMEOUT)
-            conversation_history.clear()
-        conversation_history.append({"role": "user", "content": user_text})
-        last_message_time = now
-
-        # Trim oldest pair when history exceeds limit
-        while len(conversation_history) > MAX_HISTORY_MESSAGES:
-            conversation_history.pop(0)  # remove oldest user msg
-            if conversation_history and conversation_history[0]["role"] == "assistant":
-                conversation_history.pop(0)  # remove its paired assistant reply
-
-        messages = [
-            {"role": "system", "content": SYSTEM_PROMPT},
-            *conversation_history,
-        ]
-
-        response = client.chat.completions.create(
-            model=OPENAI_MODEL_CHAT,
-            messages=messages,
+
+class RealtimeTranscriber(BatchTranscriber):
+    """Stream audio to an OpenAI Realtime transcription session.
+
+    Audio is converted to 24 kHz 16-bit and appended to the session's input
+    buffer as it arrives, so by the end marker the model has already heard
+    everything and only the final commit is left.  Any failure falls back to
+    a batch transcription of the utterance handed to finish().
+    """
+
+    def __init__(self):
+        super().__init__()
+        from websockets.sync.client import connect  # optional dependency
+
+        self._ws = connect(
+            OPENAI_REALTIME_URL,
+            additional_headers={
+                "Authorization": f"Bearer {os.environ['OPENAI_API_KEY']}",
+                "OpenAI-Beta": "realtime=v1",
+            },
+            open_timeout=5,
         )
-        reply = response.choices[0].message.content.strip()
+        self._failed = False
+        self._resampler: StreamResampler | None = None  # for the stream's rate
+        self._ws.send(json.dumps({
+            "type": "transcription_session.update",
+            "session": {
+                "input_audio_format": "pcm16",
+                "input_audio_transcription": {"model": OPENAI_MODEL_STT},
+                "turn_detection": None,
+            },
+        }))
+
+    def feed(self, pcm: bytes, fmt: AudioFormat):
+        super().feed(pcm, fmt)
+        if self._failed:
+            return
+        if self._resampler is None:
+            self._resampler = StreamResampler(fmt.sample_rate, OPENAI_REALTIME_RATE)
+        self._append(self._resampler.feed(pcm_to_16bit(pcm, fmt.sample_width)))
+
+    def _append(self, audio: bytes):
+        if not audio:
+            return
+        try:
+            self._ws.send(json.dumps({
+                "type": "input_audio_buffer.append",
+                "audio": base64.b64encode(audio).decode("ascii"),
+            }))
+        except Exception:
+            log.warning("Realtime transcription send failed, will fall back to batch",
+                        exc_info=True)
+            self._failed = True
+
+    def finish(self, pcm: memoryview) -> str:
+        try:
+            if self._resampler is not None:
+                self._append(self._resampler.flush())
+            if self._failed:
+                return super().finish(pcm)
+            self._ws.send(json.dumps({"type": "input_audio_buffer.commit"}))
+            deadline = time.monotonic() + STT_FINAL_TIMEOUT
+            while True:
+                event = json.loads(self._ws.recv(timeout=max(0.0, deadline - time.monotonic())))
+                kind = event.get("type")
+                if kind == "conversation.item.input_audio_transcription.completed":
+                    text = event.get("transcript", "").strip()
+                    log.info("Transcription: %s", text)
+                    return text
+                if kind == "error":
+                    raise RuntimeError(event.get("error", {}).get("message", "unknown error"))
+        except Exception:
+            log.warning("Realtime transcription failed, falling back to batch", exc_info=True)
+            return super().finish(pcm)
+        finally:
+            self.close()
+
+    def close(self):
+        try:
+            self._ws.close()
+        except Exception:
+            pass
+
+
+def _local_stt_engine(pcm: bytes, fmt: AudioFormat) -> str:
+    """Default LocalTranscriber engine: one word per window with sound in it."""
+    samples = pcm_to_16bit(pcm, fmt.sample_width)
+    count = len(samples) // 2
+    if count == 0:
+        return ""
+    values = struct.unpack(f"<{count}h", samples[: count * 2])
+    rms = math.sqrt(sum(v * v for v in values) / count)
+    return "speech" if rms > 100 else ""
+
+
+class LocalTranscriber(Transcriber):
+    """Offline stand-in for a streaming STT engine.
+
+    Audio is decoded in LOCAL_STT_WINDOW_S windows on a worker thread while
+    the stream is still arriving, like a real streaming engine, so finish()
+    only waits for the last partial window.  *engine(pcm, fmt) -> str* turns
+    one window into text; the default just marks windows that aren't silent.
+    """
+
+    def __init__(self, engine=None):
+        self._engine = engine or _local_stt_engine
+        self._window = bytearray()
+        self._fmt = DEFAULT_FORMAT
+        self._windows: queue.Queue[bytes | None] = queue.Queue()
+        self._words: list[str] = []
+        self._worker = threading.Thread(target=self._run, daemon=True)
+        self._worker.start()
+
+    def _run(self):
+        while (pcm := self._windows.get()) is not None:
+            text = self._engine(pcm, self._fmt)
+            if text:
+                self._words.append(text)
+
+    def feed(self, pcm: bytes, fmt: AudioFormat):
+        self._fmt = fmt
+        self._window.extend(pcm)
+        window_bytes = int(fmt.bytes_per_second * LOCAL_STT_WINDOW_S)
+        window_bytes -= window_bytes % fmt.sample_width
+        while len(self._window) >= window_bytes:
+            self._windows.put(bytes(self._window[:window_bytes]))
+            del self._window[:window_bytes]
+
+    def finish(self, pcm: memoryview) -> str:
+        if self._window:
+            self._windows.put(bytes(self._window))
+            self._window.clear()
+        self.close()
+        text = " ".join(self._words)
+        log.info("Transcription: %s", text)
+        return text
+
+    def close(self):
+        self._windows.put(None)
+        self._worker.join()
+
+
+def _float_audio(pcm16: bytes):
+    """16-bit PCM as the float32 array in [-1, 1) that Whisper models take."""
+    import numpy  # installed with either Whisper package
+
+    return numpy.frombuffer(pcm16, dtype="<i2").astype(numpy.float32) / 32768.0
+
+
+class WhisperEngine:
+    """A Whisper model loaded once and kept in memory, for LAN-only transcription.
+
+    transcribe() takes 16 kHz 16-bit mono PCM.  Calls beyond the engine's
+    worker slots wait rather than compete for the same cores.
+    """
+
+    name = "whisper"
+
+    def __init__(self, model: str, workers: int = LOCAL_STT_WORKERS):
+        self.model = model
+        self._slots = threading.Semaphore(workers)
+
+    def _run(self, audio) -> str:
+        raise NotImplementedError
+
+    def transcribe(self, pcm16: bytes) -> str:
+        audio = _float_audio(pcm16)
+        with self._slots:
+            start = time.monotonic()
+            text = self._run(audio).strip()
+        log.info("%s transcribed %.1fs of audio in %.0f ms", self.name,
+                 len(pcm16) / 2 / WHISPER_RATE, (time.monotonic() - start) * 1000)
+        return text
+
+
+class FasterWhisperEngine(WhisperEngine):
+    """CTranslate2 Whisper (faster-whisper), int8 on the CPU."""
+
+    name = "faster-whisper"
+
+    def __init__(self, model: str, workers: int = LOCAL_STT_WORKERS,
+                 threads: int = LOCAL_STT_THREADS):
+        super().__init__(model, workers)
+        from faster_whisper import WhisperModel  # optional: pip install faster-whisper
+
+        self._model = WhisperModel(model, device="cpu", compute_type="int8",
+                                   cpu_threads=threads, num_workers=workers)
+
+    def _run(self, audio) -> str:
+        segments, _ = self._model.transcribe(audio, beam_size=1)
+        return "".join(segment.text for segment in segments)
+
+
+class WhisperCppEngine(WhisperEngine):
+    """whisper.cpp through its Python bindings (pywhispercpp)."""
+
+    name = "whisper.cpp"
+
+    def __init__(self, model: str, workers: int = LOCAL_STT_WORKERS,
+                 threads: int = LOCAL_STT_THREADS):
+        super().__init__(model, 1)  # one whisper.cpp context, used by one call at a time
+        from pywhispercpp.model import Model  # optional: pip install pywhispercpp
+
+        self._model = Model(model, n_threads=threads * workers,
+                            print_progress=False, print_realtime=False)
+
+    def _run(self, audio) -> str:
+        return "".join(segment.text for segment in self._model.transcribe(audio))
+
+
+LOCAL_STT_ENGINES = {"faster-whisper": FasterWhisperEngine, "whisper.cpp": WhisperCppEngine}
+stt_engine: WhisperEngine | None = None  # loaded by load_stt_engine()
+
+
+def load_stt_engine(backend: str, model: str) -> WhisperEngine:
+    """Load *backend*'s model for the life of the server. Raises ImportError if not installed."""
+    global stt_engine
+    start = time.monotonic()
+    stt_engine = LOCAL_STT_ENGINES[backend](model)
+    log.info("Loaded %s model %s in %.1fs", backend, model, time.monotonic() - start)
+    return stt_engine
+
+
+class ModelTranscriber(BatchTranscriber):
+    """Buffer the utterance and transcribe it at the end with the resident local model."""
+
+    def __init__(self, engine: WhisperEngine):
+        super().__init__()
+        self._engine = engine
 
-        conversation_history.append({"role": "assistant", "content": reply})
+    def _transcribe(self, pcm: memoryview) -> str:
+        pcm16 = resample_pcm16(pcm_to_16bit(pcm, self._fmt.sample_width),
+                               self._fmt.sample_rate, WHISPER_RATE)
+        text = self._engine.transcribe(pcm16)
+        log.info("Transcription: %s", text)
+        return text
+
+
+def make_transcriber() -> Transcriber:
+    """Create the STT_BACKEND transcriber for a new utterance."""
+    if STT_BACKEND == "local":
+        return LocalTranscriber()
+    if STT_BACKEND in LOCAL_STT_ENGINES:
+        return ModelTranscriber(stt_engine)
+    if STT_BACKEND == "realtime":
+        try:
+            return RealtimeTranscriber()
+        except Exception:
+            log.warning("Realtime transcription unavailable, using batch", exc_info=True)
+    return BatchTranscriber()
+
+
+# ---------------------------------------------------------------------------
+# OpenAI: Chat Completion
+# ---------------------------------------------------------------------------
+def chat_completion(user_text: str, session: str = DEFAULT_SESSION) -> str:
+    """Send user text to ChatGPT and return the assistant reply."""
+    log.info("Getting chat completion...")
+
+    conversation = get_conversation(session)
+    messages, turn = conversation.begin(user_text)
+    response = client.chat.completions.create(
+        model=OPENAI_MODEL_CHAT,
+        messages=messages,
+        timeout=OPENAI_CHAT_TIMEOUT,
+    )
+    reply = response.choices[0].message.content.strip()
+    conversation.commit(user_text, reply, turn)
 
     log.info("Chat reply: %s", reply)
     return reply
 
 
+def chat_completion_stream(user_text: str, session: str = DEFAULT_SESSION) -> Iterator[str]:
+    """Like chat_completion(), but yield the reply as it is generated.
+
+    The turn is only added to the history once the reply is complete.
+    """
+    log.info("Getting chat completion (streamed)...")
+
+    conversation = get_conversation(session)
+    messages, turn = conversation.begin(user_text)
+    stream = client.chat.completions.create(
+        model=OPENAI_MODEL_CHAT,
+        messages=messages,
+        stream=True,
+        timeout=OPENAI_CHAT_TIMEOUT,
+    )
+    parts = []
+    for chunk in stream:
+        if not chunk.choices:
+            continue
+        delta = chunk.choices[0].delta.content
+        if delta:
+            parts.append(delta)
+            yield delta
+    reply = "".join(parts).strip()
+    conversation.commit(user_text, reply, turn)
+
+    log.info("Chat reply: %s", reply)
+
+
+_SENTENCE_END = re.compile(r"[.!?]+[\"')\]]*\s")
+_CLAUSE_END = re.compile(r"[,;:]\s")
+
+
+def _segment_cut(text: str) -> int | None:
+    """Index after which *text* can be spoken on its own, or None to wait."""
+    for m in _SENTENCE_END.finditer(text):
+        if m.end() >= MIN_SEGMENT_CHARS:
+            return m.end()
+    if len(text) <= MAX_SEGMENT_CHARS:
+        return None
+    clauses = [m.end() for m in _CLAUSE_END.finditer(text, 0, MAX_SEGMENT_CHARS)]
+    if clauses:
+        return clauses[-1]
+    space = text.rfind(" ", 0, MAX_SEGMENT_CHARS)
+    return space + 1 if space > 0 else MAX_SEGMENT_CHARS
+
+
+def split_sentences(deltas: Iterable[str]) -> Iterator[str]:
+    """Regroup a stream of text deltas into speakable sentences.
+
+    A sentence is emitted as soon as the whitespace after its final
+    punctuation arrives, so decimals like "3.5" are never split.
+    """
+    buf = ""
+    for delta in deltas:
+        buf += delta
+        while (cut := _segment_cut(buf)) is not None:
+            segment, buf = buf[:cut].strip(), buf[cut:]
+            if segment:
+                yield segment
+    if buf.strip():
+        yield buf.strip()
+
+
 # ---------------------------------------------------------------------------
 # OpenAI: Text-to-Speech
 # ---------------------------------------------------------------------------
-def text_to_speech(text: str, tts_dir: str | None = None) -> str:
-    """Convert text to speech via OpenAI TTS. Returns path to the MP3 file."""
-    log.info("Generating TTS audio...")
-    target_dir = tts_dir or TTS_DIR or tempfile.gettempdir()
-    tmp = tempfile.NamedTemporaryFile(
-        suffix=".mp3", delete=False, dir=target_dir
-    )
-    tmp_path = tmp.name
-    tmp.close()
+class TtsCache:
+    """Content-addressed cache of synthesized audio.
+
+    Keys hash everything that affects the audio (text, voice, model,
+    format).  A byte-bounded LRU in memory sits in front of an optional
+    directory on disk, which survives restarts and is trimmed oldest-used
+    first.  Hit and miss counts are kept for the logs.
+    """
+
+    def __init__(self, directory: str | None = None,
+                 memory_bytes: int = TTS_CACHE_MEMORY_BYTES,
+                 disk_bytes: int = TTS_CACHE_DISK_BYTES):
+        self.directory = directory
+        self.memory_bytes = memory_bytes
+        self.disk_bytes = disk_bytes
+        self.memory_hits = 0
+        self.disk_hits = 0
+        self.misses = 0
+        self._memory: OrderedDict[str, bytes] = OrderedDict()
+        self._memory_size = 0
+        self._lock = threading.Lock()
+        if directory:
+            os.makedirs(directory, exist_ok=True)
+
+    @staticmethod
+    def key(text: str, ext: str) -> str:
+        ident = "\0".join((OPENAI_MODEL_TTS, OPENAI_TTS_VOICE, ext, text))
+        return hashlib.sha256(ident.encode("utf-8")).hexdigest() + ext
+
+    def get(self, key: str) -> bytes | None:
+        with self._lock:
+            data = self._memory.get(key)
+            if data is not None:
+                self._memory.move_to_end(key)
+                self.memory_hits += 1
+                return data
+
+        data = self._read_disk(key)
+        with self._lock:
+            if data is None:
+                self.misses += 1
+                return None
+            self.disk_hits += 1
+            self._remember(key, data)
+        return data
+
+    def put(self, key: str, data: bytes):
+        with self._lock:
+            self._remember(key, data)
+        if self.directory:
+            self._write_disk(key, data)
+
+    def stats(self) -> str:
+        lookups = self.memory_hits + self.disk_hits + self.misses
+        hits = self.memory_hits + self.disk_hits
+        return (f"{hits}/{lookups} hits ({self.memory_hits} memory, {self.disk_hits} disk), "
+                f"{len(self._memory)} entries / {self._memory_size} bytes in memory")
+
+    def _remember(self, key: str, data: bytes):
+        # Called with _lock held
+        if key in self._memory:
+            self._memory_size -= len(self._memory.pop(key))
+        self._memory[key] = data
+        self._memory_size += len(data)
+        while self._memory_size > self.memory_bytes and len(self._memory) > 1:
+            _, old = self._memory.popitem(last=False)
+            self._memory_size -= len(old)
+
+    def _read_disk(self, key: str) -> bytes | None:
+        if not self.directory:
+            return None
+        path = os.path.join(self.directory, key)
+        try:
+            with open(path, "rb") as f:
+                data = f.read()
+            os.utime(path)  # mark as recently used for trimming
+            return data
+        except OSError:
+            return None
+
+    def _write_disk(self, key: str, data: bytes):
+        path = os.path.join(self.directory, key)
+        try:
+            with open(path + ".tmp", "wb") as f:
+                f.write(data)
+            os.replace(path + ".tmp", path)
+            self._trim_disk()
+        except OSError:
+            log.warning("Could not write TTS cache entry %s", path, exc_info=True)
+
+    def _trim_disk(self):
+        entries = []
+        for entry in os.scandir(self.directory):
+            if entry.is_file() and not entry.name.endswith(".tmp"):
+                st = entry.stat()
+                entries.append((st.st_mtime, st.st_size, entry.path))
+        total = sum(size for _, size, _ in entries)
+        for _, size, path in sorted(entries):
+            if total <= self.disk_bytes:
+                break
+            os.unlink(path)
+            total -= size
+
 
-    with client.audio.speech.with_streaming_response.create(
-        model=OPENAI_MODEL_TTS,
-        voice=OPENAI_TTS_VOICE,
-        input=text,
-        response_format="mp3",
-    ) as response:
-        response.stream_to_file(tmp_path)
+tts_cache = TtsCache()
 
-    log.info("TTS audio saved to %s", tmp_path)
-    return tmp_path
+
+class TtsArtifact:
+    """One synthesized reply, held in memory and served over HTTP by id.
+
+    The synthesis thread appends audio as it arrives from OpenAI; the HTTP
+    handler follows it as it grows until done is set.  Artifacts are
+    reference counted by TtsStore and dropped when the last holder releases
+    them.
+    """
+
+    def __init__(self, artifact_id: str, ext: str):
+        self.id = artifact_id
+        self.ext = ext
+        self.data = bytearray()
+        self.done = False
+        self.error: Exception | None = None
+        self.created = time.monotonic()
+        self.refs = 1  # held by the creator
+        self._cond = threading.Condition()
+        self._listeners: list[tuple[asyncio.AbstractEventLoop, asyncio.Event]] = []
+
+    @property
+    def name(self) -> str:
+        """The file name the artifact is served under."""
+        return f"{self.id}{self.ext}"
+
+    @property
+    def content_type(self) -> str:
+        return "audio/wav" if self.ext == ".wav" else "audio/mpeg"
+
+    def append(self, chunk: bytes):
+        with self._cond:
+            self.data.extend(chunk)
+            self._notify()
+
+    def finish(self, error: Exception | None = None):
+        with self._cond:
+            self.done = True
+            self.error = error
+            self._notify()
+
+    def _notify(self):
+        # Called with _cond held
+        self._cond.notify_all()
+        for loop, event in self._listeners:
+            try:
+                loop.call_soon_threadsafe(event.set)
+            except RuntimeError:
+                pass  # loop already closed
+
+    async def follow(self, timeout: float) -> AsyncIterator[bytes]:
+        """Yield the artifact's data as it grows, from an event loop.
+
+        Raises TimeoutError if nothing new arrives for *timeout* seconds.
+        """
+        event = asyncio.Event()
+        listener = (asyncio.get_running_loop(), event)
+        with self._cond:
+            self._listeners.append(listener)
+        try:
+            offset = 0
+            while True:
+                event.clear()
+                with self._cond:
+                    data, done = bytes(self.data[offset:]), self.done
+                if data:
+                    offset += len(data)
+                    yield data
+                elif done:
+                    return
+                else:
+                    await asyncio.wait_for(event.wait(), timeout)
+        finally:
+            with self._cond:
+                self._listeners.remove(listener)
+
+    def wait_done(self, timeout: float):
+        with self._cond:
+            self._cond.wait_for(lambda: self.done, timeout)
+
+    def wait(self, offset: int, timeout: float) -> tuple[bytes, bool]:
+        """Wait until there is data past *offset* or the artifact is done.
+
+        Returns (new data, done) at that point, or on timeout.
+        """
+        with self._cond:
+            self._cond.wait_for(lambda: len(self.data) > offset or self.done, timeout)
+            return bytes(self.data[offset:]), self.done
+
+
+class TtsStore:
+    """Bounded in-memory store of TTS artifacts keyed by unguessable ids.
+
+    create() hands out an artifact holding one reference; acquire() and
+    release() add and drop more.  An artifact is removed as soon as its
+    last reference is released.  Anything older than *ttl* is evicted
+    regardless, so a leaked reference can't pin memory forever, and above
+    *max_bytes* the oldest finished artifacts are evicted to make room.
+    Requests already being served keep their artifact alive until done.
+    """
+
+    def __init__(self, max_bytes: int = TTS_STORE_MAX_BYTES, ttl: float = TTS_STORE_TTL):
+        self.max_bytes = max_bytes
+        self.ttl = ttl
+        self._artifacts: dict[str, TtsArtifact] = {}
+        self._lock = threading.Lock()
+
+    def create(self, ext: str) -> TtsArtifact:
+        artifact = TtsArtifact(secrets.token_urlsafe(16), ext)
+        with self._lock:
+            self._evict()
+            self._artifacts[artifact.name] = artifact
+        return artifact
+
+    def acquire(self, name: str) -> TtsArtifact | None:
+        """Look up an artifact by served name and take a reference to it."""
+        with self._lock:
+            self._evict()
+            artifact = self._artifacts.get(name)
+            if artifact:
+                artifact.refs += 1
+            return artifact
+
+    def release(self, artifact: TtsArtifact):
+        with self._lock:
+            artifact.refs -= 1
+            if artifact.refs <= 0:
+                self._artifacts.pop(artifact.name, None)
+
+    def __len__(self) -> int:
+        with self._lock:
+            return len(self._artifacts)
+
+    def _evict(self):
+        # Called with _lock held
+        now = time.monotonic()
+        for name, artifact in list(self._artifacts.items()):
+            if now - artifact.created > self.ttl:
+                log.warning("TTS artifact %s expired with %d references", name, artifact.refs)
+                del self._artifacts[name]
+
+        total = sum(len(a.data) for a in self._artifacts.values())
+        for name, artifact in sorted(self._artifacts.items(), key=lambda kv: kv[1].created):
+            if total <= self.max_bytes:
+                break
+            if artifact.done:
+                log.warning("TTS store over %d bytes, evicting %s", self.max_bytes, name)
+                total -= len(artifact.data)
+                del self._artifacts[name]
+
+
+tts_store = TtsStore()
+
+
+def _synthesize(text: str, artifact: TtsArtifact, cache_key: str):
+    """Fill *artifact* with TTS audio for *text* as it arrives from OpenAI."""
+    wav = artifact.ext == ".wav"
+    error = None
+    try:
+        with client.audio.speech.with_streaming_response.create(
+            model=OPENAI_MODEL_TTS,
+            voice=OPENAI_TTS_VOICE,
+            input=text,
+            response_format="pcm" if wav else "mp3",
+            timeout=OPENAI_TTS_TIMEOUT,
+        ) as response:
+            fmt = AudioFormat(sample_rate=OPENAI_TTS_PCM_RATE)
+            if wav:
+                # Length unknown while streaming; patched once complete
+                artifact.append(wav_header(fmt, 0xFFFFFFFF - 36))
+            for chunk in response.iter_bytes():
+                artifact.append(chunk)
+            if wav:
+                data_bytes = len(artifact.data) - 44
+                artifact.data[:44] = wav_header(fmt, data_bytes - data_bytes % 2)
+        log.info("TTS audio complete: %s (%d bytes)", artifact.name, len(artifact.data))
+        tts_cache.put(cache_key, bytes(artifact.data))
+    except Exception as e:
+        log.error("TTS synthesis failed", exc_info=True)
+        error = e
+    finally:
+        artifact.finish(error)
+        tts_store.release(artifact)
+
+
+def text_to_speech(text: str, wav: bool = False) -> TtsArtifact:
+    """Convert text to speech via OpenAI TTS. Returns the audio artifact.
+
+    Audio already in tts_cache is returned complete without an API call.
+    Otherwise this returns as soon as the first audio has arrived; synthesis carries on in
+    the background and the HTTP server streams the artifact to the Sonos as
+    it grows.  The caller holds one reference and must release it to
+    tts_store when done.
+
+    By default the audio is MP3.  With *wav* the raw PCM response is wrapped
+    in a WAV container instead, so the exact samples the Sonos plays are
+    available as an echo reference.
+    """
+    ext = ".wav" if wav else ".mp3"
+    artifact = tts_store.create(ext)
+    cache_key = tts_cache.key(text, ext)
+    cached = tts_cache.get(cache_key)
+    if cached is not None:
+        log.info("TTS cache hit for %r (%s)", text[:40], tts_cache.stats())
+        artifact.append(cached)
+        artifact.finish()
+        return artifact
+
+    log.info("Generating TTS audio (cache miss, %s)...", tts_cache.stats())
+    artifact.refs += 1  # held by the synthesis thread
+    threading.Thread(target=_synthesize, args=(text, artifact, cache_key), daemon=True).start()
+
+    artifact.wait(0, TTS_FIRST_BYTE_TIMEOUT)
+    if artifact.error:
+        tts_store.release(artifact)
+        raise artifact.error
+    log.info("TTS audio streaming as %s", artifact.name)
+    return artifact
+
+
+def prewarm_tts_cache(phrases: Iterable[str], wav: bool = False):
+    """Make sure *phrases* are cached, synthesizing any that aren't."""
+    for text in phrases:
+        try:
+            artifact = text_to_speech(text, wav=wav)
+            artifact.wait_done(TTS_FIRST_BYTE_TIMEOUT)
+            tts_store.release(artifact)
+        except Exception:
+            log.warning("Could not pre-synthesize %r", text, exc_info=True)
+    log.info("TTS cache warm: %s", tts_cache.stats())
 
 
 # ---------------------------------------------------------------------------
-# HTTP server (serves TTS files to Sonos)
+# Echo reference for the device's acoustic echo canceller
 # ---------------------------------------------------------------------------
-class _TtsHandler(SimpleHTTPRequestHandler):
-    def do_GET(self):
-        # Block directory listings
-        if self.path.rstrip("/") == "" or self.path == "/":
-            self.send_error(403, "Directory listing not allowed")
+def load_reference(wav_file, fmt: AudioFormat) -> bytes:
+    """Read a TTS WAV (path or file object) as 16-bit mono PCM at the device's stream rate."""
+    with wave.open(wav_file, "rb") as wf:
+        if wf.getnchannels() != 1 or wf.getsampwidth() != 2:
+            raise ValueError("reference must be 16-bit mono")
+        rate = wf.getframerate()
+        pcm = wf.readframes(wf.getnframes())
+    return resample_pcm16(pcm, rate, fmt.sample_rate)
+
+
+def wait_for_sonos_playing(speaker: soco.SoCo, timeout: float = SONOS_START_TIMEOUT) -> bool:
+    """Wait until the Sonos reports PLAYING, the moment audio leaves the speaker."""
+    return wait_for_sonos_state(speaker, ("PLAYING",), timeout, poll_interval=0.05) is not None
+
+
+class ReferenceStreamer(threading.Thread):
+    """Send the playing TTS audio to the device in real time.
+
+    Frames go out as MSG_REF downlink messages, paced from the moment the
+    Sonos starts playing so they line up with the echo reaching the mic.
+    The device's adaptive filter absorbs the remaining offset.  *pcm* is
+    the reference at the device's rate, or a WAV artifact of TTS audio that
+    is followed and resampled while it is still being synthesized.  stop()
+    must be called before anything else is written to *conn*.
+    """
+
+    def __init__(self, conn: socket.socket, pcm: bytes | TtsArtifact, fmt: AudioFormat,
+                 speaker: soco.SoCo):
+        super().__init__(daemon=True)
+        self.conn = conn
+        self.pcm = pcm
+        self.fmt = fmt
+        self.speaker = speaker
+        self.frames_sent = 0
+        self._stop_event = threading.Event()
+
+    def run(self):
+        if not wait_for_sonos_playing(self.speaker):
+            log.warning("Sonos never reported PLAYING, no echo reference sent")
             return
 
-        # Resolve the requested path relative to the served directory
-        rel_path = self.path.lstrip("/")
-        base_dir = Path(self.directory).resolve()
-        requested = (base_dir / rel_path).resolve()
+        frame_bytes = self.fmt.sample_rate * REF_FRAME_MS // 1000 * 2
+        start = time.monotonic()
+        for i, frame in enumerate(self._frames(frame_bytes)):
+            delay = start + i * REF_FRAME_MS / 1000 - time.monotonic()
+            if self._stop_event.wait(max(0.0, delay)):
+                break
+            try:
+                self.conn.sendall(bytes([MSG_REF]) + struct.pack("<H", len(frame)) + frame)
+            except OSError:
+                log.warning("Device went away while streaming echo reference")
+                break
+            self.frames_sent += 1
+        log.info("Echo reference: %d frames sent", self.frames_sent)
 
-        # Prevent path traversal
-        if not str(requested).startswith(str(base_dir)):
-            self.send_error(403, "Forbidden")
+    def _frames(self, frame_bytes: int) -> Iterator[bytes]:
+        if not isinstance(self.pcm, TtsArtifact):
+            for offset in range(0, len(self.pcm), frame_bytes):
+                yield self.pcm[offset : offset + frame_bytes]
             return
 
-        # Only serve .mp3 files
-        if not requested.suffix.lower() == ".mp3":
-            self.send_error(403, "Only .mp3 files are served")
-            return
+        resampler = StreamResampler(OPENAI_TTS_PCM_RATE, self.fmt.sample_rate)
+        ready = bytearray()
+        offset, done = 44, False  # past the WAV header
+        while not done and not self._stop_event.is_set():
+            data, done = self.pcm.wait(offset, REF_FRAME_MS / 1000)
+            offset += len(data)
+            ready += resampler.feed(data)
+            if done:
+                ready += resampler.flush()
+            while len(ready) >= frame_bytes or (done and ready):
+                yield bytes(ready[:frame_bytes])
+                del ready[:frame_bytes]
 
-        if not requested.is_file():
-            self.send_error(404, "File not found")
-            return
+    def stop(self):
+        self._stop_event.set()
+        self.join()
 
-        super().do_GET()
 
-    def handle(self):
-        try:
-            super().handle()
-        except BrokenPipeError:
-            log.debug("HTTP: client disconnected (broken pipe)")
+# ---------------------------------------------------------------------------
+# HTTP server (serves TTS files to Sonos)
+# ---------------------------------------------------------------------------
+def _parse_http_head(head: bytes) -> tuple[list[str], dict[str, str]]:
+    """Split an HTTP request or status line and its headers (names lowercased)."""
+    lines = head.decode("latin-1").split("\r\n")
+    headers = {}
+    for line in lines[1:]:
+        name, sep, value = line.partition(":")
+        if sep:
+            headers[name.strip().lower()] = value.strip()
+    return lines[0].split(" ", 2), headers
+
+
+async def _handle_http(reader: asyncio.StreamReader, writer: asyncio.StreamWriter,
+                       store: TtsStore, events: "SonosEvents | None" = None):
+    """Serve one request for /<id>.mp3 or .wav from *store*, then close.
+
+    NOTIFY requests to SONOS_EVENT_CALLBACK are Sonos transport events and
+    go to *events*.
+    """
+    try:
+        request = await asyncio.wait_for(reader.readuntil(b"\r\n\r\n"), HTTP_HEADER_TIMEOUT)
+        start_line, headers = _parse_http_head(request)
+        method, path = start_line[0], start_line[1] if len(start_line) > 1 else ""
+        log.debug("HTTP: %s %s", method, path)
+        if method == "NOTIFY" and events and path == SONOS_EVENT_CALLBACK:
+            length = min(int(headers.get("content-length", 0)), MAX_EVENT_BYTES)
+            body = await asyncio.wait_for(reader.readexactly(length), HTTP_HEADER_TIMEOUT)
+            if events.notify(headers.get("sid"), body):
+                writer.write(b"HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+            else:
+                # Not our subscription; the Sonos drops it
+                writer.write(b"HTTP/1.1 412 Precondition Failed\r\nContent-Length: 0\r\n"
+                             b"Connection: close\r\n\r\n")
+            await writer.drain()
+            return
+        if method not in ("GET", "HEAD"):
+            writer.write(b"HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n"
+                         b"Connection: close\r\n\r\n")
+            return
 
-    def log_message(self, format, *args):
-        log.debug("HTTP: %s", format % args)
+        name = path.split("?", 1)[0].lstrip("/")
+        artifact = store.acquire(name) if name else None
+        if artifact is None:
+            writer.write(b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                         b"Connection: close\r\n\r\n")
+            return
+        try:
+            headers = f"HTTP/1.1 200 OK\r\nContent-Type: {artifact.content_type}\r\n"
+            if artifact.done:
+                headers += f"Content-Length: {len(artifact.data)}\r\n"
+            # Otherwise still synthesizing: no Content-Length, the body
+            # ends when the connection closes
+            writer.write((headers + "Connection: close\r\n\r\n").encode("latin-1"))
+            if method == "GET":
+                try:
+                    async for data in artifact.follow(TTS_STREAM_TIMEOUT):
+                        writer.write(data)
+                        await writer.drain()
+                except TimeoutError:
+                    log.warning("TTS stream stalled for %ds, closing", TTS_STREAM_TIMEOUT)
+        finally:
+            store.release(artifact)
+        await writer.drain()
+    except (ConnectionError, TimeoutError, ValueError, asyncio.IncompleteReadError,
+            asyncio.LimitOverrunError):
+        log.debug("HTTP: client went away or sent a bad request")
+    finally:
+        writer.close()
 
 
-def start_http_server(port: int, directory: str) -> HTTPServer:
-    """Start a background HTTP server that serves files from *directory*."""
-    handler = partial(_TtsHandler, directory=directory)
-    httpd = HTTPServer(("", port), handler)
-    thread = threading.Thread(target=httpd.serve_forever, daemon=True)
-    thread.start()
-    log.info("HTTP server started on port %d, serving %s", port, directory)
-    return httpd
+async def start_http_server(port: int, store: TtsStore, host: str = "",
+                            events: "SonosEvents | None" = None) -> asyncio.Server:
+    """Serve TTS artifacts from *store* to the Sonos on the running event loop."""
+    server = await asyncio.start_server(
+        partial(_handle_http, store=store, events=events), host or None, port)
+    log.info("HTTP server started on port %d", server.sockets[0].getsockname()[1])
+    return server
 
 
 # ---------------------------------------------------------------------------
@@ -304,61 +2040,598 @@ def play_on_sonos(speaker: soco.SoCo, audio_url: str):
     speaker.play_uri(audio_url, title="ESP Assistant Response")
 
 
+def stop_sonos(speaker: soco.SoCo):
+    """Stop playback, e.g. when a reply is interrupted."""
+    try:
+        speaker.stop()
+    except Exception:
+        log.warning("Could not stop Sonos", exc_info=True)
+
+
 def wait_for_sonos_done(speaker: soco.SoCo, timeout: int = 120):
-    """Poll Sonos transport state until playback finishes or *timeout* expires."""
-    deadline = time.time() + timeout
-    # Give Sonos a moment to start playing
-    time.sleep(1)
-    while time.time() < deadline:
-        try:
-            info = speaker.get_current_transport_info()
-            state = info.get("current_transport_state", "")
-            if state in ("STOPPED", "PAUSED_PLAYBACK", "NO_MEDIA_PRESENT"):
-                log.info("Sonos playback finished (state=%s)", state)
-                return
+    """Wait until playback finishes or *timeout* expires."""
+    # Until playback has actually started the speaker may still report the
+    # previous STOPPED state
+    wait_for_sonos_playing(speaker)
+    state = wait_for_sonos_state(speaker, SONOS_DONE_STATES, timeout)
+    if state:
+        log.info("Sonos playback finished (state=%s)", state)
+    else:
+        log.warning("Sonos playback wait timed out after %ds", timeout)
+
+
+def wait_for_sonos_state(speaker: soco.SoCo, states: tuple[str, ...], timeout: float,
+                         poll_interval: float = SONOS_POLL_INTERVAL) -> str | None:
+    """Block until *speaker* reports one of *states*; return it, or None on timeout.
+
+    With an active event subscription the state is pushed and only checked
+    by polling every SONOS_EVENT_CHECK seconds in case an event was lost.
+    """
+    deadline = time.monotonic() + timeout
+    while (remaining := deadline - time.monotonic()) > 0:
+        events = sonos_events
+        subscribed = (events is not None and events.active
+                      and events.speaker_ip == getattr(speaker, "ip_address", None))
+        if subscribed:
+            state = events.wait_for(states, min(remaining, SONOS_EVENT_CHECK))
+            if state:
+                return state
+        try:
+            state = speaker.get_current_transport_info().get("current_transport_state", "")
+            if state in states:
+                return state
         except Exception:
             log.warning("Error polling Sonos transport state", exc_info=True)
-        time.sleep(0.5)
-    log.warning("Sonos playback poll timed out after %ds", timeout)
+        if not subscribed:
+            time.sleep(min(poll_interval, max(0.0, deadline - time.monotonic())))
+    return None
+
+
+class SonosEvents:
+    """Transport state of one Sonos, kept current by UPnP AVTransport events.
+
+    start() subscribes (GENA SUBSCRIBE) to the speaker's AVTransport service
+    with our HTTP server as the callback, which hands each NOTIFY to
+    notify().  The subscription is renewed before it expires and retried
+    if it is lost; while it is not active, waits fall back to polling.
+    """
+
+    def __init__(self, speaker_ip: str, callback_url: str, port: int = SONOS_UPNP_PORT):
+        self.speaker_ip = speaker_ip
+        self.port = port
+        self.callback_url = callback_url
+        self.sid: str | None = None
+        self.state: str | None = None
+        self.active = False
+        self._cond = threading.Condition()
+        self._renewer: asyncio.Task | None = None
+
+    async def start(self) -> bool:
+        """Subscribe and keep the subscription alive; False if polling for now."""
+        try:
+            timeout = await self._subscribe()
+            log.info("Subscribed to Sonos transport events (%s)", self.sid)
+        except (OSError, EOFError, ValueError, asyncio.TimeoutError) as e:
+            log.warning("Sonos event subscription failed (%s), polling instead", e)
+            timeout = SONOS_RESUBSCRIBE_INTERVAL
+        self._renewer = asyncio.get_running_loop().create_task(self._renew_forever(timeout))
+        return self.active
+
+    async def close(self):
+        if self._renewer:
+            self._renewer.cancel()
+        if self.active:
+            self.active = False
+            try:
+                await self._request("UNSUBSCRIBE", {"SID": self.sid})
+            except (OSError, EOFError, ValueError, asyncio.TimeoutError):
+                pass
+
+    async def _renew_forever(self, timeout: float):
+        while True:
+            # Renew well before expiry
+            await asyncio.sleep(timeout * 0.8 if self.active else SONOS_RESUBSCRIBE_INTERVAL)
+            was_active = self.active
+            try:
+                timeout = await self._subscribe()
+                if not was_active:
+                    log.info("Subscribed to Sonos transport events (%s)", self.sid)
+            except (OSError, EOFError, ValueError, asyncio.TimeoutError) as e:
+                if self.active:
+                    log.warning("Lost Sonos event subscription (%s), polling instead", e)
+                self.active = False
+                self.sid = None  # start over with a new subscription
+
+    async def _subscribe(self) -> int:
+        if self.sid:
+            headers = {"SID": self.sid}
+        else:
+            headers = {"CALLBACK": f"<{self.callback_url}>", "NT": "upnp:event"}
+        headers["TIMEOUT"] = f"Second-{SONOS_SUBSCRIPTION_TIMEOUT}"
+        response = await self._request("SUBSCRIBE", headers)
+        self.sid = response.get("sid", self.sid)
+        if not self.sid:
+            raise ValueError("no SID in SUBSCRIBE response")
+        self.active = True
+        timeout = response.get("timeout", "").lower().removeprefix("second-")
+        return int(timeout) if timeout.isdigit() else SONOS_SUBSCRIPTION_TIMEOUT
+
+    async def _request(self, method: str, headers: dict[str, str]) -> dict[str, str]:
+        reader, writer = await asyncio.wait_for(
+            asyncio.open_connection(self.speaker_ip, self.port), SONOS_REQUEST_TIMEOUT)
+        try:
+            lines = [f"{method} {SONOS_AVTRANSPORT_EVENTS} HTTP/1.1",
+                     f"HOST: {self.speaker_ip}:{self.port}",
+                     *(f"{name}: {value}" for name, value in headers.items()),
+                     "Content-Length: 0", "Connection: close"]
+            writer.write(("\r\n".join(lines) + "\r\n\r\n").encode("latin-1"))
+            response = await asyncio.wait_for(reader.readuntil(b"\r\n\r\n"),
+                                              SONOS_REQUEST_TIMEOUT)
+        finally:
+            writer.close()
+        status, response_headers = _parse_http_head(response)
+        if len(status) < 2 or status[1] != "200":
+            raise ConnectionError(f"{method} refused: {' '.join(status)}")
+        return response_headers
+
+    def notify(self, sid: str | None, body: bytes) -> bool:
+        """Handle one NOTIFY; False if it belongs to another subscription."""
+        # The first event can arrive before the SUBSCRIBE response
+        if self.sid and sid != self.sid:
+            return False
+        try:
+            state = None
+            for prop in ElementTree.fromstring(body).iter():
+                if prop.tag.endswith("LastChange") and prop.text:
+                    for var in ElementTree.fromstring(prop.text).iter():
+                        if var.tag.endswith("TransportState"):
+                            state = var.get("val")
+        except ElementTree.ParseError:
+            log.warning("Malformed Sonos event ignored")
+            return True
+        if state:
+            log.debug("Sonos event: %s", state)
+            with self._cond:
+                self.state = state
+                self._cond.notify_all()
+        return True
+
+    def wait_for(self, states: tuple[str, ...], timeout: float) -> str | None:
+        """Block until the pushed state is one of *states*; return it, or None."""
+        with self._cond:
+            if self._cond.wait_for(lambda: self.state in states, timeout):
+                return self.state
+        return None
+
+
+# Set by serve() for the speaker in use
+sonos_events: SonosEvents | None = None
 
 
 # ---------------------------------------------------------------------------
 # TCP: receive audio from ESP32
 # ---------------------------------------------------------------------------
-def receive_audio(conn: socket.socket) -> bytes:
-    """Receive raw PCM audio until the end marker is detected."""
-    buf = bytearray()
-    conn.settimeout(RECV_TIMEOUT)
-    while True:
+def parse_stream_header(buf: bytes) -> tuple[AudioFormat, int]:
+    """Return the stream's audio format and the number of header bytes.
+
+    Streams that don't start with STREAM_MAGIC are headerless legacy streams
+    in DEFAULT_FORMAT.  Raises ValueError for a header we can't honour.
+    """
+    if len(buf) < STREAM_HEADER.size or buf[:4] != STREAM_MAGIC:
+        return DEFAULT_FORMAT, 0
+
+    _, version, codec, bits, channels, rate = STREAM_HEADER.unpack_from(buf)
+    if not 1 <= version <= STREAM_VERSION:
+        raise ValueError(f"unsupported stream version {version}")
+    if codec == CODEC_PCM:
+        width = bits // 8
+    elif codec == CODEC_IMA_ADPCM and bits == 4:
+        width = 2  # decodes to 16-bit
+    else:
+        raise ValueError(f"unsupported codec {codec} at {bits} bits")
+    if rate not in SUPPORTED_SAMPLE_RATES or width not in SUPPORTED_SAMPLE_WIDTHS:
+        raise ValueError(f"unsupported format {rate} Hz / {bits}-bit")
+    if channels != 1:
+        raise ValueError(f"unsupported channel count {channels}")
+    return AudioFormat(rate, width, channels, codec), STREAM_HEADER.size
+
+
+class StreamDecoder:
+    """Incremental decoder for one uplink stream.
+
+    The stream is received straight into a pooled MAX_AUDIO_BUFFER-sized
+    buffer: recv_into buffer(), then call received() with the byte count
+    (feed() copies bytes in for callers that already have them).  Each call
+    returns the PCM that can be decoded so far, for PCM streams as a
+    memoryview of the buffer itself.  The last few bytes are held back since
+    they may be the start of END_MARKER; the stream has ended once
+    everything received so far ends with the marker.  close() hands the
+    buffer back to the pool.
+    """
+
+    def __init__(self, pool: BufferPool | None = None):
+        self.fmt: AudioFormat | None = None  # known once the header is parsed
+        self.version = 0  # stream header version, 0 without a header
+        self.ended = False
+        self._pool = pool or uplink_buffers
+        self._buf = self._pool.acquire()
+        self._view = memoryview(self._buf)
+        self._pcm_start = 0  # where the payload starts, after any header
+        self._head = 0  # start of the bytes not decoded yet
+        self._tail = 0  # end of the bytes received
+
+    def buffer(self) -> memoryview:
+        """Free space to receive into; empty once MAX_AUDIO_BUFFER is reached."""
+        return self._view[self._tail:]
+
+    def _header_ready(self, final: bool) -> bool:
+        if self.fmt is not None:
+            return True
+        pending = self._view[self._head : self._tail]
+        if (not final and len(pending) < STREAM_HEADER.size
+                and STREAM_MAGIC.startswith(bytes(pending[:4]))):
+            return False  # may still turn out to be a header
+        self.fmt, offset = parse_stream_header(pending)
+        if offset:
+            self.version = pending[4]
+        self._head = self._pcm_start = self._head + offset
+        return True
+
+    def _decode(self, available: int) -> memoryview | bytes:
+        unit = ADPCM_BLOCK_BYTES if self.fmt.codec == CODEC_IMA_ADPCM else self.fmt.sample_width
+        usable = max(0, available - available % unit)
+        data = self._view[self._head : self._head + usable]
+        self._head += usable
+        return adpcm_decode(data) if self.fmt.codec == CODEC_IMA_ADPCM else data
+
+    def received(self, nbytes: int) -> memoryview | bytes:
+        """*nbytes* were written to buffer(). Raises ValueError for a header we can't honour."""
+        self._tail += nbytes
+        marker = len(END_MARKER)
+        if (self._tail - self._head >= marker
+                and self._view[self._tail - marker : self._tail] == END_MARKER):
+            self._tail -= marker
+            self.ended = True
+            return self.finish()
+        if not self._header_ready(final=False):
+            return b""
+        return self._decode(self._tail - self._head - (marker - 1))
+
+    def feed(self, chunk: bytes) -> memoryview | bytes:
+        """Add received bytes. Raises ValueError for a header we can't honour."""
+        free = self.buffer()
+        if len(chunk) > len(free):
+            raise ValueError(f"stream exceeds {MAX_AUDIO_BUFFER} bytes")
+        free[: len(chunk)] = chunk
+        return self.received(len(chunk))
+
+    def finish(self) -> memoryview | bytes:
+        """Decode everything left; a trailing partial sample or block is dropped."""
+        self._header_ready(final=True)
+        pcm = self._decode(self._tail - self._head)
+        self._head = self._tail
+        return pcm
+
+    def pcm(self) -> memoryview:
+        """All PCM decoded so far from a PCM stream, in place in the buffer."""
+        return self._view[self._pcm_start : self._head]
+
+    def close(self):
+        """Give the buffer back to the pool."""
+        if self._buf is None:
+            return
+        self._view.release()
+        self._pool.release(self._buf)
+        self._buf = None
+
+
+class EnergyVad:
+    """Speech detector by frame level over a tracked background level."""
+
+    def __init__(self):
+        self.floor_db = ENDPOINT_FLOOR_DB
+
+    def __call__(self, frame: bytes, sample_rate: int) -> bool:
+        if kenta_dsp is not None:
+            rms = kenta_dsp.rms16(frame)
+        else:
+            samples = memoryview(frame).cast("h")
+            rms = math.sqrt(sum(x * x for x in samples) / len(samples)) if samples else 0.0
+        level = 20 * math.log10(rms + 1)
+        speech = level > self.floor_db + ENDPOINT_MARGIN_DB
+        if level < self.floor_db:
+            self.floor_db += 0.2 * (level - self.floor_db)  # quiet: follow quickly
+        elif not speech:
+            self.floor_db += 0.01 * (level - self.floor_db)  # louder background: slowly
+        return speech
+
+
+def make_vad(sample_rate: int):
+    """Return is_speech(frame, sample_rate) for ENDPOINT_FRAME_MS frames of 16-bit PCM."""
+    try:
+        import webrtcvad  # optional, more robust against noise
+    except ImportError:
+        return EnergyVad()
+    if sample_rate not in (8000, 16000, 32000, 48000):
+        return EnergyVad()
+    return webrtcvad.Vad(ENDPOINT_WEBRTC_MODE).is_speech
+
+
+class Endpointer:
+    """Decides from the live uplink when the utterance is over.
+
+    feed() takes decoded audio as it arrives and returns True once, when
+    ENDPOINT_MIN_SPEECH_MS of speech has been followed by *silence_ms* of
+    silence.  Streams that never contain speech never end here.
+    """
+
+    def __init__(self, silence_ms: int = ENDPOINT_SILENCE_MS,
+                 min_speech_ms: int = ENDPOINT_MIN_SPEECH_MS):
+        self.silence_ms = silence_ms
+        self.min_speech_ms = min_speech_ms
+        self.position_ms = 0  # audio analysed so far
+        self.fired = False
+        self._vad = None
+        self._pending = bytearray()
+        self._speech = 0
+        self._silence = 0
+
+    def feed(self, pcm: bytes, fmt: AudioFormat) -> bool:
+        if self.fired:
+            return False
+        if self._vad is None:
+            self._vad = make_vad(fmt.sample_rate)
+        self._pending.extend(pcm_to_16bit(pcm, fmt.sample_width))
+        frame_bytes = fmt.sample_rate * ENDPOINT_FRAME_MS // 1000 * 2
+        while len(self._pending) >= frame_bytes:
+            frame = bytes(self._pending[:frame_bytes])
+            del self._pending[:frame_bytes]
+            self.position_ms += ENDPOINT_FRAME_MS
+            if self._vad(frame, fmt.sample_rate):
+                self._speech += ENDPOINT_FRAME_MS
+                self._silence = 0
+            else:
+                self._silence += ENDPOINT_FRAME_MS
+            if self._speech >= self.min_speech_ms and self._silence >= self.silence_ms:
+                self.fired = True
+                self._pending.clear()
+                return True
+        return False
+
+
+def make_endpointer() -> Endpointer | None:
+    # Read here rather than bound as a default, so --endpoint-silence applies
+    return Endpointer(ENDPOINT_SILENCE_MS) if ENDPOINT_SILENCE_MS else None
+
+
+def _endpoint(endpointer: Endpointer, pcm: bytes, decoder: "StreamDecoder",
+              conn: "socket.socket | DeviceLink"):
+    """Feed *endpointer*; at the end of speech tell the device to stop."""
+    if decoder.version < STREAM_VERSION_STOP:
+        return  # the device wouldn't understand MSG_STOP
+    if endpointer.feed(pcm, decoder.fmt):
+        log.info("End of speech at %.1fs, telling the device to stop",
+                 endpointer.position_ms / 1000)
         try:
-            chunk = conn.recv(4096)
-        except socket.timeout:
-            log.warning("Client recv timeout after %ds", RECV_TIMEOUT)
-            return bytes(buf) if buf else bytes()
-        except ConnectionResetError:
-            log.warning("Client connection reset")
-            return bytes()
-        if not chunk:
-            log.warning("Client disconnected before sending end marker")
-            return bytes(buf)
-        if len(buf) + len(chunk) > MAX_AUDIO_BUFFER:
+            conn.sendall(bytes([MSG_STOP]))
+        except OSError:
+            log.warning("Could not send stop to the device")
+
+
+class DeviceLink:
+    """Downlink to one device, writable from any thread.
+
+    Offers the part of the socket API the pipeline uses (sendall, close) on
+    top of the connection's asyncio transport, so stages running in
+    executor threads can send DONE and echo reference frames.
+    """
+
+    def __init__(self, loop: asyncio.AbstractEventLoop, transport: asyncio.Transport):
+        self._loop = loop
+        self._transport = transport
+        peer = transport.get_extra_info("peername")
+        self.device = peer[0] if peer else "?"  # replies are ordered per device
+
+    def sendall(self, data: bytes):
+        if self._transport.is_closing():
+            raise ConnectionResetError("device connection closed")
+        self._call(self._transport.write, bytes(data))
+
+    def close(self):
+        self._call(self._transport.close)
+
+    def _call(self, fn, *args):
+        try:
+            on_loop = asyncio.get_running_loop() is self._loop
+        except RuntimeError:
+            on_loop = False
+        if on_loop:
+            fn(*args)
+        else:
+            self._loop.call_soon_threadsafe(fn, *args)
+
+
+class DeviceProtocol(asyncio.BufferedProtocol):
+    """One device connection on the event loop.
+
+    The event loop reads the uplink straight into the decoder's pooled
+    buffer (get_buffer), and it is decoded as it arrives and fed, in order,
+    as views of that buffer to a transcriber running in the *stt* stage.
+    The buffer is held until the transcriber has finished, so finish() gets
+    the whole utterance as one view of it, without a copy (ADPCM streams,
+    decoded into new memory anyway, are collected as they arrive).  When
+    the stream ends (end marker, EOF, or RECV_TIMEOUT without data) the
+    final transcript is handed to the coroutine
+    *on_utterance(transcription, fmt, link)*.  *on_connect(device)*,
+    if given, is called as soon as a device connects.
+    """
+
+    def __init__(self, on_utterance, stt: "Stage", on_connect=None):
+        self._on_utterance = on_utterance
+        self._on_connect = on_connect
+        self._stt = stt
+        self._decoder = StreamDecoder()
+        self._endpointer = make_endpointer()
+        self._audio: asyncio.Queue[tuple[bytes, AudioFormat] | None] = asyncio.Queue()
+        self._adpcm = bytearray()  # decoded audio of an ADPCM stream
+        self._received = 0
+        self._pcm_bytes = 0
+        self._ended = False
+        self._dropped = False
+        self._discard = memoryview(bytearray(4096))  # reads after the stream is over
+
+    def connection_made(self, transport: asyncio.Transport):
+        loop = asyncio.get_running_loop()
+        self._transport = transport
+        self._peer = transport.get_extra_info("peername")
+        self._link = DeviceLink(loop, transport)
+        self._start = time.monotonic()
+        self._timer = loop.call_later(RECV_TIMEOUT, self._timed_out)
+        self._task = loop.create_task(self._run())
+        log.info("Connection from %s", self._peer)
+        if self._on_connect:
+            self._on_connect(self._link.device)
+
+    def get_buffer(self, sizehint: int) -> memoryview:
+        if self._ended:
+            return self._discard
+        return self._decoder.buffer()
+
+    def buffer_updated(self, nbytes: int):
+        if self._ended:
+            return
+        self._timer.cancel()
+        self._timer = asyncio.get_running_loop().call_later(RECV_TIMEOUT, self._timed_out)
+        self._received += nbytes
+        try:
+            self._push(self._decoder.received(nbytes))
+        except ValueError as e:
+            log.warning("Rejecting stream: %s", e)
+            self._drop()
+            return
+        if self._decoder.ended:
+            fmt = self._decoder.fmt
+            elapsed = time.monotonic() - self._start
+            log.info(
+                "End marker received. PCM: %d bytes (%.1fs, %d Hz %d-bit), "
+                "uplink %s %.0f kbit/s",
+                self._pcm_bytes, self._pcm_bytes / fmt.bytes_per_second, fmt.sample_rate,
+                fmt.sample_width * 8, CODEC_NAMES.get(fmt.codec, "?"),
+                self._received * 8 / 1000 / elapsed if elapsed > 0 else 0.0,
+            )
+            self._end(flush=False)
+        elif self._received >= MAX_AUDIO_BUFFER:
             log.warning("Audio buffer exceeded %d bytes, truncating", MAX_AUDIO_BUFFER)
-            return bytes(buf)
-        buf.extend(chunk)
-        if len(buf) >= 4 and buf[-4:] == END_MARKER:
-            pcm = bytes(buf[:-4])
-            duration = len(pcm) / (SAMPLE_RATE * SAMPLE_WIDTH)
-            log.info("End marker received. PCM: %d bytes (%.1fs)", len(pcm), duration)
-            return pcm
+            self._end()
+
+    def eof_received(self) -> bool:
+        if not self._ended:
+            log.warning("Client disconnected before sending end marker")
+            self._end()
+        return True  # keep the transport open for the done byte
+
+    def connection_lost(self, exc: Exception | None):
+        self._timer.cancel()
+        if not self._ended:
+            log.warning("Client connection reset")
+            self._drop()
+
+    def _timed_out(self):
+        log.warning("Client recv timeout after %ds", RECV_TIMEOUT)
+        self._end()
+
+    def _push(self, pcm: memoryview | bytes):
+        if pcm:
+            self._pcm_bytes += len(pcm)
+            if self._decoder.fmt.codec == CODEC_IMA_ADPCM:
+                self._adpcm.extend(pcm)
+            self._audio.put_nowait((pcm, self._decoder.fmt))
+
+    def _utterance(self) -> memoryview:
+        """All audio of the stream, in place in the receive buffer for PCM."""
+        if self._decoder.fmt and self._decoder.fmt.codec == CODEC_IMA_ADPCM:
+            return memoryview(self._adpcm)
+        return self._decoder.pcm()
+
+    def _end(self, flush: bool = True):
+        """The uplink is over: stop reading and let the transcriber finish."""
+        if flush:
+            try:
+                self._push(self._decoder.finish())
+            except ValueError as e:
+                log.warning("Rejecting stream: %s", e)
+                self._drop()
+                return
+        self._ended = True
+        self._timer.cancel()
+        self._transport.pause_reading()
+        self._audio.put_nowait(None)
+
+    def _drop(self):
+        """Abandon the stream without an utterance and close the connection."""
+        self._ended = self._dropped = True
+        self._timer.cancel()
+        self._audio.put_nowait(None)
+        self._transport.close()
+
+    def _feed(self, transcriber: Transcriber, pcm: memoryview | bytes, fmt: AudioFormat):
+        # Runs in the STT stage, so the VAD can be as heavy as a transcriber
+        transcriber.feed(pcm, fmt)
+        if self._endpointer and not self._ended:
+            _endpoint(self._endpointer, pcm, self._decoder, self._link)
+
+    async def _run(self):
+        try:
+            await self._transcribe()
+        finally:
+            # Every queued view of the buffer has been consumed by now
+            self._decoder.close()
+
+    async def _transcribe(self):
+        transcriber = await self._stt.run(make_transcriber)
+        try:
+            while (item := await self._audio.get()) is not None:
+                await self._stt.run(self._feed, transcriber, *item)
+        except Exception:
+            log.error("Error transcribing audio from %s", self._peer, exc_info=True)
+            self._dropped = True
+
+        if self._dropped or not self._pcm_bytes:
+            if not self._dropped:
+                log.warning("No audio data received from %s", self._peer)
+            await self._stt.run(transcriber.close)
+            self._link.close()
+            return
+
+        end = time.monotonic()
+        try:
+            transcription = await self._stt.run(transcriber.finish, self._utterance())
+        except Exception:
+            log.error("Transcription failed", exc_info=True)
+            transcription = ""
+        log.info("Transcript final %.0f ms after end of stream", (time.monotonic() - end) * 1000)
+        try:
+            await self._on_utterance(transcription, self._decoder.fmt or DEFAULT_FORMAT,
+                                     self._link)
+        except Exception:
+            log.error("Error queueing utterance from %s", self._peer, exc_info=True)
+            self._link.close()
+
+
+async def start_device_server(host: str, port: int, on_utterance,
+                              on_connect=None) -> asyncio.Server:
+    """Accept device connections on the running event loop."""
+    loop = asyncio.get_running_loop()
+    server = await loop.create_server(
+        lambda: DeviceProtocol(on_utterance, stt_stage, on_connect), host, port)
+    log.info("TCP server listening on %s:%d", host, server.sockets[0].getsockname()[1])
+    return server
 
 
 # ---------------------------------------------------------------------------
 # Audio queue and processing pipeline
 # ---------------------------------------------------------------------------
-audio_queue: queue.Queue[tuple[bytes, socket.socket]] = queue.Queue()
-
-
-def _send_done_and_close(conn: socket.socket):
+def _send_done_and_close(conn: socket.socket | DeviceLink):
     """Send the done byte and close the connection."""
     try:
         conn.sendall(DONE_BYTE)
@@ -368,60 +2641,254 @@ def _send_done_and_close(conn: socket.socket):
         conn.close()
 
 
-def receiver_thread(conn: socket.socket, addr: tuple):
-    """Receive audio from ESP32 and put it on the queue."""
-    log.info("Connection from %s", addr)
+class Stage:
+    """One pipeline stage: a bounded pool of threads for its blocking calls."""
+
+    def __init__(self, name: str, workers: int):
+        self.name = name
+        self.executor = ThreadPoolExecutor(max_workers=workers, thread_name_prefix=name)
+
+    async def run(self, fn, *args):
+        return await asyncio.get_running_loop().run_in_executor(self.executor, fn, *args)
+
+
+# Transcriber calls for all devices share this stage
+stt_stage = Stage("stt", STT_WORKERS)
+
+
+def _release_tts_result(future: asyncio.Future):
+    """Release the artifact of a TTS task whose segment won't be played."""
+    if future.exception() is None:
+        tts_store.release(future.result())
+
+
+def _send_playing_and_close(link: socket.socket | DeviceLink):
+    """Tell the device its reply is playing and release it."""
     try:
-        pcm_data = receive_audio(conn)
-        if pcm_data:
-            audio_queue.put((pcm_data, conn))
-        else:
-            log.warning("No audio data received from %s", addr)
-            conn.close()
+        link.sendall(bytes([MSG_PLAYING]))
     except Exception:
-        log.error("Error receiving audio from %s", addr, exc_info=True)
-        conn.close()
-
+        log.warning("Failed to send playing byte", exc_info=True)
+    finally:
+        link.close()
 
-def processor_loop(speaker: soco.SoCo, local_ip: str):
-    """Single-threaded loop that processes audio from the queue one at a time."""
-    while True:
-        pcm_data, conn = audio_queue.get()
 
-        try:
-            # 1. Transcribe
-            wav_file = pcm_to_wav(pcm_data)
-            transcription = transcribe_audio(wav_file)
-            if not transcription:
-                log.warning("Empty transcription, playing error message")
-                reply = "Sorry, I didn't catch that. Could you try again?"
-            else:
-                # 2. Chat completion
-                reply = chat_completion(transcription)
+def play_reply(artifact: TtsArtifact, speaker: soco.SoCo, local_ip: str,
+               link: DeviceLink | None, fmt: AudioFormat, on_playing=None):
+    """Play a reply on the Sonos. Blocks until it has played.
 
-            # 3. Text-to-speech
-            tts_path = text_to_speech(reply)
+    The artifact may still be growing: the Sonos plays it as one stream
+    until it is finished.  *on_playing* is called once the Sonos has been
+    told to play.  Without a *link* (the device was released) no echo
+    reference is streamed.
+    """
+    audio_url = f"http://{local_ip}:{HTTP_PORT}/{artifact.name}"
+    play_on_sonos(speaker, audio_url)
+    if on_playing:
+        on_playing()
+
+    # Wait for Sonos to finish playing, streaming the echo reference to the
+    # device meanwhile
+    streamer = None
+    if AEC_REFERENCE and link is not None:
+        streamer = ReferenceStreamer(link, artifact, fmt, speaker)
+        streamer.start()
+    try:
+        wait_for_sonos_done(speaker)
+    finally:
+        if streamer:
+            streamer.stop()
 
-            # 4. Play on Sonos
-            tts_filename = os.path.basename(tts_path)
-            audio_url = f"http://{local_ip}:{HTTP_PORT}/{tts_filename}"
-            play_on_sonos(speaker, audio_url)
 
-            # 5. Wait for Sonos to finish playing
-            wait_for_sonos_done(speaker)
+class Pipeline:
+    """Answers utterances through LLM, TTS and playback stages.
 
-            # 6. Signal ESP32 that we're done
-            _send_done_and_close(conn)
+    Each stage has its own bounded worker pool, so one device's reply can
+    be generated and synthesized while another's is still playing.
+    Utterances from the same device are answered strictly in order, in that
+    device's own conversation, and a reply holds the speaker from its first
+    sentence to its last, playing as one stream.  With EARLY_DONE the device is released when its
+    reply starts playing; in "interrupt" mode its next connection stops
+    that reply (see interrupt()).
+    """
 
-            # 7. Clean up temp file
+    def __init__(self, speaker: soco.SoCo, local_ip: str,
+                 llm_workers: int = LLM_WORKERS, tts_workers: int = TTS_WORKERS):
+        self.speaker = speaker
+        self.local_ip = local_ip
+        self.llm = Stage("llm", llm_workers)
+        self.tts = Stage("tts", tts_workers)
+        self.playback = Stage("playback", 1)  # one Sonos
+        self._speaker_lock = asyncio.Lock()
+        # Held by the device's queued _run tasks, so it goes away with the last one
+        self._lanes: weakref.WeakValueDictionary[str, asyncio.Lock] = weakref.WeakValueDictionary()
+        self._tasks: set[asyncio.Task] = set()
+        self._replies: dict[str, asyncio.Event] = {}  # set to cut a reply short
+
+    def submit(self, transcription: str, fmt: AudioFormat, link: DeviceLink) -> asyncio.Task:
+        """Start answering an utterance; must be called on the event loop."""
+        lane = self._lanes.get(link.device)
+        if lane is None:
+            lane = self._lanes[link.device] = asyncio.Lock()
+        task = asyncio.get_running_loop().create_task(self._run(lane, transcription, fmt, link))
+        self._tasks.add(task)
+        task.add_done_callback(self._tasks.discard)
+        return task
+
+    def interrupt(self, device: str):
+        """Stop the reply *device* is waiting for or hearing ("interrupt" mode).
+
+        Called when the device opens a new connection, so the speaker goes
+        quiet while the user asks the next question.
+        """
+        if EARLY_DONE == "interrupt" and (stop := self._replies.get(device)):
+            stop.set()
+
+    async def _run(self, lane: asyncio.Lock, transcription: str, fmt: AudioFormat,
+                   link: DeviceLink):
+        # Locks are FIFO, so the device's utterances run in submission order
+        async with lane:
+            stop = self._replies[link.device] = asyncio.Event()
+            released = False
             try:
-                os.unlink(tts_path)
-            except OSError:
-                pass
+                released = await self._answer(transcription, fmt, link, stop)
+            except Exception:
+                log.error("Error processing audio", exc_info=True)
+            finally:
+                del self._replies[link.device]
+            # Signal ESP32 that we're done
+            if not released:
+                _send_done_and_close(link)
+
+    async def _answer(self, transcription: str, fmt: AudioFormat, link: DeviceLink,
+                      stop: asyncio.Event) -> bool:
+        """Answer one utterance; True if the device was released early."""
+        start = time.monotonic()
+        loop = asyncio.get_running_loop()
+        # TTS tasks in sentence order, ended by None
+        pending: asyncio.Queue[asyncio.Future | None] = asyncio.Queue()
+
+        # 1. Transcription was streamed while the audio arrived
+        if not transcription:
+            log.warning("Empty transcription, playing error message")
+            self._start_tts(MSG_DIDNT_CATCH, pending)
+            pending.put_nowait(None)
+            producer = None
+        else:
+            # 2. Chat completion, split into sentences as it streams; each
+            #    sentence goes to TTS as soon as it is complete
+            producer = loop.create_task(
+                self.llm.run(self._generate, transcription, link.device, loop, pending))
+
+        # 3. Playback. Segments are appended in order to one reply artifact,
+        #    which the Sonos starts playing as soon as the first has audio and
+        #    follows as a single stream, so there are no gaps between them
+        reply = tts_store.create(".wav" if AEC_REFERENCE else ".mp3")
+        started = asyncio.Event()
+        feeder = loop.create_task(self._feed(reply, pending, stop, started))
+        holding_speaker = False
+        released = threading.Event()
+
+        def playing():
+            _send_playing_and_close(link)
+            released.set()
+        try:
+            await started.wait()
+            if reply.data and not stop.is_set():
+                await self._speaker_lock.acquire()
+                holding_speaker = True
+                log.info("First audio %.0f ms after transcript",
+                         (time.monotonic() - start) * 1000)
+                try:
+                    await self._play(reply, None if EARLY_DONE else link, fmt,
+                                     playing if EARLY_DONE else None, stop)
+                except Exception:
+                    log.error("Error playing reply", exc_info=True)
+        finally:
+            await feeder  # let the reply finish so the conversation stays in order
+            tts_store.release(reply)
+            if holding_speaker:
+                self._speaker_lock.release()
+            if producer:
+                await producer  # re-raises chat errors
+        return released.is_set()
+
+    async def _feed(self, reply: TtsArtifact, pending: asyncio.Queue, stop: asyncio.Event,
+                    started: asyncio.Event):
+        """Append each segment's audio to *reply* in order, then finish it.
+
+        *started* is set once the reply has audio, or when it is finished
+        without any.  Once *stop* is set the remaining segments are skipped.
+        """
+        wav = reply.ext == ".wav"
+        tts_fmt = AudioFormat(sample_rate=OPENAI_TTS_PCM_RATE)
+        try:
+            while (future := await pending.get()) is not None:
+                if stop.is_set():
+                    future.add_done_callback(_release_tts_result)
+                    continue
+                try:
+                    artifact = await future
+                except Exception:
+                    log.error("TTS failed for a segment, skipping it", exc_info=True)
+                    continue
+                try:
+                    # Each WAV segment has its own header; the reply keeps one
+                    # and whole samples only, so the PCM stays aligned
+                    skip, carry = (44 if wav else 0), b""
+                    async for data in artifact.follow(TTS_STREAM_TIMEOUT):
+                        if stop.is_set():
+                            break
+                        data, skip = carry + data[skip:], max(0, skip - len(data))
+                        if wav:
+                            data, carry = data[: len(data) & ~1], data[len(data) & ~1 :]
+                        if not data:
+                            continue
+                        if wav and not reply.data:
+                            # Length unknown while streaming; patched once finished
+                            reply.append(wav_header(tts_fmt, 0xFFFFFFFF - 36))
+                        reply.append(data)
+                        started.set()
+                    if artifact.error:
+                        log.error("TTS failed partway through a segment: %s", artifact.error)
+                except Exception:
+                    log.error("Error streaming a segment", exc_info=True)
+                finally:
+                    tts_store.release(artifact)
+        finally:
+            if wav and reply.data:
+                reply.data[:44] = wav_header(tts_fmt, len(reply.data) - 44)
+            reply.finish()
+            started.set()
+
+    async def _play(self, artifact: TtsArtifact, link: DeviceLink | None, fmt: AudioFormat,
+                    on_playing, stop: asyncio.Event):
+        """Play a reply, stopping the Sonos early if *stop* is set."""
+        play = asyncio.ensure_future(self.playback.run(
+            play_reply, artifact, self.speaker, self.local_ip, link, fmt, on_playing))
+        interrupted = asyncio.ensure_future(stop.wait())
+        try:
+            await asyncio.wait((play, interrupted), return_when=asyncio.FIRST_COMPLETED)
+            if interrupted.done() and not play.done():
+                log.info("Reply interrupted by a new question")
+                # The playback worker is blocked waiting for the Sonos
+                await asyncio.get_running_loop().run_in_executor(
+                    None, stop_sonos, self.speaker)
+            await play
+        finally:
+            interrupted.cancel()
+
+    def _generate(self, transcription: str, session: str, loop: asyncio.AbstractEventLoop,
+                  pending: asyncio.Queue):
+        # Runs in the LLM stage
+        try:
+            for text in split_sentences(chat_completion_stream(transcription, session)):
+                loop.call_soon_threadsafe(self._start_tts, text, pending)
+        finally:
+            loop.call_soon_threadsafe(pending.put_nowait, None)
 
-        except Exception:
-            log.error("Error processing audio", exc_info=True)
-            _send_done_and_close(conn)
+    def _start_tts(self, text: str, pending: asyncio.Queue):
+        pending.put_nowait(asyncio.ensure_future(
+            self.tts.run(text_to_speech, text, AEC_REFERENCE)))
 
 
 # ---------------------------------------------------------------------------
@@ -446,21 +2913,76 @@ def start_mdns(local_ip: str) -> tuple[Zeroconf, ServiceInfo]:
 # Main
 # ---------------------------------------------------------------------------
 def main():
-    global TTS_DIR
+    global AEC_REFERENCE, EARLY_DONE, ENDPOINT_SILENCE_MS, STT_BACKEND, TRIM_PAD_MS, \
+        TRIM_THRESHOLD_DB, UPLOAD_CODEC, tts_cache, history_store
 
     parser = argparse.ArgumentParser(description="ESP32 voice assistant server")
     parser.add_argument("--ip", help="Sonos speaker IP (skip discovery)")
+    parser.add_argument("--aec-reference", action="store_true",
+                        help="stream TTS audio to the device for echo cancellation")
+    parser.add_argument("--early-done", choices=("queue", "interrupt"), default=EARLY_DONE or None,
+                        help="release the device as soon as its reply starts playing; a new "
+                             "question then waits for the reply or interrupts it")
+    parser.add_argument("--endpoint-silence", metavar="MS", type=int, default=ENDPOINT_SILENCE_MS,
+                        help="silence after speech before the device is told to stop "
+                             "recording, 0 to leave it to the device (default: %(default)s)")
+    parser.add_argument("--stt", choices=STT_BACKENDS, default=STT_BACKEND,
+                        help="speech-to-text backend (default: %(default)s)")
+    parser.add_argument("--whisper-model", metavar="NAME", default=WHISPER_MODEL,
+                        help="model name or path for --stt faster-whisper / whisper.cpp "
+                             "(default: %(default)s)")
+    parser.add_argument("--trim-threshold", metavar="DB", type=float, default=TRIM_THRESHOLD_DB,
+                        help="level below which leading/trailing audio is cut before batch "
+                             "transcription, 0 to upload everything (default: %(default)s)")
+    parser.add_argument("--trim-pad", metavar="MS", type=int, default=TRIM_PAD_MS,
+                        help="audio kept around the speech when trimming (default: %(default)s)")
+    parser.add_argument("--upload-codec", choices=UPLOAD_CODECS, default=UPLOAD_CODEC,
+                        help="compression for batch uploads; opus needs ffmpeg "
+                             "(default: %(default)s)")
+    parser.add_argument("--tts-cache", metavar="DIR", default=TTS_CACHE_DIR,
+                        help='directory for cached TTS audio, "" to keep it in memory only '
+                             "(default: %(default)s)")
+    parser.add_argument("--history-db", metavar="PATH", default=HISTORY_DB,
+                        help='conversation log, "" to forget conversations on restart '
+                             "(default: %(default)s)")
     args = parser.parse_args()
+    AEC_REFERENCE = args.aec_reference
+    EARLY_DONE = args.early_done or ""
+    ENDPOINT_SILENCE_MS = args.endpoint_silence
+    TRIM_THRESHOLD_DB = args.trim_threshold
+    TRIM_PAD_MS = args.trim_pad
+    UPLOAD_CODEC = args.upload_codec
+    if AEC_REFERENCE and EARLY_DONE:
+        log.warning("--early-done: the echo reference needs the device connection, "
+                    "so it is not streamed")
+    STT_BACKEND = args.stt
+    if STT_BACKEND in LOCAL_STT_ENGINES:
+        try:
+            load_stt_engine(STT_BACKEND, args.whisper_model)
+        except ImportError as e:
+            parser.error(f"--stt {STT_BACKEND} needs the {e.name} package")
+    tts_cache = TtsCache(args.tts_cache or None)
+    if args.history_db:
+        history_store = ConversationStore(args.history_db)
+        threading.Thread(
+            target=compact_history_forever,
+            args=(history_store,),
+            daemon=True,
+        ).start()
 
     local_ip = get_local_ip()
     log.info("Server LAN IP: %s", local_ip)
+    log.info("Audio DSP: %s", "native (kenta_dsp)" if kenta_dsp else "Python")
 
-    # Create dedicated TTS directory
-    TTS_DIR = tempfile.mkdtemp(prefix="kenta_tts_")
-    log.info("TTS directory: %s", TTS_DIR)
+    # Keep OpenAI connections open for the first question of the night
+    threading.Thread(target=keep_openai_warm_forever, daemon=True).start()
 
-    # Start HTTP server for Sonos (serves only from TTS_DIR)
-    httpd = start_http_server(HTTP_PORT, TTS_DIR)
+    # Canned replies are synthesized ahead of time
+    threading.Thread(
+        target=prewarm_tts_cache,
+        args=(CANNED_PHRASES, AEC_REFERENCE),
+        daemon=True,
+    ).start()
 
     # mDNS advertisement
     zc, zc_info = start_mdns(local_ip)
@@ -468,54 +2990,59 @@ def main():
     # Discover Sonos
     speaker = discover_sonos(args.ip)
 
-    # Start the single-threaded processor
-    threading.Thread(
-        target=processor_loop,
-        args=(speaker, local_ip),
-        daemon=True,
-    ).start()
-
-    # TCP server — accepts connections and queues audio
-    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-    srv.bind((TCP_HOST, TCP_PORT))
-    srv.listen(5)
-    log.info("TCP server listening on %s:%d", TCP_HOST, TCP_PORT)
+    try:
+        import uvloop  # optional, faster event loop
+        run = uvloop.run
+    except ImportError:
+        run = asyncio.run
 
-    def _shutdown(signum=None, frame=None):
+    try:
+        run(serve(speaker, local_ip))
+    except KeyboardInterrupt:
+        log.info("KeyboardInterrupt received")
+    finally:
         log.info("Shutting down...")
+        log.info("TTS cache: %s", tts_cache.stats())
+        log.info("OpenAI connections: %s", openai_connections.stats())
         try:
             zc.unregister_service(zc_info)
             zc.close()
         except Exception:
             pass
-        try:
-            httpd.shutdown()
-        except Exception:
-            pass
-        try:
-            srv.close()
-        except Exception:
-            pass
-        try:
-            shutil.rmtree(TTS_DIR, ignore_errors=True)
-        except Exception:
-            pass
 
-    signal.signal(signal.SIGTERM, _shutdown)
+
+async def serve(speaker: soco.SoCo, local_ip: str):
+    """Run the device and HTTP servers and the pipeline until SIGTERM."""
+    global sonos_events
+    loop = asyncio.get_running_loop()
+    stop = asyncio.Event()
+    loop.add_signal_handler(signal.SIGTERM, stop.set)
+
+    # HTTP server for Sonos (serves only TTS artifacts from memory, and
+    # receives its transport events)
+    events = SonosEvents(speaker.ip_address,
+                         f"http://{local_ip}:{HTTP_PORT}{SONOS_EVENT_CALLBACK}")
+    httpd = await start_http_server(HTTP_PORT, tts_store, events=events)
+    await events.start()
+    sonos_events = events
+
+    # Device connections are decoded and transcribed as they stream in, then
+    # answered by the staged pipeline
+    pipeline = Pipeline(speaker, local_ip)
+
+    async def on_utterance(transcription: str, fmt: AudioFormat, link: DeviceLink):
+        pipeline.submit(transcription, fmt, link)
+
+    devices = await start_device_server(TCP_HOST, TCP_PORT, on_utterance,
+                                        on_connect=pipeline.interrupt)
 
     try:
-        while True:
-            conn, addr = srv.accept()
-            threading.Thread(
-                target=receiver_thread,
-                args=(conn, addr),
-                daemon=True,
-            ).start()
-    except KeyboardInterrupt:
-        log.info("KeyboardInterrupt received")
+        await stop.wait()
     finally:
-        _shutdown()
+        devices.close()
+        sonos_events = None
+        await events.close()
+        httpd.close()
 
 
 if __name__ == "__main__":
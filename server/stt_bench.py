@@ -0,0 +1,81 @@
+"""
+Compare speech-to-text backends head to head on the same recordings.
+
+    python stt_bench.py question1.wav question2.wav
+    python stt_bench.py *.wav --whisper-model small --backends faster-whisper whisper.cpp
+
+"batch" is the cloud path the server uses with --stt batch (trimmed,
+compressed upload to OpenAI); the local backends run the resident model the
+way --stt faster-whisper / whisper.cpp do. Model loading is timed separately,
+and each recording is transcribed once to warm up before the timed runs.
+"""
+
+import argparse
+import math
+import os
+import sys
+import time
+from pathlib import Path
+
+# Local backends need no key; "batch" without one fails on its first request.
+os.environ.setdefault("OPENAI_API_KEY", "unused")
+
+sys.path.insert(0, str(Path(__file__).resolve().parent))
+import server  # noqa: E402
+import test_client  # noqa: E402
+
+
+def best_of(fn, runs: int) -> tuple[float, str]:
+    best, text = math.inf, ""
+    for _ in range(runs):
+        start = time.perf_counter()
+        text = fn()
+        best = min(best, time.perf_counter() - start)
+    return best, text
+
+
+def cloud(pcm: bytes) -> str:
+    fmt = server.DEFAULT_FORMAT
+    trimmed, _ = server.trim_silence(pcm, fmt, server.TRIM_THRESHOLD_DB, server.TRIM_PAD_MS)
+    return server.transcribe_audio(server.encode_upload(trimmed, fmt, server.UPLOAD_CODEC))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("wavs", nargs="+", metavar="WAV", help="recordings to transcribe")
+    parser.add_argument("--backends", nargs="+", default=["batch", *server.LOCAL_STT_ENGINES],
+                        choices=["batch", *server.LOCAL_STT_ENGINES],
+                        help="backends to compare (default: all)")
+    parser.add_argument("--whisper-model", default=server.WHISPER_MODEL, metavar="NAME",
+                        help="local model name or path (default: %(default)s)")
+    parser.add_argument("--runs", type=int, default=3, help="timed runs per recording (default: 3)")
+    args = parser.parse_args()
+
+    recordings = [(path, test_client.load_wav_pcm(path, server.WHISPER_RATE)) for path in args.wavs]
+
+    backends = []
+    for name in args.backends:
+        if name == "batch":
+            backends.append((name, cloud))
+            continue
+        start = time.perf_counter()
+        try:
+            engine = server.load_stt_engine(name, args.whisper_model)
+        except ImportError as e:
+            print(f"{name}: skipped, needs the {e.name} package", file=sys.stderr)
+            continue
+        print(f"{name}: loaded {args.whisper_model} in {time.perf_counter() - start:.1f} s")
+        backends.append((name, engine.transcribe))
+
+    print(f"\n{'backend':<16}{'recording':<24}{'audio s':>9}{'best ms':>10}{'RTF':>7}  text")
+    for path, pcm in recordings:
+        seconds = len(pcm) / server.DEFAULT_FORMAT.bytes_per_second
+        for name, transcribe in backends:
+            transcribe(pcm)
+            elapsed, text = best_of(lambda: transcribe(pcm), args.runs)
+            print(f"{name:<16}{path[-23:]:<24}{seconds:>9.1f}{elapsed * 1000:>10.0f}"
+                  f"{elapsed / seconds:>7.2f}  {text}")
+
+
+if __name__ == "__main__":
+    main()
@@ -7,31 +7,51 @@ Usage:
 
     # Send a real WAV file (tests with actual speech)
     python test_client.py path/to/speech.wav
+
+    # Negotiate a different sample rate / bit depth
+    python test_client.py path/to/speech.wav --rate 24000 --bits 24
 """
 
+import argparse
 import socket
 import struct
 import math
-import sys
 import wave
 
+try:
+    import kenta_dsp  # optional native audio loops, built from server/native
+except ImportError:
+    kenta_dsp = None
+
 SERVER_IP = "127.0.0.1"
 SERVER_PORT = 12345
 SAMPLE_RATE = 16000
+SAMPLE_BITS = 16
 END_MARKER = b"\xDE\xAD\xBE\xEF"
 
+# Stream header: magic, version, codec (0 = PCM), bits, channels, sample rate
+STREAM_HEADER = struct.Struct("<4sBBBBI")
+
 
-def generate_sine_wave(freq: float = 440, duration: float = 3.0) -> bytes:
+def build_stream_header(sample_rate: int, bits: int) -> bytes:
+    """Announce the audio format the way the firmware does."""
+    return STREAM_HEADER.pack(b"KNTA", 1, 0, bits, 1, sample_rate)
+
+
+def generate_sine_wave(freq: float = 440, duration: float = 3.0,
+                       sample_rate: int = SAMPLE_RATE) -> bytes:
     """Generate a sine wave as 16-bit little-endian PCM."""
     samples = []
-    for i in range(int(SAMPLE_RATE * duration)):
-        val = int(32767 * 0.5 * math.sin(2 * math.pi * freq * i / SAMPLE_RATE))
+    for i in range(int(sample_rate * duration)):
+        val = int(32767 * 0.5 * math.sin(2 * math.pi * freq * i / sample_rate))
         samples.append(struct.pack("<h", val))
     return b"".join(samples)
 
 
 def _stereo_to_mono(pcm: bytes, sample_width: int) -> bytes:
     """Convert stereo PCM to mono by averaging left and right channels."""
+    if kenta_dsp is not None:
+        return kenta_dsp.to_mono(pcm, sample_width)
     if sample_width == 1:
         fmt = "B"  # unsigned 8-bit
         offset = 128
@@ -57,9 +77,11 @@ def _stereo_to_mono(pcm: bytes, sample_width: int) -> bytes:
 
 
 def _convert_sample_width(pcm: bytes, from_width: int, to_width: int) -> bytes:
-    """Convert PCM between sample widths (1/2/4 bytes)."""
+    """Convert PCM between sample widths (1/2/3/4 bytes)."""
     if from_width == to_width:
         return pcm
+    if kenta_dsp is not None:
+        return kenta_dsp.convert_width(pcm, from_width, to_width)
 
     # Read samples
     if from_width == 1:
@@ -67,6 +89,11 @@ def _convert_sample_width(pcm: bytes, from_width: int, to_width: int) -> bytes:
     elif from_width == 2:
         num = len(pcm) // 2
         samples = [s << 16 for s in struct.unpack(f"<{num}h", pcm)]
+    elif from_width == 3:
+        samples = [
+            int.from_bytes(pcm[i : i + 3], "little", signed=True) << 8
+            for i in range(0, len(pcm) - 2, 3)
+        ]
     elif from_width == 4:
         num = len(pcm) // 4
         samples = list(struct.unpack(f"<{num}i", pcm))
@@ -78,6 +105,8 @@ def _convert_sample_width(pcm: bytes, from_width: int, to_width: int) -> bytes:
         return bytes((s >> 24) + 128 for s in samples)
     elif to_width == 2:
         return struct.pack(f"<{len(samples)}h", *[s >> 16 for s in samples])
+    elif to_width == 3:
+        return b"".join((s >> 8).to_bytes(3, "little", signed=True) for s in samples)
     elif to_width == 4:
         return struct.pack(f"<{len(samples)}i", *samples)
     else:
@@ -89,6 +118,8 @@ def _resample(pcm: bytes, from_rate: int, to_rate: int) -> bytes:
     num_samples = len(pcm) // 2
     if num_samples == 0:
         return pcm
+    if kenta_dsp is not None:
+        return kenta_dsp.resample16(pcm, from_rate, to_rate)
     samples = struct.unpack(f"<{num_samples}h", pcm)
 
     ratio = from_rate / to_rate
@@ -106,8 +137,8 @@ def _resample(pcm: bytes, from_rate: int, to_rate: int) -> bytes:
     return struct.pack(f"<{len(out)}h", *out)
 
 
-def load_wav_pcm(path: str) -> bytes:
-    """Read a WAV file and return raw PCM converted to 16kHz, 16-bit, mono."""
+def load_wav_pcm(path: str, sample_rate: int = SAMPLE_RATE) -> bytes:
+    """Read a WAV file and return raw PCM converted to *sample_rate*, 16-bit, mono."""
     with wave.open(path, "rb") as wf:
         channels = wf.getnchannels()
         sample_width = wf.getsampwidth()
@@ -124,27 +155,38 @@ def load_wav_pcm(path: str) -> bytes:
     if sample_width != 2:
         pcm = _convert_sample_width(pcm, sample_width, 2)
 
-    if framerate != SAMPLE_RATE:
-        pcm = _resample(pcm, framerate, SAMPLE_RATE)
+    if framerate != sample_rate:
+        pcm = _resample(pcm, framerate, sample_rate)
 
-    print(f"Converted to: 1ch, {SAMPLE_RATE}Hz, 16-bit")
+    print(f"Converted to: 1ch, {sample_rate}Hz, 16-bit")
     return pcm
 
 
 def main():
-    if len(sys.argv) > 1:
-        wav_path = sys.argv[1]
-        print(f"Loading PCM from {wav_path}")
-        pcm = load_wav_pcm(wav_path)
+    parser = argparse.ArgumentParser(description="Simulate an ESP32 sending audio")
+    parser.add_argument("wav", nargs="?", help="WAV file to send (default: sine wave)")
+    parser.add_argument("--rate", type=int, default=SAMPLE_RATE,
+                        choices=(8000, 12000, 16000, 24000))
+    parser.add_argument("--bits", type=int, default=SAMPLE_BITS, choices=(16, 24))
+    args = parser.parse_args()
+
+    if args.wav:
+        print(f"Loading PCM from {args.wav}")
+        pcm = load_wav_pcm(args.wav, args.rate)
     else:
         duration = 3.0
         print(f"Generating {duration}s sine wave (440 Hz)")
-        pcm = generate_sine_wave(duration=duration)
+        pcm = generate_sine_wave(duration=duration, sample_rate=args.rate)
+
+    if args.bits != 16:
+        pcm = _convert_sample_width(pcm, 2, args.bits // 8)
 
-    print(f"Sending {len(pcm)} bytes of PCM to {SERVER_IP}:{SERVER_PORT}")
+    print(f"Sending {len(pcm)} bytes of PCM ({args.rate}Hz, {args.bits}-bit) "
+          f"to {SERVER_IP}:{SERVER_PORT}")
 
     sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     sock.connect((SERVER_IP, SERVER_PORT))
+    sock.sendall(build_stream_header(args.rate, args.bits))
     sock.sendall(pcm)
     sock.sendall(END_MARKER)
     print("End marker sent. Done.")
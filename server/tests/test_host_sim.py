@@ -0,0 +1,198 @@
+"""End-to-end tests of the firmware host simulator against server.py.
+
+Build the simulator first and point KENTA_HOST_SIM at it:
+
+    cmake -S firmware/host -B build-host && cmake --build build-host
+    KENTA_HOST_SIM=build-host/kenta_sim pytest server/tests/test_host_sim.py
+"""
+
+import os
+import subprocess
+import threading
+import time
+import wave
+
+import pytest
+
+from .test_server import SAMPLE_RATE, _FakeSpeaker, _Uplink, generate_pcm_sine, srv
+
+SIM = os.environ.get("KENTA_HOST_SIM")
+WAKE_TOOL = os.path.join(os.path.dirname(SIM), "kenta_wake") if SIM else None
+
+pytestmark = pytest.mark.skipif(
+    not SIM or not os.path.exists(SIM), reason="KENTA_HOST_SIM not built"
+)
+
+
+def _write_wav(path, pcm: bytes, rate: int = SAMPLE_RATE):
+    with wave.open(str(path), "wb") as wf:
+        wf.setnchannels(1)
+        wf.setsampwidth(2)
+        wf.setframerate(rate)
+        wf.writeframes(pcm)
+
+
+def _run_sim(tmp_path, monkeypatch, pcm: bytes, script: str, handler, rate=SAMPLE_RATE,
+             extra_args=(), endpoint_silence_ms=0):
+    """Run the simulator against the device server, calling *handler(pcm, fmt, link)*
+    with the first stream it sends."""
+    wav_path = tmp_path / "mic.wav"
+    script_path = tmp_path / "buttons.txt"
+    _write_wav(wav_path, pcm, rate)
+    script_path.write_text(script)
+
+    with _Uplink(monkeypatch, endpoint_silence_ms) as uplink:
+        t = threading.Thread(target=lambda: handler(*uplink.receive(timeout=30)), daemon=True)
+        t.start()
+        proc = subprocess.run(
+            [SIM, "--wav", str(wav_path), "--buttons", str(script_path),
+             "--port", str(uplink.port), "--rate", str(rate), "--timeout", "30", *extra_args],
+            capture_output=True, text=True, timeout=60,
+        )
+        t.join(timeout=5)
+    return proc
+
+
+def test_sim_streams_pcm_to_server(tmp_path, monkeypatch):
+    """Audio captured by the simulated device arrives bit-exact at the transcriber."""
+    pcm = generate_pcm_sine(duration=2.0)
+    received = {}
+
+    def handler(pcm, fmt, link):
+        received["pcm"], received["fmt"] = pcm, fmt
+        srv._send_done_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, pcm, "200 press\n1200 release\n", handler)
+
+    assert proc.returncode == 0, proc.stderr
+    assert received["fmt"] == srv.DEFAULT_FORMAT
+    got = received["pcm"]
+    # Button held ~1 s, plus the 3 s grace period of streamed (silent) audio
+    assert len(got) >= 4 * SAMPLE_RATE * 2 * 0.9
+    # Whatever part of the WAV was live during recording must match exactly
+    speech = got.rstrip(b"\x00")
+    assert speech and speech[:512] in pcm
+    assert "interaction=1" in proc.stdout
+
+
+def test_sim_negotiates_format(tmp_path, monkeypatch):
+    """--rate/--bits are announced in the stream header and honoured by the server."""
+    received = {}
+
+    def handler(pcm, fmt, link):
+        received["pcm"], received["fmt"] = pcm, fmt
+        srv._send_done_and_close(link)
+
+    silence = bytes(2 * 8000)
+    proc = _run_sim(tmp_path, monkeypatch, silence, "100 press\n400 release\n", handler,
+                    rate=8000, extra_args=("--bits", "24"))
+
+    assert proc.returncode == 0, proc.stderr
+    assert received["fmt"] == srv.AudioFormat(sample_rate=8000, sample_width=3)
+    assert len(received["pcm"]) % (3 * 256) == 0
+
+
+def test_sim_weak_link_downshifts_to_adpcm(tmp_path, monkeypatch):
+    """At poor RSSI the device sends half-rate ADPCM, which the server decodes."""
+    pcm = generate_pcm_sine(duration=2.0)
+    received = {}
+
+    def handler(pcm, fmt, link):
+        received["pcm"], received["fmt"] = pcm, fmt
+        srv._send_done_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, pcm, "200 press\n1200 release\n", handler,
+                    extra_args=("--rssi", "-80"))
+
+    assert proc.returncode == 0, proc.stderr
+    assert "uplink=ADPCM/2" in proc.stdout
+    fmt = received["fmt"]
+    assert fmt.codec == srv.CODEC_IMA_ADPCM
+    assert fmt.sample_rate == SAMPLE_RATE // 2
+    # ~4 s of audio at 8 kHz, 16-bit after decoding
+    assert len(received["pcm"]) >= 4 * 8000 * 2 * 0.9
+
+
+def test_sim_stops_when_server_hears_end(tmp_path, monkeypatch):
+    """The server's stop cuts the grace period after release short."""
+    pcm = generate_pcm_sine(duration=1.0) + bytes(SAMPLE_RATE * 2 * 5)
+    received = {}
+
+    def handler(pcm, fmt, link):
+        received["pcm"] = pcm
+        srv._send_done_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, pcm, "100 press\n1300 release\n", handler,
+                    endpoint_silence_ms=srv.ENDPOINT_SILENCE_MS)
+
+    assert proc.returncode == 0, proc.stderr
+    assert "endpoint=server" in proc.stdout
+    wait_ms = float(proc.stdout.split("wait_ms=")[1].split()[0])
+    assert wait_ms < 2000  # instead of the 3 s grace period
+    assert len(received["pcm"]) < 3 * SAMPLE_RATE * 2
+
+
+def test_sim_ignores_stop_crossing_end_marker(tmp_path, monkeypatch):
+    """A stop sent as the end marker arrives doesn't drop the device before its reply."""
+    def handler(pcm, fmt, link):
+        link.sendall(bytes([srv.MSG_STOP]))  # the endpointer fired just too late
+        time.sleep(0.2)
+        srv._send_playing_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, bytes(2 * SAMPLE_RATE), "100 press\n400 release\n", handler)
+
+    assert proc.returncode == 0, proc.stderr
+    assert "Unexpected recv result" not in proc.stdout + proc.stderr
+    assert "interaction=1" in proc.stdout and "early=1" in proc.stdout
+
+
+def test_sim_cancels_echo_from_reference(tmp_path, monkeypatch):
+    """REF frames sent while the server 'plays' drive the device's echo canceller."""
+    pcm = generate_pcm_sine(duration=6.0)
+    ref = generate_pcm_sine(duration=1.0)
+
+    def handler(pcm, fmt, link):
+        streamer = srv.ReferenceStreamer(link, ref, srv.DEFAULT_FORMAT, _FakeSpeaker())
+        streamer.start()
+        streamer.join(timeout=5)
+        srv._send_done_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, pcm, "200 press\n700 release\n", handler)
+
+    assert proc.returncode == 0, proc.stderr
+    assert "erle_db=" in proc.stdout
+
+
+def test_sim_released_when_playback_starts(tmp_path, monkeypatch):
+    """A PLAYING byte frees the device just like DONE, flagged as early."""
+    def handler(pcm, fmt, link):
+        srv._send_playing_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, bytes(2 * SAMPLE_RATE), "100 press\n400 release\n", handler)
+
+    assert proc.returncode == 0, proc.stderr
+    assert "interaction=1" in proc.stdout and "early=1" in proc.stdout
+
+
+def test_sim_wake_word_sends_preroll(tmp_path, monkeypatch):
+    """The wake word starts an interaction that includes audio from before it."""
+    subprocess.run([WAKE_TOOL, "--demo", str(tmp_path)], check=True, timeout=30)
+    with wave.open(str(tmp_path / "demo.wav"), "rb") as wf:
+        demo = wf.readframes(wf.getnframes())
+    received = {}
+
+    def handler(pcm, fmt, link):
+        received["pcm"], received["fmt"] = pcm, fmt
+        srv._send_done_and_close(link)
+
+    proc = _run_sim(tmp_path, monkeypatch, demo, "", handler,
+                    extra_args=("--wake-model", str(tmp_path / "model.bin")))
+
+    assert proc.returncode == 0, proc.stderr
+    assert "trigger=wake" in proc.stdout
+    got = received["pcm"]
+    # The stream starts with pre-roll from before the keyword (at 1.0 s) and
+    # ends on silence well before the WAV does
+    start = demo.find(got[:8000])
+    assert 0 <= start < 1 * SAMPLE_RATE * 2
+    assert 2.5 * SAMPLE_RATE * 2 < len(got) < 5.5 * SAMPLE_RATE * 2
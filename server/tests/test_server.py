@@ -1,8 +1,10 @@
 """Offline tests for the Kenta server — no API keys or hardware needed."""
 
+import asyncio
 import io
 import math
 import os
+import queue
 import socket
 import struct
 import tempfile
@@ -11,6 +13,7 @@ import time
 import wave
 from functools import partial
 from http.server import HTTPServer, SimpleHTTPRequestHandler
+from urllib.error import HTTPError
 from urllib.request import urlopen
 
 import pytest
@@ -94,6 +97,354 @@ class TestPcmToWav:
 
         assert decoded == pcm
 
+    def test_negotiated_format(self):
+        """pcm_to_wav() writes the header for whatever format was negotiated."""
+        fmt = srv.AudioFormat(sample_rate=24000, sample_width=3)
+        wav_buf = srv.pcm_to_wav(b"\x00\x01\x02" * 100, fmt)
+
+        with wave.open(wav_buf, "rb") as wf:
+            assert wf.getframerate() == 24000
+            assert wf.getsampwidth() == 3
+            assert wf.getnframes() == 100
+
+    def test_reads_across_header_and_payload(self):
+        """Small reads and seeks see header and PCM as one file, sized for the upload."""
+        pcm = bytearray(generate_pcm_sine(duration=0.01))
+        wav = srv.pcm_to_wav(memoryview(pcm))
+
+        assert wav.seek(0, io.SEEK_END) == 44 + len(pcm)
+        wav.seek(40)
+        assert wav.read(8) == struct.pack("<I", len(pcm)) + pcm[:4]
+        wav.seek(0)
+        data = b"".join(iter(lambda: wav.read(7), b""))
+        assert data == srv.wav_header(srv.DEFAULT_FORMAT, len(pcm)) + pcm
+
+
+# ---------------------------------------------------------------------------
+# Silence trimming
+# ---------------------------------------------------------------------------
+class TestTrimSilence:
+    def test_cuts_both_ends_with_padding(self):
+        speech = generate_pcm_sine(duration=1.0)
+        pcm = bytes(SAMPLE_RATE * 2) + speech + bytes(SAMPLE_RATE * 2 * 3)
+        trimmed, seconds = srv.trim_silence(pcm, srv.DEFAULT_FORMAT, pad_ms=200)
+        assert trimmed == bytes(SAMPLE_RATE * 2 // 5) + speech + bytes(SAMPLE_RATE * 2 // 5)
+        assert seconds == pytest.approx(1.0 + 3.0 - 0.4)
+
+    def test_all_quiet_kept_whole(self):
+        pcm = bytes(SAMPLE_RATE * 2)
+        assert srv.trim_silence(pcm, srv.DEFAULT_FORMAT) == (pcm, 0.0)
+
+    def test_24_bit_cut_on_sample_boundaries(self):
+        fmt = srv.AudioFormat(sample_width=3)
+        speech = b"".join(b"\x00" + generate_pcm_sine(duration=0.5)[i : i + 2]
+                          for i in range(0, SAMPLE_RATE, 2))
+        pcm = bytes(3 * SAMPLE_RATE) + speech + bytes(3 * SAMPLE_RATE)
+        trimmed, seconds = srv.trim_silence(pcm, fmt, pad_ms=0)
+        assert trimmed == speech
+        assert seconds == pytest.approx(2.0)
+
+    def test_numpy_matches_python(self):
+        np = pytest.importorskip("numpy")
+        pcm16 = bytes(3200) + generate_pcm_sine(duration=0.3) + bytes(6400)
+        min_power = 100.0 ** 2
+        assert srv._loud_span_numpy(np, pcm16, 160, min_power) == \
+            srv._loud_span_python(pcm16, 160, min_power)
+
+    def test_batch_upload_is_trimmed(self, monkeypatch):
+        uploaded = []
+
+        def fake_transcribe(wav):
+            with wave.open(wav) as wf:
+                uploaded.append(wf.getnframes())
+            return "hello"
+
+        monkeypatch.setattr(srv, "transcribe_audio", fake_transcribe)
+        monkeypatch.setattr(srv, "UPLOAD_CODEC", "wav")
+        transcriber = srv.BatchTranscriber()
+        speech, grace = generate_pcm_sine(duration=1.0), bytes(SAMPLE_RATE * 2 * 3)
+        transcriber.feed(speech, srv.DEFAULT_FORMAT)
+        transcriber.feed(grace, srv.DEFAULT_FORMAT)
+        assert transcriber.finish(memoryview(speech + grace)) == "hello"
+        assert uploaded == [SAMPLE_RATE * (1000 + srv.TRIM_PAD_MS) // 1000]
+
+
+# ---------------------------------------------------------------------------
+# Upload encoding
+# ---------------------------------------------------------------------------
+class _BitReader:
+    def __init__(self, data: bytes, pos: int):
+        self.data, self.bit = data, pos * 8
+
+    def read(self, n: int) -> int:
+        value = 0
+        for _ in range(n):
+            value = (value << 1) | (self.data[self.bit >> 3] >> (7 - (self.bit & 7)) & 1)
+            self.bit += 1
+        return value
+
+    def signed(self, n: int) -> int:
+        value = self.read(n)
+        return value - (1 << n) if value >> (n - 1) else value
+
+
+def flac_decode_reference(data: bytes) -> tuple[int, int, list[int]]:
+    """Decode what encode_flac() writes; returns (rate, bits, samples). Checks both CRCs."""
+    assert data[:4] == b"fLaC" and data[4:8] == b"\x80\x00\x00\x22"
+    info = int.from_bytes(data[18:26], "big")
+    rate, bps, total = info >> 44, ((info >> 36) & 0x1F) + 1, info & ((1 << 36) - 1)
+    fixed = ((), (1,), (2, -1), (3, -3, 1), (4, -6, 4, -1))
+    samples, pos = [], 42
+    while len(samples) < total:
+        bits = _BitReader(data, pos)
+        assert bits.read(32) == 0xFFF87000
+        lead = bits.read(8)
+        for _ in range(8 - (~lead & 0xFF).bit_length() - 1 if lead & 0x80 else 0):
+            bits.read(8)
+        n = bits.read(16) + 1
+        assert bits.read(8) == srv._crc8(data[pos : (bits.bit >> 3) - 1])
+        assert bits.read(1) == 0
+        kind = bits.read(6)
+        assert bits.read(1) == 0
+        if kind == 0:
+            x = [bits.signed(bps)] * n
+        elif kind == 1:
+            x = [bits.signed(bps) for _ in range(n)]
+        else:
+            order = kind & 7
+            x = [bits.signed(bps) for _ in range(order)]
+            assert bits.read(6) == 0
+            k = bits.read(4)
+            for _ in range(n - order):
+                q = 0
+                while not bits.read(1):
+                    q += 1
+                u = (q << k) | bits.read(k)
+                residual = u >> 1 if u & 1 == 0 else -(u >> 1) - 1
+                x.append(residual + sum(c * x[-1 - j] for j, c in enumerate(fixed[order])))
+        end = (bits.bit + 7) >> 3
+        assert int.from_bytes(data[end : end + 2], "big") == srv._crc16(data[pos:end])
+        samples += x
+        pos = end + 2
+    assert pos == len(data)
+    return rate, bps, samples
+
+
+class TestUploadEncoding:
+    @staticmethod
+    def _speech(duration: float = 0.6) -> bytes:
+        """A tone with quiet stretches and a little noise."""
+        import random
+        rng = random.Random(5)
+        values = [int(12000 * math.sin(i / 9) * (i % 4000 < 2500) + rng.gauss(0, 40))
+                  for i in range(int(SAMPLE_RATE * duration))]
+        return struct.pack(f"<{len(values)}h", *values)
+
+    @pytest.mark.parametrize("width", [2, 3])
+    def test_flac_roundtrip(self, monkeypatch, width):
+        """FLAC decodes back to the exact samples and is much smaller than WAV."""
+        monkeypatch.setattr(srv, "kenta_dsp", None)
+        pcm = self._speech()
+        if width == 3:
+            pcm = b"".join(b"\x07" + pcm[i : i + 2] for i in range(0, len(pcm), 2))
+        fmt = srv.AudioFormat(sample_rate=24000, sample_width=width)
+        data = srv.encode_flac(pcm, fmt, block=1024)
+
+        rate, bps, samples = flac_decode_reference(data)
+        assert (rate, bps) == (24000, 8 * width)
+        assert b"".join(v.to_bytes(width, "little", signed=True) for v in samples) == pcm
+        assert len(data) < len(pcm) * 0.8
+
+    def test_flac_silence_and_short_block(self, monkeypatch):
+        monkeypatch.setattr(srv, "kenta_dsp", None)
+        pcm = bytes(2000) + b"\x01\x00\xff\xff\x05\x00"
+        _, _, samples = flac_decode_reference(srv.encode_flac(pcm, srv.DEFAULT_FORMAT, block=512))
+        assert samples == [0] * 1000 + [1, -1, 5]
+
+    def test_native_flac_matches_python(self, monkeypatch):
+        pytest.importorskip("kenta_dsp")
+        pcm = self._speech(1.0) + bytes(9000)
+        native = srv.encode_flac(pcm, srv.DEFAULT_FORMAT)
+        monkeypatch.setattr(srv, "kenta_dsp", None)
+        assert native == srv.encode_flac(pcm, srv.DEFAULT_FORMAT)
+
+    def test_opus_without_ffmpeg_sends_flac(self, monkeypatch):
+        monkeypatch.setattr(srv.shutil, "which", lambda name: None)
+        upload = srv.encode_upload(self._speech(), srv.DEFAULT_FORMAT, "opus")
+        assert upload.name == "audio.flac"
+        assert upload.read(4) == b"fLaC"
+
+    def test_opus_through_ffmpeg(self, monkeypatch, tmp_path):
+        """Opus is produced by the ffmpeg on PATH, reading raw PCM from stdin."""
+        ffmpeg = tmp_path / "ffmpeg"
+        ffmpeg.write_text('#!/bin/sh\necho "$@" > "$(dirname "$0")/args"\n'
+                          'printf OggS; wc -c | tr -d " "\n')
+        ffmpeg.chmod(0o755)
+        monkeypatch.setenv("PATH", f"{tmp_path}{os.pathsep}{os.environ['PATH']}")
+        pcm = self._speech(0.1)
+        upload = srv.encode_upload(pcm, srv.AudioFormat(sample_rate=8000), "opus")
+
+        assert upload.name == "audio.ogg"
+        assert upload.read().decode() == f"OggS{len(pcm)}\n"
+        args = (tmp_path / "args").read_text().split()
+        assert args[args.index("-f") + 1] == "s16le" and args[args.index("-ar") + 1] == "8000"
+        assert "libopus" in args
+
+    def test_batch_uploads_flac(self, monkeypatch):
+        uploads = []
+        monkeypatch.setattr(srv, "transcribe_audio", lambda f: uploads.append(f) or "hi")
+        monkeypatch.setattr(srv, "UPLOAD_CODEC", "flac")
+        transcriber = srv.BatchTranscriber()
+        transcriber.feed(self._speech(), srv.DEFAULT_FORMAT)
+
+        assert transcriber.finish(memoryview(self._speech())) == "hi"
+        assert uploads[0].name == "audio.flac"
+        assert flac_decode_reference(uploads[0].read())[2][:4] == \
+            list(struct.unpack("<4h", self._speech()[:8]))
+
+
+# ---------------------------------------------------------------------------
+# IMA ADPCM uplink codec
+# ---------------------------------------------------------------------------
+def adpcm_encode_reference(pcm: bytes) -> bytes:
+    """Straightforward IMA ADPCM encoder producing firmware-style blocks."""
+    samples = list(struct.unpack(f"<{len(pcm) // 2}h", pcm))
+    samples += [0] * (-len(samples) % srv.ADPCM_BLOCK_SAMPLES)
+    steps, index_table = srv._ADPCM_STEP_TABLE, srv._ADPCM_INDEX_TABLE
+    predictor, index = 0, 0
+    out = bytearray()
+    for start in range(0, len(samples), srv.ADPCM_BLOCK_SAMPLES):
+        out += struct.pack("<hBB", predictor, index, 0)
+        codes = []
+        for s in samples[start : start + srv.ADPCM_BLOCK_SAMPLES]:
+            step = steps[index]
+            diff, code = s - predictor, 0
+            if diff < 0:
+                code, diff = 8, -diff
+            delta = step >> 3
+            for bit, part in ((4, step), (2, step >> 1), (1, step >> 2)):
+                if diff >= part:
+                    code |= bit
+                    diff -= part
+                    delta += part
+            predictor = max(-32768, min(32767, predictor - delta if code & 8 else predictor + delta))
+            index = max(0, min(88, index + index_table[code]))
+            codes.append(code)
+        out += bytes(lo | (hi << 4) for lo, hi in zip(codes[::2], codes[1::2]))
+    return bytes(out)
+
+
+class TestAdpcm:
+    def test_decode_tracks_signal(self):
+        """Decoded ADPCM stays close to the original waveform."""
+        pcm = generate_pcm_sine(duration=0.2)
+        decoded = srv.adpcm_decode(adpcm_encode_reference(pcm))
+
+        orig = struct.unpack(f"<{len(pcm) // 2}h", pcm)
+        dec = struct.unpack(f"<{len(orig)}h", decoded[: len(pcm)])
+        err = max(abs(a - b) for a, b in zip(orig[100:], dec[100:]))
+        assert err < 2000  # 0.5 full-scale sine, 4-bit quantisation
+
+    def test_partial_block_ignored(self):
+        """A truncated trailing block is dropped rather than misdecoded."""
+        block = adpcm_encode_reference(bytes(2 * srv.ADPCM_BLOCK_SAMPLES))
+        decoded = srv.adpcm_decode(block + block[:10])
+        assert len(decoded) == 2 * srv.ADPCM_BLOCK_SAMPLES
+
+    def test_adpcm_stream(self):
+        """An ADPCM stream header yields decoded 16-bit PCM."""
+        header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, srv.STREAM_VERSION,
+                                        srv.CODEC_IMA_ADPCM, 4, 1, 8000)
+        payload = adpcm_encode_reference(generate_pcm_sine(duration=0.1))
+        decoder = srv.StreamDecoder()
+        pcm = decoder.feed(header + payload + END_MARKER)
+        fmt = decoder.fmt
+        decoder.close()
+
+        assert fmt.sample_rate == 8000
+        assert fmt.sample_width == 2
+        assert fmt.codec == srv.CODEC_IMA_ADPCM
+        assert len(pcm) == len(payload) // srv.ADPCM_BLOCK_BYTES * srv.ADPCM_BLOCK_SAMPLES * 2
+
+
+# ---------------------------------------------------------------------------
+# Native DSP module (server/native), checked against the Python fallbacks
+# ---------------------------------------------------------------------------
+def _noise(samples: int, width: int = 2, seed: int = 7) -> bytes:
+    import random
+    rng = random.Random(seed)
+    return rng.randbytes(samples * width)
+
+
+def _test_client():
+    spec = importlib.util.spec_from_file_location("test_client", _server_path.parent / "test_client.py")
+    module = importlib.util.module_from_spec(spec)  # type: ignore[arg-type]
+    spec.loader.exec_module(module)  # type: ignore[union-attr]
+    return module
+
+
+class TestNativeDsp:
+    @pytest.fixture(autouse=True)
+    def native(self):
+        return pytest.importorskip("kenta_dsp")
+
+    @staticmethod
+    def python(monkeypatch, module, fn, *args):
+        with monkeypatch.context() as m:
+            m.setattr(module, "kenta_dsp", None)
+            return fn(*args)
+
+    def test_adpcm_decode(self, monkeypatch):
+        data = adpcm_encode_reference(generate_pcm_sine(duration=0.2)) + _noise(500)
+        assert srv.adpcm_decode(data) == self.python(monkeypatch, srv, srv.adpcm_decode, data)
+
+    def test_24_to_16_bit(self, monkeypatch):
+        pcm = _noise(1001, width=3)
+        assert srv.pcm_to_16bit(pcm, 3) == self.python(monkeypatch, srv, srv.pcm_to_16bit, pcm, 3)
+
+    @pytest.mark.parametrize("rates", [(16000, 8000), (8000, 16000), (44100, 16000), (24000, 16000)])
+    def test_resample(self, monkeypatch, rates):
+        pcm = _noise(4410)
+        assert srv.resample_pcm16(pcm, *rates) == \
+            self.python(monkeypatch, srv, srv.resample_pcm16, pcm, *rates)
+
+    def test_trim_span(self, monkeypatch):
+        pcm = bytes(32000) + _noise(8000) + bytes(48000)
+        expected = self.python(monkeypatch, srv, srv.trim_silence, pcm, srv.DEFAULT_FORMAT)
+        assert srv.trim_silence(pcm, srv.DEFAULT_FORMAT) == expected
+        assert expected[1] > 0
+
+    def test_energy_vad(self, monkeypatch):
+        frames = [bytes(640), _noise(320), b"\x10\x00" * 320, b""]
+        native = srv.EnergyVad()
+        python = self.python(monkeypatch, srv, srv.EnergyVad)
+        got = [(native(f, 16000), native.floor_db) for f in frames]
+        with monkeypatch.context() as m:
+            m.setattr(srv, "kenta_dsp", None)
+            assert got == [(python(f, 16000), python.floor_db) for f in frames]
+
+    @pytest.mark.parametrize("width", [1, 2, 4])
+    def test_client_stereo_to_mono(self, monkeypatch, width):
+        client = _test_client()
+        pcm = _noise(2000, width)
+        assert client._stereo_to_mono(pcm, width) == \
+            self.python(monkeypatch, client, client._stereo_to_mono, pcm, width)
+
+    @pytest.mark.parametrize("widths", [(1, 2), (2, 1), (2, 3), (3, 2), (3, 4), (4, 2), (4, 3)])
+    def test_client_convert_width(self, monkeypatch, widths):
+        client = _test_client()
+        pcm = _noise(999, widths[0])
+        assert client._convert_sample_width(pcm, *widths) == \
+            self.python(monkeypatch, client, client._convert_sample_width, pcm, *widths)
+
+    def test_buffer_protocol(self, native):
+        pcm = _noise(100, width=3)
+        expected = native.convert_width(pcm, 3, 2)
+        assert native.convert_width(bytearray(pcm), 3, 2) == expected
+        assert native.convert_width(memoryview(pcm), 3, 2) == expected
+        with pytest.raises(ValueError):
+            native.convert_width(pcm, 3, 5)
+
 
 # ---------------------------------------------------------------------------
 # generate_pcm_sine helper
@@ -115,48 +466,813 @@ class TestGeneratePcmSine:
 
 
 # ---------------------------------------------------------------------------
-# receive_audio
+# Receiving the uplink (DeviceProtocol)
 # ---------------------------------------------------------------------------
+class _LoopThread:
+    """An event loop running in a background thread, for the asyncio servers."""
+
+    def __enter__(self):
+        self.loop = asyncio.new_event_loop()
+        self.thread = threading.Thread(target=self.loop.run_forever, daemon=True)
+        self.thread.start()
+        return self
+
+    def run(self, coro, timeout: float = 5):
+        return asyncio.run_coroutine_threadsafe(coro, self.loop).result(timeout)
+
+    def __exit__(self, *exc):
+        self.loop.call_soon_threadsafe(self.loop.stop)
+        self.thread.join(timeout=5)
+        self.loop.close()
+
+
+async def _close_server(server):
+    server.close()
+    await server.wait_closed()
+
+
+class _RecordingTranscriber(srv.Transcriber):
+    """Keeps what DeviceProtocol feeds it; finish() returns a key to the audio."""
+
+    def __init__(self, uplink: "_Uplink"):
+        self.uplink = uplink
+        self.pieces: list[bytes] = []
+        self.finished = False
+
+    def feed(self, pcm, fmt):
+        self.pieces.append(bytes(pcm))
+
+    def finish(self, pcm):
+        assert bytes(pcm) == b"".join(self.pieces)
+        self.finished = True
+        key = str(id(self))
+        self.uplink._pieces[key] = self.pieces
+        return key
+
+    def close(self):
+        if not self.finished:  # the stream was dropped
+            self.uplink._streams.put((b"", srv.DEFAULT_FORMAT, None))
+
+
+class _Uplink:
+    """The device server on a background loop, recording what each stream carried.
+
+    Devices connect with plain sockets; receive() returns (pcm, fmt, link)
+    for the next stream to end, with no audio and no link for a stream that
+    was dropped.  Endpointing is off unless *endpoint_silence_ms* is given.
+    """
+
+    def __init__(self, monkeypatch, endpoint_silence_ms: int = 0):
+        monkeypatch.setattr(srv, "make_transcriber", lambda: _RecordingTranscriber(self))
+        monkeypatch.setattr(srv, "ENDPOINT_SILENCE_MS", endpoint_silence_ms)
+        self._streams: queue.Queue = queue.Queue()
+        self._pieces: dict[str, list[bytes]] = {}
+        self.pieces: list[bytes] = []  # of the last stream received
+
+    def __enter__(self):
+        self._lt = _LoopThread().__enter__()
+        self.server = self._lt.run(srv.start_device_server("127.0.0.1", 0, self._on_utterance))
+        self.port = self.server.sockets[0].getsockname()[1]
+        return self
+
+    def __exit__(self, *exc):
+        self._lt.run(_close_server(self.server))
+        self._lt.__exit__(*exc)
+
+    def connect(self) -> socket.socket:
+        return socket.create_connection(("127.0.0.1", self.port))
+
+    def receive(self, timeout: float = 5):
+        pcm, fmt, link = self._streams.get(timeout=timeout)
+        return pcm, fmt, link
+
+    async def _on_utterance(self, key, fmt, link):
+        self.pieces = self._pieces.pop(key)
+        self._streams.put((b"".join(self.pieces), fmt, link))
+
+
 class TestReceiveAudio:
-    @staticmethod
-    def _make_socketpair() -> tuple[socket.socket, socket.socket]:
-        """Create a connected TCP socket pair via loopback."""
-        srv_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        srv_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-        srv_sock.bind(("127.0.0.1", 0))
-        srv_sock.listen(1)
-        port = srv_sock.getsockname()[1]
-
-        client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        client.connect(("127.0.0.1", port))
-        conn, _ = srv_sock.accept()
-        srv_sock.close()
-        return conn, client
-
-    def test_end_marker(self):
-        """receive_audio() correctly strips the 0xDEADBEEF end marker."""
-        conn, client = self._make_socketpair()
+    def test_end_marker(self, monkeypatch):
+        """The 0xDEADBEEF end marker is stripped and the link kept for the reply."""
         pcm = generate_pcm_sine(duration=0.1)
-
-        def send():
+        with _Uplink(monkeypatch) as uplink:
+            client = uplink.connect()
             client.sendall(pcm + END_MARKER)
+            result, fmt, link = uplink.receive()
+            srv._send_done_and_close(link)
             client.close()
 
-        threading.Thread(target=send, daemon=True).start()
-        result = srv.receive_audio(conn)
-        conn.close()
-
         assert result == pcm
+        assert fmt == srv.DEFAULT_FORMAT
 
-    def test_empty(self):
+    def test_empty(self, monkeypatch):
         """Handles client disconnect (no data) gracefully."""
-        conn, client = self._make_socketpair()
-        client.close()  # immediate disconnect
+        with _Uplink(monkeypatch) as uplink:
+            uplink.connect().close()  # immediate disconnect
+            result, _, link = uplink.receive()
+
+        assert result == b"" and link is None
+
+    def test_stream_header(self, monkeypatch):
+        """The stream header is stripped and its format returned."""
+        header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, srv.STREAM_VERSION,
+                                        srv.CODEC_PCM, 24, 1, 8000)
+        pcm = b"\x10\x20\x30" * 800
+        with _Uplink(monkeypatch) as uplink:
+            client = uplink.connect()
+            client.sendall(header + pcm + END_MARKER)
+            result, fmt, link = uplink.receive()
+            srv._send_done_and_close(link)
+            client.close()
+
+        assert result == pcm
+        assert fmt == srv.AudioFormat(sample_rate=8000, sample_width=3)
+
+    def test_unsupported_header_rejected(self, monkeypatch):
+        """A header announcing an unsupported rate yields no audio."""
+        header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, srv.STREAM_VERSION,
+                                        srv.CODEC_PCM, 16, 1, 44100)
+        with _Uplink(monkeypatch) as uplink:
+            client = uplink.connect()
+            client.sendall(header + generate_pcm_sine(duration=0.1) + END_MARKER)
+            result, _, link = uplink.receive()
+            client.close()
+
+        assert result == b"" and link is None
+
+    def test_audio_streams_in_pieces(self, monkeypatch):
+        """The transcriber sees the decoded audio as it arrives, adding up to the stream."""
+        pcm = generate_pcm_sine(duration=0.5)
+        with _Uplink(monkeypatch) as uplink:
+            client = uplink.connect()
+            for i in range(0, len(pcm), 1001):
+                client.sendall(pcm[i : i + 1001])
+                time.sleep(0.002)
+            client.sendall(END_MARKER)
+            result, _, link = uplink.receive()
+            srv._send_done_and_close(link)
+            client.close()
+
+        assert result == pcm
+        assert len(uplink.pieces) > 1
+
+
+class TestBufferPool:
+    def test_released_buffer_is_reused(self):
+        pool = srv.BufferPool(64, keep=2)
+        buf = pool.acquire()
+        pool.release(buf)
+
+        assert pool.acquire() is buf
+        assert len(buf) == 64
+        assert pool.allocated == 1
+
+    def test_viewed_buffer_is_not_reused(self):
+        """A view still held downstream keeps the buffer out of the pool."""
+        pool = srv.BufferPool(64, keep=2)
+        buf = pool.acquire()
+        view = memoryview(buf)[8:16]
+        pool.release(buf)
+
+        assert pool.acquire() is not buf
+        del view
+
+    def test_receive_reuses_one_buffer(self, monkeypatch):
+        """Back-to-back interactions are received into the same pooled buffer."""
+        pool = srv.BufferPool(srv.MAX_AUDIO_BUFFER, keep=2)
+        monkeypatch.setattr(srv, "uplink_buffers", pool)
+        pcm = generate_pcm_sine(duration=0.1)
+        with _Uplink(monkeypatch) as uplink:
+            for _ in range(3):
+                client = uplink.connect()
+                client.sendall(pcm + END_MARKER)
+                result, _, link = uplink.receive()
+                srv._send_done_and_close(link)
+                client.close()
+                assert result == pcm
+
+        assert pool.allocated == 1
+
+
+class TestStreamDecoder:
+    @staticmethod
+    def _feed_bytewise(stream: bytes) -> tuple[bytes, srv.StreamDecoder]:
+        decoder = srv.StreamDecoder()
+        out = bytearray()
+        for i in range(len(stream)):
+            out += decoder.feed(stream[i : i + 1])
+            if decoder.ended:
+                break
+        return bytes(out), decoder
+
+    def test_bytewise_matches_whole_stream(self):
+        """Feeding one byte at a time decodes the same PCM as the whole buffer."""
+        header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, srv.STREAM_VERSION,
+                                        srv.CODEC_PCM, 24, 1, 8000)
+        stream = header + b"\x10\x20\x30" * 100 + END_MARKER
+        out, decoder = self._feed_bytewise(stream)
+
+        assert decoder.ended
+        assert decoder.fmt == srv.AudioFormat(sample_rate=8000, sample_width=3)
+        assert out == b"\x10\x20\x30" * 100
+
+    def test_headerless_stream(self):
+        """Legacy streams without a header decode as DEFAULT_FORMAT."""
+        pcm = generate_pcm_sine(duration=0.05)
+        out, decoder = self._feed_bytewise(pcm + END_MARKER)
+
+        assert decoder.ended
+        assert decoder.fmt == srv.DEFAULT_FORMAT
+        assert out == pcm
+
+    def test_adpcm_blocks_decoded_as_they_complete(self):
+        """ADPCM audio comes out block by block, before the end marker."""
+        header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, srv.STREAM_VERSION,
+                                        srv.CODEC_IMA_ADPCM, 4, 1, 8000)
+        payload = adpcm_encode_reference(generate_pcm_sine(duration=0.1))
+        decoder = srv.StreamDecoder()
+        first = decoder.feed(header + payload[: srv.ADPCM_BLOCK_BYTES + 10])
+
+        assert len(first) == 2 * srv.ADPCM_BLOCK_SAMPLES
+        rest = decoder.feed(payload[srv.ADPCM_BLOCK_BYTES + 10 :] + END_MARKER)
+        assert decoder.ended
+        assert first + rest == srv.adpcm_decode(payload)
+
+
+# ---------------------------------------------------------------------------
+# Streaming transcription
+# ---------------------------------------------------------------------------
+def _assert_same_audio(got: bytes, expected: bytes):
+    """Same length, and equal up to the rounding of the interpolation positions."""
+    assert len(got) == len(expected)
+    got, expected = memoryview(got).cast("h"), memoryview(expected).cast("h")
+    assert max((abs(a - b) for a, b in zip(got, expected)), default=0) <= 1
+
+
+class TestStreamResampler:
+    @pytest.mark.parametrize("rates", [(16000, 24000), (8000, 24000), (12000, 24000),
+                                       (24000, 16000), (44100, 16000), (16000, 16000)])
+    def test_chunks_match_whole_buffer(self, rates):
+        import random
+        pcm = _noise(9001)
+        rng = random.Random(3)
+        resampler = srv.StreamResampler(*rates)
+        out, i = [], 0
+        while i < len(pcm):
+            step = 2 * rng.randint(1, 700)
+            out.append(resampler.feed(pcm[i : i + step]))
+            i += step
+        out.append(resampler.flush())
+        _assert_same_audio(b"".join(out), srv.resample_pcm16(pcm, *rates))
+
+    def test_realtime_appends_continuous_audio(self, monkeypatch):
+        import base64
+        import json
+        sent = []
+
+        class FakeSocket:
+            def send(self, message):
+                sent.append(json.loads(message))
+
+            def recv(self, timeout=None):
+                return json.dumps({"type": "conversation.item.input_audio_transcription.completed",
+                                   "transcript": " hello "})
+
+            def close(self):
+                pass
+
+        client = types.ModuleType("websockets.sync.client")
+        client.connect = lambda *args, **kwargs: FakeSocket()
+        monkeypatch.setitem(sys.modules, "websockets", types.ModuleType("websockets"))
+        monkeypatch.setitem(sys.modules, "websockets.sync", types.ModuleType("websockets.sync"))
+        monkeypatch.setitem(sys.modules, "websockets.sync.client", client)
+        monkeypatch.setenv("OPENAI_API_KEY", "unused")
+
+        pcm = generate_pcm_sine(duration=0.3)
+        stt = srv.RealtimeTranscriber()
+        for i in range(0, len(pcm), 642):  # not a whole 2:3 period
+            stt.feed(pcm[i : i + 642], srv.DEFAULT_FORMAT)
+        assert stt.finish(memoryview(pcm)) == "hello"
+
+        audio = b"".join(base64.b64decode(m["audio"]) for m in sent
+                         if m["type"] == "input_audio_buffer.append")
+        _assert_same_audio(audio, srv.resample_pcm16(pcm, SAMPLE_RATE, srv.OPENAI_REALTIME_RATE))
+        assert sent[-1] == {"type": "input_audio_buffer.commit"}
+
+
+class TestLocalTranscriber:
+    def test_transcribes_while_audio_arrives(self):
+        """Windows are decoded during the stream, so finish() only waits for the tail."""
+        window_s = srv.LOCAL_STT_WINDOW_S
+        calls = []
+
+        def slow_engine(pcm, fmt):
+            time.sleep(0.1)
+            calls.append(len(pcm))
+            return "word"
+
+        stt = srv.LocalTranscriber(engine=slow_engine)
+        pcm = generate_pcm_sine(duration=window_s * 4.5)
+        step = int(SAMPLE_RATE * SAMPLE_WIDTH * window_s / 4)
+        for i in range(0, len(pcm), step):
+            stt.feed(pcm[i : i + step], srv.DEFAULT_FORMAT)
+            time.sleep(0.03)
+
+        start = time.monotonic()
+        text = stt.finish(memoryview(pcm))
+        elapsed = time.monotonic() - start
+
+        assert text == " ".join(["word"] * 5)
+        assert sum(calls) == len(pcm)
+        # Four full windows were done during the stream; only the tail is left
+        assert elapsed < 0.3
+
+    def test_silence_is_empty(self):
+        stt = srv.LocalTranscriber()
+        silence = bytes(SAMPLE_RATE * SAMPLE_WIDTH)
+        stt.feed(silence, srv.DEFAULT_FORMAT)
+        assert stt.finish(memoryview(silence)) == ""
+
+
+class FakeWhisperModel:
+    """Stands in for faster_whisper.WhisperModel: records how it was built and called."""
+
+    instances = []
+
+    def __init__(self, model, **options):
+        self.model, self.options, self.audio = model, options, []
+        self.active = self.peak = 0
+        FakeWhisperModel.instances.append(self)
+
+    def transcribe(self, audio, **options):
+        self.active += 1
+        self.peak = max(self.peak, self.active)
+        time.sleep(0.02)
+        self.audio.append(audio)
+        self.active -= 1
+        return iter([types.SimpleNamespace(text=" hello"), types.SimpleNamespace(text=" world")]), None
+
+
+class TestWhisperBackends:
+    @pytest.fixture(autouse=True)
+    def fake_faster_whisper(self, monkeypatch):
+        FakeWhisperModel.instances = []
+        monkeypatch.setitem(sys.modules, "faster_whisper",
+                            types.SimpleNamespace(WhisperModel=FakeWhisperModel))
+        monkeypatch.setattr(srv, "_float_audio", bytes)  # numpy-free; the model sees PCM
+        monkeypatch.setattr(srv, "STT_BACKEND", "faster-whisper")
+        monkeypatch.setattr(srv, "stt_engine", None)
+
+    def test_model_is_loaded_once_as_int8(self):
+        srv.load_stt_engine("faster-whisper", "tiny")
+        for _ in range(3):
+            stt = srv.make_transcriber()
+            pcm = generate_pcm_sine(duration=0.5)
+            stt.feed(pcm, srv.DEFAULT_FORMAT)
+            assert stt.finish(memoryview(pcm)) == "hello world"
+        (model,) = FakeWhisperModel.instances
+        assert model.model == "tiny"
+        assert model.options["compute_type"] == "int8"
+        assert model.options["cpu_threads"] == srv.LOCAL_STT_THREADS
+        assert len(model.audio) == 3
+
+    def test_audio_is_resampled_to_16k(self, monkeypatch):
+        monkeypatch.setattr(srv, "TRIM_THRESHOLD_DB", 0)
+        pcm = srv.resample_pcm16(generate_pcm_sine(duration=0.5), SAMPLE_RATE, 24000)
+        srv.load_stt_engine("faster-whisper", "tiny")
+        stt = srv.make_transcriber()
+        stt.feed(pcm, srv.AudioFormat(sample_rate=24000))
+        stt.finish(memoryview(pcm))
+        (model,) = FakeWhisperModel.instances
+        assert model.audio == [srv.resample_pcm16(pcm, 24000, srv.WHISPER_RATE)]
+
+    def test_concurrent_utterances_share_the_worker_slots(self):
+        engine = srv.load_stt_engine("faster-whisper", "tiny")
+        threads = [threading.Thread(target=engine.transcribe, args=(bytes(3200),)) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        (model,) = FakeWhisperModel.instances
+        assert len(model.audio) == 4
+        assert model.peak == srv.LOCAL_STT_WORKERS
+
+    def test_missing_package_raises_import_error(self, monkeypatch):
+        monkeypatch.setitem(sys.modules, "faster_whisper", None)
+        with pytest.raises(ImportError):
+            srv.load_stt_engine("faster-whisper", "tiny")
+
+
+# ---------------------------------------------------------------------------
+# Server-side endpointing
+# ---------------------------------------------------------------------------
+class TestEndpointer:
+    def _feed(self, endpointer, pcm, chunk=1000):
+        """Feed *pcm* in pieces; return the time in ms at which it fired, if it did."""
+        for i in range(0, len(pcm), chunk):
+            if endpointer.feed(pcm[i : i + chunk], srv.DEFAULT_FORMAT):
+                return endpointer.position_ms
+        return None
+
+    def test_fires_after_trailing_silence(self):
+        endpointer = srv.Endpointer(silence_ms=500)
+        pcm = generate_pcm_sine(duration=1.0) + bytes(SAMPLE_RATE * 2)
+        assert self._feed(endpointer, pcm) == 1000 + 500
+        assert not endpointer.feed(bytes(SAMPLE_RATE), srv.DEFAULT_FORMAT)  # only once
+
+    def test_pause_shorter_than_silence_continues(self):
+        endpointer = srv.Endpointer(silence_ms=500)
+        speech = generate_pcm_sine(duration=0.5)
+        pause = bytes(SAMPLE_RATE * 2 * 300 // 1000)
+        pcm = speech + pause + speech + bytes(SAMPLE_RATE * 2)
+        assert self._feed(endpointer, pcm) == 500 + 300 + 500 + 500
+
+    def test_silence_alone_never_ends(self):
+        assert self._feed(srv.Endpointer(), bytes(SAMPLE_RATE * 2 * 3)) is None
+
+    def test_threshold_follows_background(self):
+        """In a noisier room, a sound that would otherwise count as speech doesn't."""
+
+        def tone(amplitude, duration):
+            n = int(SAMPLE_RATE * duration)
+            return struct.pack(f"<{n}h", *(int(amplitude * math.sin(2 * math.pi * 200 * i
+                                                                     / SAMPLE_RATE))
+                                           for i in range(n)))
+
+        frame = SAMPLE_RATE * srv.ENDPOINT_FRAME_MS // 1000 * 2
+        murmur = tone(795, 0.1)  # ~55 dB, over the initial threshold
+        assert srv.EnergyVad()(murmur[:frame], SAMPLE_RATE)
+
+        vad = srv.EnergyVad()
+        background = tone(316, 5.0)  # ~47 dB
+        for i in range(0, len(background), frame):
+            assert not vad(background[i : i + frame], SAMPLE_RATE)
+        assert not vad(murmur[:frame], SAMPLE_RATE)
+
+
+# ---------------------------------------------------------------------------
+# Asyncio device server
+# ---------------------------------------------------------------------------
+def _start_devices(lt: _LoopThread, utterances: list, got: threading.Event):
+    async def on_utterance(transcription, fmt, link):
+        utterances.append((transcription, fmt, link))
+        got.set()
+
+    server = lt.run(srv.start_device_server("127.0.0.1", 0, on_utterance))
+    return server, server.sockets[0].getsockname()[1]
+
+
+class TestDeviceServer:
+    def test_transcribes_and_keeps_downlink(self, monkeypatch):
+        """A finished stream yields its transcript and a link for the done byte."""
+        monkeypatch.setattr(srv, "STT_BACKEND", "local")
+        utterances, got = [], threading.Event()
+        with _LoopThread() as lt:
+            server, port = _start_devices(lt, utterances, got)
+            client = socket.create_connection(("127.0.0.1", port))
+            pcm = generate_pcm_sine(duration=1.0)
+            for i in range(0, len(pcm), 1000):
+                client.sendall(pcm[i : i + 1000])
+            client.sendall(END_MARKER)
+
+            assert got.wait(5)
+            transcription, fmt, link = utterances[0]
+            assert transcription == "speech speech"
+            assert fmt == srv.DEFAULT_FORMAT
+
+            srv._send_done_and_close(link)  # from outside the loop thread
+            client.settimeout(5)
+            assert client.recv(1) == srv.DONE_BYTE
+            assert client.recv(1) == b""
+            client.close()
+            lt.run(_close_server(server))
+
+    def test_rejected_header_closes_connection(self, monkeypatch):
+        monkeypatch.setattr(srv, "STT_BACKEND", "local")
+        utterances, got = [], threading.Event()
+        with _LoopThread() as lt:
+            server, port = _start_devices(lt, utterances, got)
+            client = socket.create_connection(("127.0.0.1", port))
+            header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, srv.STREAM_VERSION,
+                                            srv.CODEC_PCM, 16, 1, 44100)
+            client.sendall(header + bytes(1000))
+            client.settimeout(5)
+            assert client.recv(1) == b""
+            assert not utterances
+            client.close()
+            lt.run(_close_server(server))
+
+    def test_end_of_speech_stops_device(self, monkeypatch):
+        """A device announcing protocol 2 is told to stop once speech has ended."""
+        monkeypatch.setattr(srv, "STT_BACKEND", "local")
+        utterances, got = [], threading.Event()
+        with _LoopThread() as lt:
+            server, port = _start_devices(lt, utterances, got)
+            for version, expect_stop in ((srv.STREAM_VERSION_STOP, True), (1, False)):
+                client = socket.create_connection(("127.0.0.1", port))
+                header = srv.STREAM_HEADER.pack(srv.STREAM_MAGIC, version,
+                                                srv.CODEC_PCM, 16, 1, SAMPLE_RATE)
+                client.sendall(header + generate_pcm_sine(duration=0.5)
+                               + bytes(SAMPLE_RATE * 2))  # then 1 s of silence
+                client.settimeout(0.5)
+                try:
+                    stop = client.recv(1)
+                except socket.timeout:
+                    stop = b""
+                assert stop == (bytes([srv.MSG_STOP]) if expect_stop else b"")
+                client.close()
+            deadline = time.monotonic() + 5
+            while len(utterances) < 2 and time.monotonic() < deadline:
+                time.sleep(0.01)
+            lt.run(_close_server(server))
+
+    def test_batch_upload_reads_the_receive_buffer(self, monkeypatch):
+        """Each utterance reaches the upload as a view of the pooled buffer, never copied."""
+        pool = srv.BufferPool(srv.MAX_AUDIO_BUFFER, keep=2)
+        monkeypatch.setattr(srv, "uplink_buffers", pool)
+        monkeypatch.setattr(srv, "STT_BACKEND", "batch")
+        monkeypatch.setattr(srv, "TRIM_THRESHOLD_DB", 0)
+        uploads = []
+
+        def upload(transcriber, pcm):
+            uploads.append((pcm.obj, bytes(pcm)))
+            return "ok"
+
+        monkeypatch.setattr(srv.BatchTranscriber, "_transcribe", upload)
+        utterances, got = [], threading.Event()
+        pcm = generate_pcm_sine(duration=0.5)
+        with _LoopThread() as lt:
+            server, port = _start_devices(lt, utterances, got)
+            for _ in range(2):
+                got.clear()
+                client = socket.create_connection(("127.0.0.1", port))
+                for i in range(0, len(pcm), 1000):
+                    client.sendall(pcm[i : i + 1000])
+                client.sendall(END_MARKER)
+                assert got.wait(5)
+                srv._send_done_and_close(utterances[-1][2])
+                client.close()
+            lt.run(_close_server(server))
+
+        assert [audio for _, audio in uploads] == [pcm, pcm]
+        buffer = pool.acquire()
+        assert all(obj is buffer for obj, _ in uploads)
+        assert pool.allocated == 1
+
+    def test_threads_do_not_grow_with_devices(self, monkeypatch):
+        """Many open device connections share the loop and a bounded STT pool."""
+
+        class CountingTranscriber(srv.Transcriber):
+            def feed(self, pcm, fmt):
+                pass
+
+            def finish(self, pcm):
+                return "ok"
+
+        monkeypatch.setattr(srv, "make_transcriber", CountingTranscriber)
+        utterances, got = [], threading.Event()
+        with _LoopThread() as lt:
+            server, port = _start_devices(lt, utterances, got)
+            before = threading.active_count()
+            clients = [socket.create_connection(("127.0.0.1", port)) for _ in range(30)]
+            for c in clients:
+                c.sendall(generate_pcm_sine(duration=0.1))
+            time.sleep(0.3)
+            assert threading.active_count() - before <= srv.STT_WORKERS
+            for c in clients:
+                c.sendall(END_MARKER)
+            deadline = time.monotonic() + 5
+            while len(utterances) < 30 and time.monotonic() < deadline:
+                time.sleep(0.01)
+            assert len(utterances) == 30
+            for c in clients:
+                c.close()
+            lt.run(_close_server(server))
+
+
+# ---------------------------------------------------------------------------
+# Echo reference downlink
+# ---------------------------------------------------------------------------
+class _FakeSpeaker:
+    def __init__(self, state="PLAYING"):
+        self.state = state
+
+    def get_current_transport_info(self):
+        return {"current_transport_state": self.state}
+
+
+def _read_downlink(sock: socket.socket) -> list[tuple[int, bytes]]:
+    data = bytearray()
+    while chunk := sock.recv(4096):
+        data.extend(chunk)
+    msgs, i = [], 0
+    while i < len(data):
+        kind = data[i]
+        if kind == srv.MSG_REF:
+            (length,) = struct.unpack_from("<H", data, i + 1)
+            msgs.append((kind, bytes(data[i + 3 : i + 3 + length])))
+            i += 3 + length
+        else:
+            msgs.append((kind, b""))
+            i += 1
+    return msgs
 
-        result = srv.receive_audio(conn)
-        conn.close()
 
-        assert result == b""
+class TestReferenceStreamer:
+    def test_frames_then_done(self):
+        """REF frames carry the reference in order and DONE comes last."""
+        pcm = generate_pcm_sine(duration=0.1)
+        server_end, device_end = socket.socketpair()
+        streamer = srv.ReferenceStreamer(server_end, pcm, srv.DEFAULT_FORMAT, _FakeSpeaker())
+        streamer.start()
+        streamer.join(timeout=3)
+        streamer.stop()
+        srv._send_done_and_close(server_end)
+
+        msgs = _read_downlink(device_end)
+        device_end.close()
+
+        assert [k for k, _ in msgs] == [srv.MSG_REF] * 5 + [srv.DONE_BYTE[0]]
+        assert b"".join(p for _, p in msgs) == pcm
+        assert all(len(p) == SAMPLE_RATE * srv.REF_FRAME_MS // 1000 * 2 for _, p in msgs[:-1])
+
+    def test_stop_cuts_stream_short(self):
+        """stop() ends the stream early so DONE is never interleaved with REF."""
+        pcm = generate_pcm_sine(duration=5.0)
+        server_end, device_end = socket.socketpair()
+        streamer = srv.ReferenceStreamer(server_end, pcm, srv.DEFAULT_FORMAT, _FakeSpeaker())
+        streamer.start()
+        time.sleep(0.1)
+        streamer.stop()
+        srv._send_done_and_close(server_end)
+
+        msgs = _read_downlink(device_end)
+        device_end.close()
+
+        assert 1 <= streamer.frames_sent < 250
+        assert msgs[-1][0] == srv.DONE_BYTE[0]
+
+    def test_follows_a_reply_still_being_synthesized(self):
+        """A WAV artifact is resampled to the device's rate as it grows."""
+        tts_fmt = srv.AudioFormat(sample_rate=24000)
+        wav = srv.pcm_to_wav(generate_pcm_sine(duration=0.2), tts_fmt).read()
+        artifact = srv.TtsArtifact("reply", ".wav")
+        server_end, device_end = socket.socketpair()
+        streamer = srv.ReferenceStreamer(server_end, artifact, srv.DEFAULT_FORMAT, _FakeSpeaker())
+        streamer.start()
+        for chunk in _chunks(wav, 999):
+            time.sleep(0.005)
+            artifact.append(chunk)
+        artifact.finish()
+        streamer.join(timeout=3)
+        streamer.stop()
+        srv._send_done_and_close(server_end)
+
+        msgs = _read_downlink(device_end)
+        device_end.close()
+
+        assert {k for k, _ in msgs[:-1]} == {srv.MSG_REF}
+        _assert_same_audio(b"".join(p for _, p in msgs[:-1]),
+                           srv.load_reference(io.BytesIO(wav), srv.DEFAULT_FORMAT))
+
+    def test_load_reference_resamples(self, tmp_path):
+        """A 24 kHz TTS WAV is converted to the device's stream rate."""
+        path = tmp_path / "tts.wav"
+        pcm24 = bytes(2 * 24000)
+        with open(path, "wb") as f:
+            f.write(srv.pcm_to_wav(pcm24, srv.AudioFormat(sample_rate=24000)).read())
+
+        ref = srv.load_reference(str(path), srv.DEFAULT_FORMAT)
+        assert len(ref) == 2 * SAMPLE_RATE
+
+
+# ---------------------------------------------------------------------------
+# Sonos transport events
+# ---------------------------------------------------------------------------
+class _FakeSonosUpnp:
+    """A Sonos AVTransport event endpoint: accepts GENA subscriptions and
+    pushes transport states to the subscriber's callback.  Also answers
+    transport state polls like a SoCo, counting them."""
+
+    def __init__(self, accept=True):
+        self.accept = accept
+        self.ip_address = "127.0.0.1"
+        self.state = "STOPPED"
+        self.requests = []
+        self.callback = None
+        self.polls = 0
+
+    async def start(self):
+        self.server = await asyncio.start_server(self._handle, "127.0.0.1", 0)
+        self.port = self.server.sockets[0].getsockname()[1]
+        return self
+
+    async def _handle(self, reader, writer):
+        start, headers = srv._parse_http_head(await reader.readuntil(b"\r\n\r\n"))
+        self.requests.append((start[0], headers))
+        if not self.accept:
+            writer.write(b"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n")
+        elif start[0] == "SUBSCRIBE":
+            if "callback" in headers:
+                self.callback = headers["callback"].strip("<>")
+            writer.write(b"HTTP/1.1 200 OK\r\nSID: uuid:sub-1\r\nTIMEOUT: Second-1800\r\n"
+                         b"Content-Length: 0\r\n\r\n")
+        else:
+            writer.write(b"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n")
+        await writer.drain()
+        writer.close()
+
+    async def push(self, state, sid="uuid:sub-1") -> str:
+        """Send a NOTIFY with *state* to the subscriber; return its status code."""
+        self.state = state
+        last_change = (f'<Event xmlns="urn:schemas-upnp-org:metadata-1-0/AVT/">'
+                       f'<InstanceID val="0"><TransportState val="{state}"/></InstanceID></Event>')
+        body = ('<?xml version="1.0"?><e:propertyset xmlns:e="urn:schemas-upnp-org:event-1-0">'
+                '<e:property><LastChange>'
+                + last_change.replace("&", "&amp;").replace("<", "&lt;").replace(">", "&gt;")
+                + "</LastChange></e:property></e:propertyset>").encode()
+        host, _, path = self.callback.removeprefix("http://").partition("/")
+        hostname, _, port = host.partition(":")
+        reader, writer = await asyncio.open_connection(hostname, int(port))
+        writer.write((f"NOTIFY /{path} HTTP/1.1\r\nHOST: {host}\r\nNT: upnp:event\r\n"
+                      f"NTS: upnp:propchange\r\nSID: {sid}\r\nSEQ: 0\r\n"
+                      f"Content-Length: {len(body)}\r\n\r\n").encode() + body)
+        status = (await reader.readuntil(b"\r\n")).split()[1].decode()
+        writer.close()
+        return status
+
+    def get_current_transport_info(self):
+        self.polls += 1
+        return {"current_transport_state": self.state}
+
+
+class TestSonosEvents:
+    def _subscribe(self, lt, sonos):
+        lt.run(sonos.start())
+        # Callback port is only known once the HTTP server is listening
+        events = srv.SonosEvents("127.0.0.1", "", port=sonos.port)
+        httpd = lt.run(srv.start_http_server(0, srv.TtsStore(), "127.0.0.1", events=events))
+        events.callback_url = (f"http://127.0.0.1:{httpd.sockets[0].getsockname()[1]}"
+                               f"{srv.SONOS_EVENT_CALLBACK}")
+        lt.run(events.start())
+        return events, httpd
+
+    def test_done_pushed_without_polling(self, monkeypatch):
+        """Playback completion is seen as soon as the STOPPED event arrives."""
+        with _LoopThread() as lt:
+            sonos = _FakeSonosUpnp()
+            events, httpd = self._subscribe(lt, sonos)
+            monkeypatch.setattr(srv, "sonos_events", events)
+            assert events.active and events.sid == "uuid:sub-1"
+            assert sonos.requests[0][1]["nt"] == "upnp:event"
+
+            assert lt.run(sonos.push("PLAYING")) == "200"
+            done = threading.Event()
+            waiter = threading.Thread(target=lambda: (srv.wait_for_sonos_done(sonos), done.set()))
+            waiter.start()
+            time.sleep(0.3)
+            assert not done.is_set()
+
+            start = time.monotonic()
+            lt.run(sonos.push("STOPPED"))
+            assert done.wait(1)
+            assert time.monotonic() - start < 0.1
+            assert sonos.polls == 0
+            waiter.join()
+
+            lt.run(events.close())
+            assert sonos.requests[-1][0] == "UNSUBSCRIBE"
+            assert sonos.requests[-1][1]["sid"] == "uuid:sub-1"
+            lt.run(_close_server(httpd))
+            lt.run(_close_server(sonos.server))
+
+    def test_foreign_subscription_rejected(self):
+        with _LoopThread() as lt:
+            sonos = _FakeSonosUpnp()
+            events, httpd = self._subscribe(lt, sonos)
+            assert lt.run(sonos.push("PLAYING", sid="uuid:someone-else")) == "412"
+            assert events.state is None
+            lt.run(events.close())
+            lt.run(_close_server(httpd))
+            lt.run(_close_server(sonos.server))
+
+    def test_falls_back_to_polling(self, monkeypatch):
+        """Without a subscription, the transport state is polled."""
+        with _LoopThread() as lt:
+            sonos = _FakeSonosUpnp(accept=False)
+            events, httpd = self._subscribe(lt, sonos)
+            monkeypatch.setattr(srv, "sonos_events", events)
+            assert not events.active
+
+            sonos.state = "PLAYING"
+            threading.Timer(0.3, setattr, (sonos, "state", "STOPPED")).start()
+            start = time.monotonic()
+            srv.wait_for_sonos_done(sonos)
+            assert 0.3 <= time.monotonic() - start < 1
+            assert sonos.polls > 1
+            lt.run(events.close())
+            lt.run(_close_server(httpd))
+            lt.run(_close_server(sonos.server))
 
 
 # ---------------------------------------------------------------------------
@@ -231,13 +1347,13 @@ def test_http_server():
 def test_conversation_history_timeout(monkeypatch):
     """History clears after the inactivity threshold is exceeded."""
     # Reset history state
-    srv.conversation_history.clear()
-    srv.last_message_time = 0.0
+    srv.conversations.clear()
+    conversation = srv.get_conversation(srv.DEFAULT_SESSION)
 
     # Pretend a message was sent long ago
-    srv.conversation_history.append({"role": "user", "content": "old message"})
-    srv.conversation_history.append({"role": "assistant", "content": "old reply"})
-    srv.last_message_time = time.time() - srv.HISTORY_TIMEOUT - 1
+    conversation._push({"role": "user", "content": "old message"})
+    conversation._push({"role": "assistant", "content": "old reply"})
+    conversation.last_message_time = time.time() - srv.HISTORY_TIMEOUT - 1
 
     # Stub out the OpenAI API call
     class FakeChoice:
@@ -263,6 +1379,764 @@ def test_conversation_history_timeout(monkeypatch):
 
     assert reply == "mocked reply"
     # History should contain only the new exchange (old ones cleared)
-    assert len(srv.conversation_history) == 2
-    assert srv.conversation_history[0]["content"] == "new message"
-    assert srv.conversation_history[1]["content"] == "mocked reply"
+    assert len(conversation.messages) == 2
+    assert conversation.messages[0]["content"] == "new message"
+    assert conversation.messages[1]["content"] == "mocked reply"
+
+
+def test_sessions_do_not_block_each_other(monkeypatch):
+    """Slow replies in one session don't hold up another, and histories stay apart."""
+    srv.conversations.clear()
+
+    class SlowCompletions:
+        def create(self, messages, **kwargs):
+            time.sleep(0.3)
+            reply = f"reply to {messages[-1]['content']}"
+            return types.SimpleNamespace(
+                choices=[types.SimpleNamespace(message=types.SimpleNamespace(content=reply))])
+
+    monkeypatch.setattr(srv, "client", types.SimpleNamespace(
+        chat=types.SimpleNamespace(completions=SlowCompletions())))
+
+    start = time.monotonic()
+    threads = [threading.Thread(target=srv.chat_completion, args=(f"q{i}", f"room{i}"))
+               for i in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert time.monotonic() - start < 0.3 * 2
+    for i in range(4):
+        assert [m["content"] for m in srv.get_conversation(f"room{i}").messages] == \
+            [f"q{i}", f"reply to q{i}"]
+
+
+class TestConversationStore:
+    def test_survives_restart(self, tmp_path):
+        db = str(tmp_path / "history.db")
+        conversation = srv.Conversation("kitchen", srv.ConversationStore(db))
+        _, turn = conversation.begin("What is hygge?")
+        conversation.commit("What is hygge?", "Cosiness.", turn)
+        conversation.store.close()
+
+        restored = srv.Conversation("kitchen", srv.ConversationStore(db))
+        assert list(restored.messages) == list(conversation.messages)
+        assert srv.Conversation("bedroom", restored.store).messages == srv.deque()
+
+    def test_wal_mode(self, tmp_path):
+        store = srv.ConversationStore(str(tmp_path / "history.db"))
+        assert store._db.execute("PRAGMA journal_mode").fetchone()[0] == "wal"
+
+    def test_loads_only_recent_tail(self):
+        store = srv.ConversationStore(":memory:")
+        now = time.time()
+        for i in range(100):
+            store.append("s", [{"role": "user", "content": f"q{i}"},
+                               {"role": "assistant", "content": f"a{i}"}], now)
+        restored = srv.Conversation("s", store)
+        assert len(restored.messages) == srv.MAX_HISTORY_MESSAGES
+        assert restored.messages[-1]["content"] == "a99"
+        assert restored.messages[0]["role"] == "user"
+
+    def test_restore_stops_at_inactivity_gap(self):
+        store = srv.ConversationStore(":memory:")
+        now = time.time()
+        store.append("s", [{"role": "user", "content": "last night"},
+                           {"role": "assistant", "content": "old"}], now - 2 * srv.HISTORY_TIMEOUT)
+        store.append("s", [{"role": "user", "content": "just now"},
+                           {"role": "assistant", "content": "new"}], now)
+        restored = srv.Conversation("s", store)
+        assert [m["content"] for m in restored.messages] == ["just now", "new"]
+
+    def test_compact_keeps_recent_messages(self):
+        store = srv.ConversationStore(":memory:")
+        for session in ("a", "b"):
+            for i in range(30):
+                store.append(session, [{"role": "user", "content": f"q{i}"},
+                                       {"role": "assistant", "content": f"a{i}"}], time.time())
+        store.compact(keep=10)
+        assert store._db.execute("SELECT COUNT(*) FROM messages").fetchone()[0] == 20
+        assert store.load("a", 100)[-1][1] == "a29"
+
+
+def test_history_trimmed_in_pairs():
+    conversation = srv.Conversation()
+    for i in range(srv.MAX_HISTORY_MESSAGES):
+        _, turn = conversation.begin(f"q{i}")
+        conversation.commit(f"q{i}", f"a{i}", turn)
+
+    assert len(conversation.messages) == srv.MAX_HISTORY_MESSAGES
+    assert conversation.messages[0] == {"role": "user", "content": f"q{srv.MAX_HISTORY_MESSAGES // 2}"}
+    assert conversation.messages[-1]["role"] == "assistant"
+
+
+class TestTokenBudget:
+    def _long_turns(self, conversation, count, words=60):
+        for i in range(count):
+            question = f"q{i} " + "word " * words
+            _, turn = conversation.begin(question)
+            conversation.commit(question, f"a{i} " + "word " * words, turn)
+
+    def _wait_summary(self, conversation):
+        deadline = time.monotonic() + 5
+        while (conversation._summarizing or not conversation.summary) \
+                and time.monotonic() < deadline:
+            time.sleep(0.01)
+
+    def test_prompt_bounded_and_summary_sent(self, monkeypatch):
+        monkeypatch.setattr(srv, "summarize_turns",
+                            lambda summary, turns: f"{len(turns)} messages")
+        conversation = srv.Conversation()
+        self._long_turns(conversation, 40)
+        self._wait_summary(conversation)
+
+        messages, _ = conversation.begin("next")
+        history = messages[2:-1]
+        assert sum(srv.count_tokens(m["content"]) for m in history) <= srv.HISTORY_TOKEN_BUDGET
+        assert history[0]["role"] == "user"
+        assert history[-1]["content"].startswith("a39")
+        assert messages[1]["role"] == "system" and "messages" in messages[1]["content"]
+        assert conversation.history_tokens == sum(conversation.tokens)
+
+    def test_summary_does_not_block_turns(self, monkeypatch):
+        release = threading.Event()
+
+        def slow_summary(summary, turns):
+            release.wait(5)
+            return "we talked about words"
+
+        monkeypatch.setattr(srv, "summarize_turns", slow_summary)
+        conversation = srv.Conversation()
+        start = time.monotonic()
+        self._long_turns(conversation, 30)
+        assert time.monotonic() - start < 1
+        assert conversation._summarizing and not conversation.summary
+
+        release.set()
+        self._wait_summary(conversation)
+        assert conversation.summary == "we talked about words"
+        assert conversation.history_tokens <= srv.HISTORY_TOKEN_BUDGET
+
+    def test_tokens_counted_once_per_message(self, monkeypatch):
+        calls = []
+        count = srv.count_tokens
+        monkeypatch.setattr(srv, "count_tokens", lambda text: calls.append(text) or count(text))
+        conversation = srv.Conversation()
+        for i in range(5):
+            _, turn = conversation.begin(f"q{i}")
+            conversation.commit(f"q{i}", f"a{i}", turn)
+        assert len(calls) == 10
+
+    def test_failed_summary_keeps_history(self, monkeypatch):
+        def broken(summary, turns):
+            raise RuntimeError("API down")
+
+        monkeypatch.setattr(srv, "summarize_turns", broken)
+        conversation = srv.Conversation()
+        self._long_turns(conversation, 20)
+        deadline = time.monotonic() + 5
+        while conversation._summarizing and time.monotonic() < deadline:
+            time.sleep(0.01)
+        assert len(conversation.messages) == 40 and not conversation.summary
+
+
+# ---------------------------------------------------------------------------
+# OpenAI connection pool
+# ---------------------------------------------------------------------------
+def _response(stream, warm_up: bool = False):
+    """Stands in for an httpx.Response as seen by the response hook."""
+    headers = {srv.OPENAI_WARM_HEADER: "1"} if warm_up else {}
+    return types.SimpleNamespace(extensions={"network_stream": stream},
+                                 request=types.SimpleNamespace(headers=headers))
+
+
+class TestOpenAIConnections:
+    def test_reuse_counted_per_network_stream(self):
+        stats = srv.ConnectionStats()
+        first, second = object(), object()
+        for stream in (first, first, second, first, None):
+            stats.on_response(_response(stream))
+        assert (stats.requests, stats.reused) == (5, 2)
+        assert stats.stats() == "5 requests, 2 on reused connections (40%)"
+        assert stats.last_used > 0
+
+    def test_warm_up_is_not_traffic(self):
+        stats = srv.ConnectionStats()
+        warmed = object()
+        stats.on_response(_response(warmed, warm_up=True))
+        stats.on_response(_response(warmed, warm_up=True))
+        assert (stats.requests, stats.reused, stats.last_used) == (0, 0, 0.0)
+        stats.on_response(_response(warmed))  # the first question, on the warm connection
+        assert (stats.requests, stats.reused) == (1, 1)
+
+    def test_idle_pool_is_kept_alive_with_one_request(self, monkeypatch):
+        """A night without questions costs one warm-up per keep-alive period."""
+        clock = [1000.0]
+        warm_ups = []
+
+        class NightIsOver(Exception):
+            pass
+
+        def sleep(seconds):
+            clock[0] += seconds
+            if clock[0] > 1000 + 8 * 3600:
+                raise NightIsOver
+
+        monkeypatch.setattr(srv, "time", types.SimpleNamespace(monotonic=lambda: clock[0],
+                                                               sleep=sleep))
+        monkeypatch.setattr(srv, "warm_up_openai",
+                            lambda connections=srv.OPENAI_WARM_CONNECTIONS: warm_ups.append(connections))
+        monkeypatch.setattr(srv, "openai_connections", srv.ConnectionStats())
+        with pytest.raises(NightIsOver):
+            srv.keep_openai_warm_forever()
+        assert warm_ups[0] == srv.OPENAI_WARM_CONNECTIONS
+        assert warm_ups[1:] == [1] * (8 * 3600 // srv.OPENAI_REWARM_IDLE)
+        assert srv.OPENAI_REWARM_IDLE < srv.OPENAI_KEEPALIVE_EXPIRY
+
+    def test_warm_up_runs_concurrently(self, monkeypatch):
+        calls = []
+
+        def retrieve(model, timeout, extra_headers):
+            calls.append((model, timeout, extra_headers))
+            time.sleep(0.2)
+
+        monkeypatch.setattr(srv, "client", types.SimpleNamespace(
+            models=types.SimpleNamespace(retrieve=retrieve)))
+        start = time.monotonic()
+        srv.warm_up_openai(3)
+        assert time.monotonic() - start < 0.4
+        assert calls == [(srv.OPENAI_MODEL_CHAT, srv.OPENAI_WARM_TIMEOUT,
+                          {srv.OPENAI_WARM_HEADER: "1"})] * 3
+
+
+# ---------------------------------------------------------------------------
+# Streamed replies
+# ---------------------------------------------------------------------------
+def _tokens(text: str, size: int = 3) -> list[str]:
+    return [text[i : i + size] for i in range(0, len(text), size)]
+
+
+class TestSplitSentences:
+    def test_sentences_from_token_stream(self):
+        text = "Hej means hello in Swedish. It is informal. You can use it with anyone!"
+        assert list(srv.split_sentences(_tokens(text))) == [
+            "Hej means hello in Swedish.",
+            "It is informal. You can use it with anyone!",
+        ]
+
+    def test_decimals_not_split(self):
+        text = "The answer is roughly 3.5 metres long. That is about eleven feet."
+        assert list(srv.split_sentences(_tokens(text))) == [
+            "The answer is roughly 3.5 metres long.",
+            "That is about eleven feet.",
+        ]
+
+    def test_run_on_sentence_cut_at_clause(self):
+        text = "word " * 30 + "and then, " + "more " * 30 + "end."
+        segments = list(srv.split_sentences(_tokens(text)))
+        assert len(segments) > 1
+        assert all(len(s) <= srv.MAX_SEGMENT_CHARS for s in segments)
+        assert " ".join(segments).split() == text.split()
+
+
+class _FakeStreamingClient:
+    """Chat client whose completions stream the given reply in small deltas."""
+
+    def __init__(self, reply: str):
+        ns = types.SimpleNamespace
+        self.chunks = [ns(choices=[ns(delta=ns(content=t))]) for t in _tokens(reply)]
+        self.chat = ns(completions=self)
+
+    def create(self, **kwargs):
+        assert kwargs["stream"] is True
+        return iter(self.chunks)
+
+
+def test_chat_completion_stream_updates_history(monkeypatch):
+    srv.conversations.clear()
+    monkeypatch.setattr(srv, "client", _FakeStreamingClient("Hello there. How are you?"))
+
+    deltas = list(srv.chat_completion_stream("hi", "kitchen"))
+
+    assert "".join(deltas) == "Hello there. How are you?"
+    assert list(srv.get_conversation("kitchen").messages) == [
+        {"role": "user", "content": "hi"},
+        {"role": "assistant", "content": "Hello there. How are you?"},
+    ]
+
+
+class _FakeLink:
+    """Stands in for DeviceLink: records the done (or playing) byte."""
+
+    def __init__(self, device: str, events: list):
+        self.device = device
+        self.events = events
+
+    def sendall(self, data: bytes):
+        self.events.append(("done" if data == srv.DONE_BYTE else "playing", self.device))
+
+    def close(self):
+        pass
+
+
+def _fake_stages(monkeypatch, events: list, llm_delay=0.1, tts_delay=0.05, play_delay=0.02,
+                 hold=None):
+    """Replace chat, TTS and Sonos with slow fakes that log what they do.
+
+    Each segment's audio is its text and a newline.  The fake Sonos logs
+    ("play_uri", name) when told to play, then follows that artifact like
+    the HTTP stream it is, logging ("play", text) for each sentence and
+    holding it for *play_delay*, or until *hold*(speaker) returns True
+    (stopped).
+    """
+    store = srv.TtsStore()
+    monkeypatch.setattr(srv, "tts_store", store)
+    hold = hold or (lambda speaker: time.sleep(play_delay))
+
+    def fake_chat(transcription, session):
+        for text in (f"{transcription} one.", f"{transcription} two.", f"{transcription} three."):
+            time.sleep(llm_delay)  # model still generating
+            events.append(("generated", text))
+            yield text
+
+    def fake_tts(text, wav=False):
+        time.sleep(tts_delay)
+        artifact = store.create(".wav" if wav else ".mp3")
+        artifact.append(f"{text}\n".encode())
+        artifact.finish()
+        return artifact
+
+    def fake_play(speaker, url):
+        name = url.rsplit("/", 1)[1]
+        speaker.reply = store.acquire(name)  # the Sonos fetching the stream
+        events.append(("play_uri", name))
+
+    def fake_wait(speaker):
+        reply, offset, done = speaker.reply, 0, False
+        try:
+            while not done:
+                data, done = reply.wait(offset, 5)
+                for text in data.decode().splitlines():
+                    events.append(("play", text))
+                    if hold(speaker):
+                        return
+                offset += len(data)
+        finally:
+            store.release(reply)
+
+    monkeypatch.setattr(srv, "chat_completion_stream", fake_chat)
+    monkeypatch.setattr(srv, "split_sentences", lambda deltas: deltas)
+    monkeypatch.setattr(srv, "text_to_speech", fake_tts)
+    monkeypatch.setattr(srv, "play_on_sonos", fake_play)
+    monkeypatch.setattr(srv, "wait_for_sonos_done", fake_wait)
+    return store
+
+
+def _played(events: list) -> list[str]:
+    return [e[1] for e in events if e[0] == "play"]
+
+
+def test_pipeline_starts_playback_before_reply_is_finished(monkeypatch):
+    """The first sentence plays while later ones are still being generated."""
+    events = []
+    store = _fake_stages(monkeypatch, events)
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        await pipeline.submit("Hi", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+
+    asyncio.run(run())
+
+    assert _played(events) == ["Hi one.", "Hi two.", "Hi three."]
+    assert events.index(("play", "Hi one.")) < events.index(("generated", "Hi three."))
+    assert events[-1] == ("done", "a")
+    assert len(store) == 0  # every segment and the reply released after playing
+
+
+def test_pipeline_plays_each_reply_as_one_stream(monkeypatch):
+    """All of a reply's sentences reach the Sonos through a single play_uri."""
+    events = []
+    _fake_stages(monkeypatch, events)
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        link = _FakeLink("a", events)
+        await asyncio.gather(pipeline.submit("Hi", srv.DEFAULT_FORMAT, link),
+                             pipeline.submit("Next", srv.DEFAULT_FORMAT, link))
+
+    asyncio.run(run())
+
+    uris = [i for i, e in enumerate(events) if e[0] == "play_uri"]
+    assert len(uris) == 2  # one per reply
+    assert events[uris[0]][1] != events[uris[1]][1]
+    assert uris[0] < events.index(("generated", "Hi two.")) < events.index(("play", "Hi two."))
+    assert _played(events[uris[1]:]) == ["Next one.", "Next two.", "Next three."]
+
+
+def test_wav_reply_is_one_wav(monkeypatch):
+    """With an echo reference the reply is one WAV of every segment's samples."""
+    events = []
+    store = _fake_stages(monkeypatch, events, llm_delay=0.01)
+    monkeypatch.setattr(srv, "AEC_REFERENCE", True)
+    monkeypatch.setattr(srv, "EARLY_DONE", "queue")  # no reference streamed
+    tts_fmt = srv.AudioFormat(sample_rate=srv.OPENAI_TTS_PCM_RATE)
+    segments = {}
+
+    def wav_tts(text, wav=False):
+        assert wav
+        segments[text] = generate_pcm_sine(freq=440 + 100 * len(segments), duration=0.05)
+        artifact = store.create(".wav")
+        data = srv.pcm_to_wav(segments[text], tts_fmt).read()
+        for chunk in _chunks(data, 333):  # odd sizes split samples and the header
+            artifact.append(chunk)
+        artifact.finish()
+        return artifact
+
+    replies = []
+
+    def fake_play(speaker, url):
+        replies.append(store.acquire(url.rsplit("/", 1)[1]))
+
+    monkeypatch.setattr(srv, "text_to_speech", wav_tts)
+    monkeypatch.setattr(srv, "play_on_sonos", fake_play)
+    monkeypatch.setattr(srv, "wait_for_sonos_done", lambda speaker: replies[0].wait_done(5))
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        await pipeline.submit("Hi", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+
+    asyncio.run(run())
+
+    [reply] = replies
+    assert reply.name.endswith(".wav")
+    with wave.open(io.BytesIO(reply.data), "rb") as wf:
+        assert wf.getframerate() == tts_fmt.sample_rate
+        assert wf.readframes(wf.getnframes()) == b"".join(segments.values())
+    store.release(reply)
+    assert len(store) == 0
+
+
+def test_early_done_releases_device_and_queues_next(monkeypatch):
+    """The device is freed when its reply starts; its next question plays after it."""
+    events = []
+    _fake_stages(monkeypatch, events)
+    monkeypatch.setattr(srv, "EARLY_DONE", "queue")
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        first = pipeline.submit("Hi", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+        while ("playing", "a") not in events:
+            await asyncio.sleep(0.01)
+        pipeline.interrupt("a")  # no effect when queueing
+        await pipeline.submit("Next", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+        await first
+
+    asyncio.run(run())
+
+    assert events[events.index(("playing", "a")) - 1][0] == "play_uri"
+    assert events.index(("playing", "a")) < events.index(("generated", "Hi three."))
+    assert ("done", "a") not in events
+    assert _played(events) == [
+        "Hi one.", "Hi two.", "Hi three.", "Next one.", "Next two.", "Next three."]
+
+
+def test_early_done_needs_the_reply_to_play(monkeypatch):
+    """A reply the Sonos refused doesn't release the device; it gets DONE."""
+    events = []
+    store = _fake_stages(monkeypatch, events)
+    monkeypatch.setattr(srv, "EARLY_DONE", "queue")
+
+    def refuse(speaker, url):
+        raise ConnectionError("Sonos unreachable")
+
+    monkeypatch.setattr(srv, "play_on_sonos", refuse)
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        await pipeline.submit("Hi", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+
+    asyncio.run(run())
+
+    assert ("playing", "a") not in events
+    assert events[-1] == ("done", "a")
+    assert ("generated", "Hi three.") in events  # the reply still finished
+    assert len(store) == 0
+
+
+def test_early_done_interrupt_stops_reply(monkeypatch):
+    """A new connection from the device cuts its playing reply short."""
+    events = []
+
+    class StoppableSpeaker:
+        def __init__(self):
+            self.stopped = threading.Event()
+            self.sentence_s = 2.0
+
+        def stop(self):
+            events.append(("stop", ""))
+            self.stopped.set()
+
+    def hold(speaker):
+        # A long sentence, unless stopped
+        if speaker.stopped.wait(speaker.sentence_s):
+            speaker.stopped.clear()
+            return True
+        return False
+
+    store = _fake_stages(monkeypatch, events, hold=hold)
+    monkeypatch.setattr(srv, "EARLY_DONE", "interrupt")
+
+    async def run():
+        pipeline = srv.Pipeline(StoppableSpeaker(), "127.0.0.1")
+        first = pipeline.submit("Hi", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+        while ("playing", "a") not in events:
+            await asyncio.sleep(0.01)
+        start = time.monotonic()
+        pipeline.interrupt("a")  # the device reconnected
+        await first
+        assert time.monotonic() - start < 1
+        pipeline.speaker.sentence_s = 0.02
+        await pipeline.submit("Next", srv.DEFAULT_FORMAT, _FakeLink("a", events))
+
+    asyncio.run(run())
+
+    assert _played(events) == ["Hi one.", "Next one.", "Next two.", "Next three."]
+    assert events.count(("stop", "")) == 1
+    deadline = time.monotonic() + 2
+    while len(store) and time.monotonic() < deadline:
+        time.sleep(0.01)
+    assert len(store) == 0  # skipped segments released too
+
+
+def test_pipeline_parallel_across_devices_ordered_within(monkeypatch):
+    """Another room's reply is prepared during playback; one room stays in order."""
+    events = []
+    _fake_stages(monkeypatch, events, llm_delay=0.05, play_delay=0.1)
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        kitchen, bedroom = _FakeLink("kitchen", events), _FakeLink("bedroom", events)
+        tasks = [
+            pipeline.submit("K1", srv.DEFAULT_FORMAT, kitchen),
+            pipeline.submit("K2", srv.DEFAULT_FORMAT, kitchen),
+            pipeline.submit("B1", srv.DEFAULT_FORMAT, bedroom),
+        ]
+        await asyncio.gather(*tasks)
+
+    asyncio.run(run())
+
+    # The bedroom reply was generated while the kitchen's first was playing
+    assert events.index(("generated", "B1 one.")) < events.index(("done", "kitchen"))
+    # The kitchen's second utterance only started after its first was answered
+    assert events.index(("done", "kitchen")) < events.index(("generated", "K2 one."))
+    # Replies never interleave on the speaker, and the kitchen's are in order
+    plays = [text.split()[0] for text in _played(events)]
+    replies = [plays[i] for i in range(0, len(plays), 3)]
+    assert plays == [r for r in replies for _ in range(3)]
+    assert sorted(replies) == ["B1", "K1", "K2"]
+    assert replies.index("K1") < replies.index("K2")
+
+
+def test_pipeline_forgets_idle_devices(monkeypatch):
+    """A device's lane lives only while it has utterances queued or running."""
+    events = []
+    _fake_stages(monkeypatch, events, llm_delay=0.01, play_delay=0.01)
+
+    async def run():
+        pipeline = srv.Pipeline(_FakeSpeaker(), "127.0.0.1")
+        tasks = [pipeline.submit("Hi", srv.DEFAULT_FORMAT, _FakeLink(f"peer{i}", events))
+                 for i in range(5)]
+        tasks.append(pipeline.submit("Again", srv.DEFAULT_FORMAT, _FakeLink("peer0", events)))
+        assert len(pipeline._lanes) == 5
+        await asyncio.gather(*tasks)
+        del tasks
+        return pipeline
+
+    pipeline = asyncio.run(run())
+    assert len(pipeline._lanes) == 0
+    assert events.count(("done", "peer0")) == 2
+
+
+# ---------------------------------------------------------------------------
+# Progressive TTS serving
+# ---------------------------------------------------------------------------
+class _FakeSpeechClient:
+    """TTS client whose responses trickle out in chunks with a delay."""
+
+    def __init__(self, chunks: list[bytes], delay: float = 0.05):
+        self.chunks = chunks
+        self.delay = delay
+        self.calls = 0
+        self.audio = types.SimpleNamespace(
+            speech=types.SimpleNamespace(with_streaming_response=self))
+
+    def create(self, **kwargs):
+        fake = self
+        self.calls += 1
+
+        class Response:
+            def __enter__(self):
+                return self
+
+            def __exit__(self, *exc):
+                return False
+
+            def iter_bytes(self):
+                for chunk in fake.chunks:
+                    time.sleep(fake.delay)
+                    yield chunk
+
+        return Response()
+
+
+def test_tts_served_while_still_synthesizing(monkeypatch):
+    """text_to_speech() returns after the first chunk and HTTP follows the artifact."""
+    chunks = [bytes([i]) * 1000 for i in range(10)]
+    store = srv.TtsStore()
+    monkeypatch.setattr(srv, "tts_store", store)
+    monkeypatch.setattr(srv, "tts_cache", srv.TtsCache())
+    monkeypatch.setattr(srv, "client", _FakeSpeechClient(chunks))
+
+    with _LoopThread() as lt:
+        httpd = lt.run(srv.start_http_server(0, store, host="127.0.0.1"))
+        port = httpd.sockets[0].getsockname()[1]
+
+        start = time.monotonic()
+        artifact = srv.text_to_speech("hello")
+        assert time.monotonic() - start < 0.3  # well before all 10 chunks
+        assert not artifact.done
+
+        resp = urlopen(f"http://127.0.0.1:{port}/{artifact.name}", timeout=5)
+        assert resp.headers["Content-Type"] == "audio/mpeg"
+        assert resp.read() == b"".join(chunks)
+        assert artifact.done
+
+        # Finished artifacts are served with a length
+        resp = urlopen(f"http://127.0.0.1:{port}/{artifact.name}", timeout=5)
+        assert int(resp.headers["Content-Length"]) == 10000
+        resp.read()
+
+        # Released by the caller once played (and by the HTTP handlers once
+        # they finish): gone from the store
+        store.release(artifact)
+        deadline = time.monotonic() + 5
+        while len(store) and time.monotonic() < deadline:
+            time.sleep(0.01)
+        assert len(store) == 0
+        with pytest.raises(HTTPError) as e:
+            urlopen(f"http://127.0.0.1:{port}/{artifact.name}", timeout=5)
+        assert e.value.code == 404
+        lt.run(_close_server(httpd))
+
+
+def test_streamed_wav_header_patched(monkeypatch):
+    """A streamed WAV gets its real length once synthesis completes."""
+    pcm = generate_pcm_sine(duration=0.2)
+    monkeypatch.setattr(srv, "tts_store", srv.TtsStore())
+    monkeypatch.setattr(srv, "tts_cache", srv.TtsCache())
+    monkeypatch.setattr(srv, "client", _FakeSpeechClient(_chunks(pcm, 1000), delay=0.01))
+
+    artifact = srv.text_to_speech("hello", wav=True)
+    artifact.wait_done(5)
+
+    with wave.open(io.BytesIO(artifact.data), "rb") as wf:
+        assert wf.getnframes() == len(pcm) // 2
+        assert wf.readframes(wf.getnframes()) == pcm
+
+
+def _chunks(data: bytes, size: int) -> list[bytes]:
+    return [data[i : i + size] for i in range(0, len(data), size)]
+
+
+class TestTtsStore:
+    def test_ids_are_unguessable(self):
+        store = srv.TtsStore()
+        a, b = store.create(".mp3"), store.create(".mp3")
+        assert a.name != b.name
+        assert len(a.id) >= 16
+
+    def test_reference_counting(self):
+        store = srv.TtsStore()
+        artifact = store.create(".mp3")
+        assert store.acquire(artifact.name) is artifact
+        store.release(artifact)
+        assert len(store) == 1  # creator still holds it
+        store.release(artifact)
+        assert store.acquire(artifact.name) is None
+
+    def test_ttl_evicts_leaked_artifacts(self):
+        store = srv.TtsStore(ttl=0.05)
+        leaked = store.create(".mp3")
+        time.sleep(0.1)
+        store.create(".mp3")
+        assert store.acquire(leaked.name) is None
+
+    def test_byte_budget_evicts_oldest_finished(self):
+        store = srv.TtsStore(max_bytes=1500)
+        old = store.create(".mp3")
+        old.append(bytes(1000))
+        old.finish()
+        growing = store.create(".mp3")
+        growing.append(bytes(1000))
+        store.create(".mp3")
+        assert store.acquire(old.name) is None
+        assert store.acquire(growing.name) is growing
+
+
+class TestTtsCache:
+    def test_hit_skips_synthesis(self, monkeypatch):
+        fake = _FakeSpeechClient([b"mp3" * 100], delay=0)
+        monkeypatch.setattr(srv, "client", fake)
+        monkeypatch.setattr(srv, "tts_store", srv.TtsStore())
+        monkeypatch.setattr(srv, "tts_cache", srv.TtsCache())
+
+        first = srv.text_to_speech("Sorry?")
+        first.wait_done(5)
+        second = srv.text_to_speech("Sorry?")
+
+        assert fake.calls == 1
+        assert second.done and second.data == first.data
+        assert second.name != first.name  # still a separate artifact
+        assert (srv.tts_cache.memory_hits, srv.tts_cache.misses) == (1, 1)
+
+    def test_key_covers_format_and_voice(self, monkeypatch):
+        mp3 = srv.TtsCache.key("hello", ".mp3")
+        assert mp3 != srv.TtsCache.key("hello", ".wav")
+        monkeypatch.setattr(srv, "OPENAI_TTS_VOICE", "alloy")
+        assert mp3 != srv.TtsCache.key("hello", ".mp3")
+
+    def test_memory_tier_is_lru_bounded(self):
+        cache = srv.TtsCache(memory_bytes=250)
+        cache.put("a", bytes(100))
+        cache.put("b", bytes(100))
+        cache.get("a")  # a is now the most recently used
+        cache.put("c", bytes(100))
+        assert cache.get("b") is None
+        assert cache.get("a") is not None and cache.get("c") is not None
+
+    def test_disk_tier_survives_restart(self, tmp_path):
+        srv.TtsCache(str(tmp_path)).put("k.mp3", b"audio")
+        cache = srv.TtsCache(str(tmp_path))
+        assert cache.get("k.mp3") == b"audio"
+        assert cache.get("k.mp3") == b"audio"
+        assert (cache.disk_hits, cache.memory_hits) == (1, 1)
+
+    def test_disk_tier_trimmed_oldest_first(self, tmp_path):
+        cache = srv.TtsCache(str(tmp_path), disk_bytes=250)
+        for i, key in enumerate(("a", "b", "c")):
+            cache.put(key, bytes(100))
+            os.utime(tmp_path / key, (i, i))
+        assert sorted(p.name for p in tmp_path.iterdir()) == ["b", "c"]
+
+    def test_prewarm(self, monkeypatch):
+        fake = _FakeSpeechClient([b"mp3"], delay=0)
+        monkeypatch.setattr(srv, "client", fake)
+        monkeypatch.setattr(srv, "tts_store", srv.TtsStore())
+        monkeypatch.setattr(srv, "tts_cache", srv.TtsCache())
+
+        srv.prewarm_tts_cache(srv.CANNED_PHRASES)
+        srv.prewarm_tts_cache(srv.CANNED_PHRASES)
+
+        assert fake.calls == len(srv.CANNED_PHRASES)
+        assert len(srv.tts_store) == 0